@@ -268,9 +268,9 @@ class BVH : public Accel<T> {
 
         bool intersect(const Ray& ray, Hit& isect) const {
             Vec3 invDir = 1.0f/(ray.direction);
-            if(std::abs(invDir.x) > ray.tmax) invDir.x += sign(invDir.x)*ray.tmax;
-            if(std::abs(invDir.y) > ray.tmax) invDir.y += sign(invDir.y)*ray.tmax;
-            if(std::abs(invDir.z) > ray.tmax) invDir.z += sign(invDir.z)*ray.tmax;
+            if(std::abs(invDir.x) > Ray::tfar) invDir.x += sign(invDir.x)*Ray::tfar;
+            if(std::abs(invDir.y) > Ray::tfar) invDir.y += sign(invDir.y)*Ray::tfar;
+            if(std::abs(invDir.z) > Ray::tfar) invDir.z += sign(invDir.z)*Ray::tfar;
             const int dirIsNeg[3] = {ray.direction.x < 0, ray.direction.y < 0, ray.direction.z < 0};
             return intersect(ray, isect, invDir, dirIsNeg);
         };
@@ -0,0 +1,186 @@
+#ifndef AOV_H
+#define AOV_H
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include "util.h"
+#include "vec3.h"
+#include "ray.h"
+#include "hit.h"
+#include "primitive.h"
+
+
+//カメラレイ1本分のAOV(Arbitrary Output Variables)
+//最初の衝突点の情報と 放射輝度の直接光と間接光への分割を持つ
+struct AOVSample {
+    bool hit = false;
+    //カメラ側に向けた法線
+    Vec3 normal;
+    float depth = 0.0f;
+    //光源と背景は1とする(デノイザーの特徴量と同じ)
+    RGB albedo = RGB(1.0f);
+    int primitiveId = -1;
+    int materialId = -1;
+    //光源から1回以内の反射でカメラに届いた寄与(光源そのものを含む)
+    RGB direct;
+    //それ以外の寄与
+    RGB indirect;
+
+
+    //カメラレイの最初の衝突点を記録する
+    void recordFirstHit(const Ray& ray, const Hit& res) {
+        hit = true;
+        normal = dot(res.hitNormal, ray.direction) > 0.0f ? -res.hitNormal : res.hitNormal;
+        depth = res.t;
+        primitiveId = res.hitPrimitive->id;
+        if(res.hitPrimitive->areaLight == nullptr) {
+            albedo = res.hitPrimitive->material->albedo();
+            materialId = res.hitPrimitive->material->id;
+        }
+    };
+    //光源からの反射回数bouncesの寄与Lを加える
+    void addRadiance(const RGB& L, int bounces) {
+        if(bounces <= 1)
+            direct += L;
+        else
+            indirect += L;
+    };
+};
+
+
+//ピクセルごとのAOVの蓄積バッファ
+//Filmと同じくタイルを処理するスレッドだけが書き込むので同期しない
+class AOVFilm {
+    public:
+        struct Pixel {
+            Vec3 normal_sum;
+            float depth_sum = 0.0f;
+            RGB albedo_sum;
+            RGB direct_sum;
+            RGB indirect_sum;
+            //何かに当たったサンプル数 法線と深度はこれで割る
+            int nhits = 0;
+            int nsamples = 0;
+            //最初に当たったサンプルのID
+            int primitiveId = -1;
+            int materialId = -1;
+        };
+
+        int width;
+        int height;
+        std::vector<Pixel> pixels;
+
+
+        AOVFilm(int _width, int _height) : width(_width), height(_height), pixels(_width*_height) {};
+
+
+        void addSample(int i, int j, const AOVSample& s) {
+            Pixel& pixel = pixels[i + width*j];
+            pixel.albedo_sum += s.albedo;
+            pixel.direct_sum += s.direct;
+            pixel.indirect_sum += s.indirect;
+            pixel.nsamples++;
+            if(s.hit) {
+                pixel.normal_sum += s.normal;
+                pixel.depth_sum += s.depth;
+                pixel.nhits++;
+                if(pixel.primitiveId < 0) {
+                    pixel.primitiveId = s.primitiveId;
+                    pixel.materialId = s.materialId;
+                }
+            }
+        };
+        void clear() {
+            std::fill(pixels.begin(), pixels.end(), Pixel());
+        };
+
+
+        //ピクセルの平均値 背景の法線は0 深度は0
+        Vec3 normal(int k) const {
+            const Pixel& p = pixels[k];
+            if(p.nhits == 0) return Vec3(0.0f);
+            const float len = p.normal_sum.length();
+            return len > 0.0f ? p.normal_sum/len : Vec3(0.0f);
+        };
+        float depth(int k) const {
+            const Pixel& p = pixels[k];
+            return p.nhits > 0 ? p.depth_sum/p.nhits : 0.0f;
+        };
+        RGB albedo(int k) const {
+            const Pixel& p = pixels[k];
+            return p.nsamples > 0 ? p.albedo_sum/p.nsamples : RGB(1.0f);
+        };
+
+
+        //prefixを付けたファイル名で各AOVを書き出す
+        //法線は[0, 1]に写し 深度は最大値で正規化し IDはハッシュした色にする
+        void ppm_output(const std::string& prefix) const {
+            const int n = width*height;
+            std::vector<RGB> img(n);
+
+            for(int k = 0; k < n; k++)
+                img[k] = (normal(k) + 1.0f)/2.0f;
+            write(prefix + "normal.ppm", img);
+
+            float maxDepth = 0.0f;
+            for(int k = 0; k < n; k++)
+                maxDepth = std::max(maxDepth, depth(k));
+            for(int k = 0; k < n; k++)
+                img[k] = RGB(maxDepth > 0.0f ? depth(k)/maxDepth : 0.0f);
+            write(prefix + "depth.ppm", img);
+
+            for(int k = 0; k < n; k++)
+                img[k] = gamma(albedo(k));
+            write(prefix + "albedo.ppm", img);
+
+            for(int k = 0; k < n; k++)
+                img[k] = idColor(pixels[k].primitiveId);
+            write(prefix + "primitive_id.ppm", img);
+
+            for(int k = 0; k < n; k++)
+                img[k] = idColor(pixels[k].materialId);
+            write(prefix + "material_id.ppm", img);
+
+            for(int k = 0; k < n; k++)
+                img[k] = pixels[k].nsamples > 0 ? gamma(pixels[k].direct_sum/pixels[k].nsamples) : RGB(0.0f);
+            write(prefix + "direct.ppm", img);
+
+            for(int k = 0; k < n; k++)
+                img[k] = pixels[k].nsamples > 0 ? gamma(pixels[k].indirect_sum/pixels[k].nsamples) : RGB(0.0f);
+            write(prefix + "indirect.ppm", img);
+        };
+
+
+    private:
+        static RGB gamma(const RGB& c) {
+            return RGB(std::pow(c.x, 1.0f/2.2f), std::pow(c.y, 1.0f/2.2f), std::pow(c.z, 1.0f/2.2f));
+        };
+        //IDごとに異なる色 背景(-1)は黒
+        static RGB idColor(int id) {
+            if(id < 0) return RGB(0.0f);
+            uint32_t h = (uint32_t)(id + 1)*2654435761u;
+            h ^= h >> 15;
+            h *= 2246822519u;
+            h ^= h >> 13;
+            return RGB((h & 0xff)/255.0f, ((h >> 8) & 0xff)/255.0f, ((h >> 16) & 0xff)/255.0f);
+        };
+        void write(const std::string& filename, const std::vector<RGB>& img) const {
+            std::ofstream file(filename);
+            file << "P3" << std::endl;
+            file << width << " " << height << std::endl;
+            file << 255 << std::endl;
+            for(int j = 0; j < height; j++) {
+                for(int i = 0; i < width; i++) {
+                    const RGB& c = img[i + width*j];
+                    file << (int)(255*clamp(c.x, 0.0f, 1.0f)) << " " << (int)(255*clamp(c.y, 0.0f, 1.0f)) << " " << (int)(255*clamp(c.z, 0.0f, 1.0f)) << std::endl;
+                }
+            }
+            file.close();
+            std::cout << filename << " written out" << std::endl;
+        };
+};
+#endif
@@ -0,0 +1,550 @@
+#ifndef BDPT_H
+#define BDPT_H
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+#include "integrator.h"
+
+
+enum class BDPT_VERTEX_TYPE {
+    CAMERA,
+    LIGHT,
+    SURFACE
+};
+
+
+//双方向パストレーシングの部分パスの頂点
+//pdfFwdは部分パスを生成した向きにこの頂点が選ばれる確率密度 pdfRevは逆向きに選ばれる確率密度
+//どちらも面積測度で 無限遠の頂点では立体角測度とする
+struct BDPTVertex {
+    BDPT_VERTEX_TYPE type;
+    //位置 無限遠の頂点では直前の頂点から見た方向
+    Vec3 p;
+    //法線と接ベクトル 非スペキュラーの表面では法線を到達した側に向ける
+    Vec3 n, s, t;
+    //直前の頂点に向かう方向
+    Vec3 wo;
+    const Material* material = nullptr;
+    //光源の頂点の光源 光源として扱われていない空ならnullptr
+    const Light* light = nullptr;
+    //部分パスの始点からこの頂点までの寄与 この頂点のBRDFは含まない
+    RGB beta;
+    //光源の頂点の放射輝度
+    RGB Le;
+    float pdfFwd = 0.0f;
+    float pdfRev = 0.0f;
+    //スペキュラーな頂点
+    bool delta = false;
+    //空あるいは平行光源の頂点
+    bool infinite = false;
+
+    BDPTVertex() : type(BDPT_VERTEX_TYPE::SURFACE) {};
+
+    bool onSurface() const {
+        if(type == BDPT_VERTEX_TYPE::SURFACE) return true;
+        return type == BDPT_VERTEX_TYPE::LIGHT && light && light->type == LIGHT_TYPE::AREA;
+    };
+    //他の部分パスの頂点と接続できるか
+    bool connectible() const {
+        if(type == BDPT_VERTEX_TYPE::SURFACE) return !delta;
+        if(type == BDPT_VERTEX_TYPE::LIGHT) return !infinite;
+        return true;
+    };
+    //位置がデルタ分布の光源か
+    bool isDeltaLight() const {
+        return type == BDPT_VERTEX_TYPE::LIGHT && light && light->isDelta();
+    };
+    Vec3 directionTo(const BDPTVertex& v) const {
+        return v.infinite ? v.p : normalize(v.p - p);
+    };
+};
+
+
+//双方向パストレーシング
+//カメラと光源の両側から部分パスを生成し 全ての頂点の組(s, t)を接続してMISの重み(パワーヒューリスティック)で足し合わせる
+//sは光源側 tはカメラ側の頂点数 光源側の頂点をカメラに直接接続した寄与(t = 1)はFilm::addSplatで該当するピクセルに加える
+//光源は一様に選び Scene::lightSamplerは使わない
+//光源は光を反射しないので 部分パスは光源に当たったところで終わる
+class BDPT : public TiledIntegrator {
+    public:
+        //(s, t)ごとのMISの重みをつけた寄与を画像として書き出すか
+        bool strategyImages = false;
+        //書き出す戦略のパスの深さ(反射回数)の上限
+        int strategyDepth = 5;
+
+        BDPT(std::shared_ptr<Camera> _cam, std::shared_ptr<Sampler> _sampler, int _pixelSamples, int _maxDepth) : TiledIntegrator(_cam, _sampler, _pixelSamples, _maxDepth) {};
+
+
+        void render(const Scene& scene) const {
+            if(strategyImages) {
+                const int depth = std::min(maxDepth, strategyDepth);
+                strategyFilms.clear();
+                strategyFilms.resize(depth + 3);
+                for(int s = 0; s <= depth + 2; s++) {
+                    strategyFilms[s].resize(depth + 3);
+                    for(int t = 1; s + t - 2 <= depth; t++) {
+                        if(s + t - 2 < 0 || (s == 1 && t == 1)) continue;
+                        strategyFilms[s][t] = std::unique_ptr<Film>(new Film(cam->film->width, cam->film->height, nullptr));
+                    }
+                }
+            }
+            //描画を始める時点のスレッド数で作り直す
+            subpaths = PerThread<Subpaths>();
+
+            TiledIntegrator::render(scene);
+
+            if(strategyImages) {
+                for(size_t s = 0; s < strategyFilms.size(); s++) {
+                    for(size_t t = 0; t < strategyFilms[s].size(); t++) {
+                        Film* film = strategyFilms[s][t].get();
+                        if(!film) continue;
+                        for(int j = 0; j < film->height; j++) {
+                            for(int i = 0; i < film->width; i++)
+                                film->setPixel(i, j, film->pixels[i + film->width*j].splat_sum/pixelSamples);
+                        }
+                        film->gamma_correction();
+                        film->ppm_output("bdpt_s" + std::to_string(s) + "_t" + std::to_string(t) + ".ppm");
+                    }
+                }
+            }
+        };
+
+
+        //光源側から辿ったパスはcamに接続するので camのビューだけを描画できる
+        RGB samplePixel(const Scene& scene, const View& view, int i, int j) const {
+            const float rx = sampler->getNext();
+            const float ry = sampler->getNext();
+            const Vec2 uv = view.cam->rasterToUV(i + rx, j + ry);
+            float w;
+            Ray ray = view.cam->getRay(uv.x, uv.y, w, *sampler, view.isLeft);
+            return Li(ray, scene, *view.film, w, i, j);
+        };
+        RGB radiance(const Ray& ray, const Scene& scene) const {
+            return Li(ray, scene, *cam->film, 1.0f, -1, -1);
+        };
+
+
+        //カメラレイrayのサンプルについて全ての戦略の寄与を計算する
+        //filmは光源側から辿ったパスの寄与を加えるフィルム
+        //wはカメラレイの重み (i, j)は戦略ごとの画像に書き込むピクセル
+        RGB Li(const Ray& ray, const Scene& scene, Film& film, float w, int i, int j) const {
+            //部分パスの配列はサンプルごとに確保せずスレッドごとに使い回す
+            Subpaths& paths = subpaths.get();
+            std::vector<BDPTVertex>& cameraPath = paths.cameraPath;
+            std::vector<BDPTVertex>& lightPath = paths.lightPath;
+            cameraPath.resize(maxDepth + 2);
+            lightPath.resize(maxDepth + 1);
+            const int nCamera = generateCameraSubpath(scene, ray, cameraPath);
+            const int nLight = generateLightSubpath(scene, lightPath);
+
+            RGB L;
+            for(int t = 1; t <= nCamera; t++) {
+                for(int s = 0; s <= nLight; s++) {
+                    const int depth = s + t - 2;
+                    if((s == 1 && t == 1) || depth < 0 || depth > maxDepth) continue;
+
+                    Vec2 raster;
+                    const RGB Lpath = connect(scene, lightPath, cameraPath, s, t, raster);
+                    if(iszero(Lpath) || isnan(Lpath) || isinf(Lpath)) continue;
+                    if(t == 1)
+                        film.addSplat(raster.x, raster.y, Lpath);
+                    else
+                        L += w*Lpath;
+
+                    if(!strategyFilms.empty() && i >= 0 && s < (int)strategyFilms.size() && t < (int)strategyFilms[s].size() && strategyFilms[s][t]) {
+                        if(t == 1)
+                            strategyFilms[s][t]->addSplat(raster.x, raster.y, Lpath);
+                        else
+                            strategyFilms[s][t]->addSplat(i, j, w*Lpath);
+                    }
+                }
+            }
+            return L;
+        };
+
+
+    private:
+        mutable std::vector<std::vector<std::unique_ptr<Film>>> strategyFilms;
+        //スレッドごとの部分パスの頂点の配列 頂点は生成するときに初期化される
+        struct Subpaths {
+            std::vector<BDPTVertex> cameraPath;
+            std::vector<BDPTVertex> lightPath;
+        };
+        mutable PerThread<Subpaths> subpaths;
+
+
+        int generateCameraSubpath(const Scene& scene, const Ray& ray, std::vector<BDPTVertex>& path) const {
+            BDPTVertex& v = path[0];
+            v = BDPTVertex();
+            v.type = BDPT_VERTEX_TYPE::CAMERA;
+            v.p = ray.origin;
+            v.beta = RGB(1.0f);
+            //カメラレイの重みはsamplePixelでかける
+            return randomWalk(scene, ray, RGB(1.0f), cam->pdfDir(ray.direction), TRANSPORT_MODE::RADIANCE, path);
+        };
+
+
+        int generateLightSubpath(const Scene& scene, std::vector<BDPTVertex>& path) const {
+            if(scene.lights.empty() || path.empty()) return 0;
+            float pmf;
+            const Light* light = chooseLight(scene, pmf);
+            Ray ray;
+            Vec3 normal;
+            float pdfPos, pdfDir;
+            const RGB le = light->sampleLe(*sampler, ray, normal, pdfPos, pdfDir);
+            if(pdfPos == 0.0f || pdfDir == 0.0f || iszero(le)) return 0;
+
+            BDPTVertex& v = path[0];
+            v = BDPTVertex();
+            v.type = BDPT_VERTEX_TYPE::LIGHT;
+            v.light = light;
+            v.p = ray.origin;
+            v.n = normal;
+            v.Le = le;
+            v.beta = le/(pmf*pdfPos);
+            v.pdfFwd = pmf*pdfPos;
+
+            const float cos_term = light->type == LIGHT_TYPE::AREA ? std::abs(dot(normal, ray.direction)) : 1.0f;
+            return randomWalk(scene, ray, v.beta*cos_term/pdfDir, pdfDir, TRANSPORT_MODE::IMPORTANCE, path);
+        };
+
+
+        //path[0]から出るレイrayを辿ってpathの残りを埋め 部分パスの頂点数を返す
+        //pdfFwdはrayの方向が選ばれた確率密度(立体角測度)
+        int randomWalk(const Scene& scene, Ray ray, RGB beta, float pdfFwd, TRANSPORT_MODE mode, std::vector<BDPTVertex>& path) const {
+            const int maxVertices = path.size();
+            int k = 1;
+            while(k < maxVertices) {
+                BDPTVertex& vertex = path[k];
+                BDPTVertex& prev = path[k - 1];
+                vertex = BDPTVertex();
+                vertex.beta = beta;
+
+                Hit res;
+                if(!scene.intersect(ray, res)) {
+                    //カメラ側では空を無限遠の光源の頂点として記録する
+                    if(mode == TRANSPORT_MODE::RADIANCE) {
+                        vertex.type = BDPT_VERTEX_TYPE::LIGHT;
+                        vertex.light = scene.envLight;
+                        vertex.infinite = true;
+                        vertex.p = ray.direction;
+                        vertex.Le = scene.sky->getSky(ray);
+                        vertex.pdfFwd = pdfFwd;
+                        k++;
+                    }
+                    break;
+                }
+                vertex.p = res.hitPos;
+                vertex.wo = -ray.direction;
+
+                //光源に当たったらそこで部分パスを終える
+                if(res.hitPrimitive->areaLight != nullptr) {
+                    if(mode == TRANSPORT_MODE::RADIANCE) {
+                        vertex.type = BDPT_VERTEX_TYPE::LIGHT;
+                        vertex.light = res.hitPrimitive->areaLight.get();
+                        vertex.n = res.hitNormal;
+                        vertex.Le = vertex.light->Le(res);
+                        vertex.pdfFwd = convertDensity(pdfFwd, prev, vertex);
+                        k++;
+                    }
+                    break;
+                }
+
+                const Material* material = res.hitPrimitive->material.get();
+                const bool specular = material->type == MATERIAL_TYPE::SPECULAR;
+                vertex.type = BDPT_VERTEX_TYPE::SURFACE;
+                vertex.material = material;
+                vertex.delta = specular;
+                //非スペキュラーのマテリアルは到達した側で反射するように法線を向ける
+                vertex.n = (!specular && dot(res.hitNormal, vertex.wo) < 0.0f) ? -res.hitNormal : res.hitNormal;
+                vertex.s = res.dpdu;
+                vertex.t = normalize(cross(vertex.s, vertex.n));
+                vertex.pdfFwd = convertDensity(pdfFwd, prev, vertex);
+                if(++k >= maxVertices) break;
+
+                //BRDFの計算と方向のサンプリング
+                const Vec3 wo_local = worldToLocal(vertex.wo, vertex.n, vertex.s, vertex.t);
+                Vec3 wi_local;
+                float pdf = 1.0f;
+                RGB brdf_f = material->sample(wo_local, wi_local, *sampler, pdf, mode);
+                if(iszero(wi_local)) break;
+                float pdfRev = 0.0f;
+                if(specular) {
+                    pdfFwd = 0.0f;
+                }
+                else {
+                    //MISの重みと整合するように BRDF全体の値とpdfを使う
+                    brdf_f = material->f(wo_local, wi_local);
+                    pdf = material->pdf(wo_local, wi_local);
+                    if(pdf == 0.0f) break;
+                    pdfFwd = pdf;
+                    pdfRev = material->pdf(wi_local, wo_local);
+                }
+                beta *= brdf_f * std::abs(wi_local.y)/pdf;
+                if(iszero(beta) || isnan(beta) || isinf(beta)) break;
+                prev.pdfRev = convertDensity(pdfRev, vertex, prev);
+
+                ray = Ray(res.hitPos, localToWorld(wi_local, vertex.n, vertex.s, vertex.t));
+            }
+            return k;
+        };
+
+
+        //光源側のs頂点とカメラ側のt頂点をつないだパスの寄与 MISの重みを含む
+        //t = 1の場合はrasterに寄与を加えるフィルム上の位置を返す
+        RGB connect(const Scene& scene, std::vector<BDPTVertex>& lightPath, std::vector<BDPTVertex>& cameraPath, int s, int t, Vec2& raster) const {
+            const BDPTVertex& pt = cameraPath[t - 1];
+            //光源に当たって終わったカメラ側の部分パスは他の頂点と接続しない
+            if(t > 1 && s != 0 && pt.type == BDPT_VERTEX_TYPE::LIGHT) return RGB(0.0f);
+
+            RGB L;
+            BDPTVertex sampled;
+            if(s == 0) {
+                //カメラ側の部分パスだけで光源に当たった場合
+                if(pt.type != BDPT_VERTEX_TYPE::LIGHT) return RGB(0.0f);
+                L = pt.beta * pt.Le;
+            }
+            else if(t == 1) {
+                //光源側の頂点をカメラに接続する
+                const BDPTVertex& qs = lightPath[s - 1];
+                if(!qs.connectible()) return RGB(0.0f);
+                float we;
+                if(!cam->importance(qs.p, raster, we)) return RGB(0.0f);
+                sampled.type = BDPT_VERTEX_TYPE::CAMERA;
+                sampled.p = cam->camPos;
+                const Vec3 d = sampled.p - qs.p;
+                const float dist2 = d.length2();
+                L = qs.beta * f(qs, sampled) * we * std::abs(dot(qs.n, d))/(dist2*std::sqrt(dist2));
+                if(iszero(L) || !visible(scene, qs.p, sampled.p)) return RGB(0.0f);
+            }
+            else if(s == 1) {
+                //光源上の点をサンプリングし直してカメラ側の頂点に接続する
+                if(!pt.connectible()) return RGB(0.0f);
+                if(!sampleLightVertex(scene, pt, sampled)) return RGB(0.0f);
+                const Vec3 wi = pt.directionTo(sampled);
+                float g = std::abs(dot(pt.n, wi));
+                if(!sampled.infinite) {
+                    g /= (sampled.p - pt.p).length2();
+                    if(sampled.onSurface())
+                        g *= std::abs(dot(sampled.n, wi));
+                }
+                L = pt.beta * f(pt, sampled) * sampled.beta * g;
+                if(iszero(L)) return RGB(0.0f);
+                if(sampled.infinite) {
+                    Ray shadowRay(pt.p, wi);
+                    Hit shadow_res;
+                    if(scene.intersect(shadowRay, shadow_res)) return RGB(0.0f);
+                }
+                else if(!visible(scene, pt.p, sampled.p)) {
+                    return RGB(0.0f);
+                }
+            }
+            else {
+                //両側の端点をつなぐ
+                const BDPTVertex& qs = lightPath[s - 1];
+                if(!qs.connectible() || !pt.connectible()) return RGB(0.0f);
+                const Vec3 d = pt.p - qs.p;
+                const float dist2 = d.length2();
+                const float g = std::abs(dot(qs.n, d))*std::abs(dot(pt.n, d))/(dist2*dist2);
+                L = qs.beta * f(qs, pt) * f(pt, qs) * pt.beta * g;
+                if(iszero(L) || !visible(scene, qs.p, pt.p)) return RGB(0.0f);
+            }
+
+            return misWeight(scene, lightPath, cameraPath, sampled, s, t) * L;
+        };
+
+
+        //(s, t)の戦略で生成されたパスのMISの重み
+        //同じパスを他の戦略で生成する確率密度との比を 端点から順にpdfRev/pdfFwdの積で求める
+        float misWeight(const Scene& scene, std::vector<BDPTVertex>& lightPath, std::vector<BDPTVertex>& cameraPath, const BDPTVertex& sampled, int s, int t) const {
+            if(s + t == 2) return 1.0f;
+
+            BDPTVertex* qs = s > 0 ? &lightPath[s - 1] : nullptr;
+            BDPTVertex* pt = t > 0 ? &cameraPath[t - 1] : nullptr;
+            BDPTVertex* qsMinus = s > 1 ? &lightPath[s - 2] : nullptr;
+            BDPTVertex* ptMinus = t > 1 ? &cameraPath[t - 2] : nullptr;
+
+            //接続に関わる頂点を書き換えるので 最後に元に戻す
+            BDPTVertex* touched[4] = {qs, pt, qsMinus, ptMinus};
+            BDPTVertex saved[4];
+            for(int k = 0; k < 4; k++)
+                if(touched[k]) saved[k] = *touched[k];
+
+            //サンプリングし直した端点に置き換える
+            if(s == 1) *qs = sampled;
+            else if(t == 1) *pt = sampled;
+            //接続する頂点はデルタ分布ではない
+            if(pt) pt->delta = false;
+            if(qs) qs->delta = false;
+            //接続によって決まる逆向きのpdf
+            if(pt) pt->pdfRev = s > 0 ? pdf(*qs, qsMinus, *pt) : pdfLightOrigin(scene, *pt, *ptMinus);
+            if(ptMinus) ptMinus->pdfRev = s > 0 ? pdf(*pt, qs, *ptMinus) : pdfLight(*pt, *ptMinus);
+            if(qs) qs->pdfRev = pdf(*pt, ptMinus, *qs);
+            if(qsMinus) qsMinus->pdfRev = pdf(*qs, pt, *qsMinus);
+
+            //空や平行光源で終わるパスは光源側の頂点が1つまでの戦略でしか生成できない
+            int maxLightVertices = std::numeric_limits<int>::max();
+            const BDPTVertex& endpoint = s > 0 ? lightPath[0] : cameraPath[t - 1];
+            if(endpoint.infinite)
+                maxLightVertices = endpoint.light ? 1 : 0;
+            //光源側の頂点をカメラに接続できないカメラではt = 1の戦略はない
+            const bool cameraConnectible = cam->pdfDir(cam->camForward) > 0.0f;
+
+            auto remap0 = [](float f) {
+                return f != 0.0f ? f : 1.0f;
+            };
+            float sumRi = 0.0f;
+            //カメラ側の頂点を光源側の部分パスで生成する戦略
+            float ri = 1.0f;
+            for(int i = t - 1; i > 0; i--) {
+                if(s + t - i > maxLightVertices) break;
+                const float r = remap0(cameraPath[i].pdfRev)/remap0(cameraPath[i].pdfFwd);
+                ri *= r*r;
+                if(!cameraPath[i].delta && !cameraPath[i - 1].delta && (i > 1 || cameraConnectible))
+                    sumRi += ri;
+            }
+            //光源側の頂点をカメラ側の部分パスで生成する戦略
+            ri = 1.0f;
+            for(int i = s - 1; i >= 0; i--) {
+                const float r = remap0(lightPath[i].pdfRev)/remap0(lightPath[i].pdfFwd);
+                ri *= r*r;
+                const bool deltaLightVertex = i > 0 ? lightPath[i - 1].delta : lightPath[0].isDeltaLight();
+                if(!lightPath[i].delta && !deltaLightVertex)
+                    sumRi += ri;
+            }
+
+            for(int k = 0; k < 4; k++)
+                if(touched[k]) *touched[k] = saved[k];
+            return 1.0f/(1.0f + sumRi);
+        };
+
+
+        //光源を一様に選ぶ
+        const Light* chooseLight(const Scene& scene, float& pmf) const {
+            const int n = scene.lights.size();
+            const int index = std::min((int)(sampler->getNext()*n), n - 1);
+            pmf = 1.0f/n;
+            return scene.lights[index].get();
+        };
+
+
+        //頂点ptに接続する光源上の頂点をサンプリングする
+        bool sampleLightVertex(const Scene& scene, const BDPTVertex& pt, BDPTVertex& v) const {
+            if(scene.lights.empty()) return false;
+            float pmf;
+            const Light* light = chooseLight(scene, pmf);
+            v.type = BDPT_VERTEX_TYPE::LIGHT;
+            v.light = light;
+
+            if(light->type == LIGHT_TYPE::AREA) {
+                float pdfPos;
+                Hit res;
+                res.hitPos = v.p = static_cast<const AreaLight*>(light)->shape->sample(*sampler, v.n, pdfPos);
+                res.hitNormal = v.n;
+                if(pdfPos == 0.0f) return false;
+                v.Le = light->Le(res);
+                v.beta = v.Le/(pmf*pdfPos);
+                v.pdfFwd = pdfLightOrigin(scene, v, pt);
+            }
+            else if(light->type == LIGHT_TYPE::POINT) {
+                Hit res;
+                v.p = static_cast<const PointLight*>(light)->lightPos;
+                v.Le = light->Le(res);
+                v.beta = v.Le/pmf;
+                v.pdfFwd = 0.0f;
+            }
+            else {
+                //平行光源と環境光は方向をサンプリングする
+                Hit res;
+                res.hitPos = pt.p;
+                res.hitNormal = pt.n;
+                float pdfDir;
+                Vec3 wi;
+                v.Le = light->sample(res, *sampler, wi, pdfDir);
+                if(pdfDir == 0.0f) return false;
+                v.infinite = true;
+                v.p = wi;
+                v.beta = v.Le/(pmf*pdfDir);
+                v.pdfFwd = pmf*pdfDir;
+            }
+            return true;
+        };
+
+
+        //面積測度に変換する 無限遠の頂点には立体角測度のまま返す
+        float convertDensity(float pdf, const BDPTVertex& from, const BDPTVertex& to) const {
+            if(to.infinite) return pdf;
+            const Vec3 w = to.p - from.p;
+            const float dist2 = w.length2();
+            if(dist2 == 0.0f) return 0.0f;
+            if(to.onSurface())
+                pdf *= std::abs(dot(to.n, w))/std::sqrt(dist2);
+            return pdf/dist2;
+        };
+
+
+        //表面の頂点vから頂点nextに向かう方向のBRDF
+        //非スペキュラーのマテリアルは反射のみを扱う
+        RGB f(const BDPTVertex& v, const BDPTVertex& next) const {
+            const Vec3 wo_local = worldToLocal(v.wo, v.n, v.s, v.t);
+            const Vec3 wi_local = worldToLocal(v.directionTo(next), v.n, v.s, v.t);
+            if(cosTheta(wi_local) <= 0.0f) return RGB(0.0f);
+            return v.material->f(wo_local, wi_local);
+        };
+
+
+        //prevから頂点vに来たパスがnextに向かう確率密度
+        float pdf(const BDPTVertex& v, const BDPTVertex* prev, const BDPTVertex& next) const {
+            if(v.type == BDPT_VERTEX_TYPE::LIGHT) return pdfLight(v, next);
+            const Vec3 wn = v.directionTo(next);
+            float pdf;
+            if(v.type == BDPT_VERTEX_TYPE::CAMERA) {
+                pdf = cam->pdfDir(wn);
+            }
+            else {
+                const Vec3 wp = v.directionTo(*prev);
+                pdf = v.material->pdf(worldToLocal(wp, v.n, v.s, v.t), worldToLocal(wn, v.n, v.s, v.t));
+            }
+            return convertDensity(pdf, v, next);
+        };
+
+
+        //光源の頂点vから出るレイがnextに向かう確率密度
+        float pdfLight(const BDPTVertex& v, const BDPTVertex& next) const {
+            if(v.infinite || !v.light) return 0.0f;
+            float pdfPos, pdfDir;
+            v.light->pdfLe(v.n, normalize(next.p - v.p), pdfPos, pdfDir);
+            return convertDensity(pdfDir, v, next);
+        };
+
+
+        //光源の頂点vが光源側の部分パスの始点として選ばれる確率密度
+        //環境光の場合はnextから見た方向の立体角測度
+        float pdfLightOrigin(const Scene& scene, const BDPTVertex& v, const BDPTVertex& next) const {
+            if(!v.light) return 0.0f;
+            const float pmf = 1.0f/scene.lights.size();
+            if(v.infinite) {
+                if(v.light->type != LIGHT_TYPE::ENVIRONMENT) return 0.0f;
+                Hit res;
+                res.hitPos = next.p;
+                return pmf * v.light->pdf(res, v.p, res);
+            }
+            float pdfPos, pdfDir;
+            v.light->pdfLe(v.n, normalize(next.p - v.p), pdfPos, pdfDir);
+            return pmf * pdfPos;
+        };
+
+
+        //2点の間に遮蔽物がないか
+        bool visible(const Scene& scene, const Vec3& a, const Vec3& b) const {
+            const Vec3 d = b - a;
+            const float dist = d.length();
+            Ray ray(a, d/dist);
+            ray.tmax = dist*(1.0f - 1e-4f);
+            Hit res;
+            return !scene.intersect(ray, res);
+        };
+};
+#endif
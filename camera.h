@@ -2,6 +2,7 @@
 #define CAMERA_H
 #include <cmath>
 #include <memory>
+#include "vec2.h"
 #include "vec3.h"
 #include "ray.h"
 #include "sampler.h"
@@ -23,6 +24,24 @@ class Camera {
         };
 
         virtual Ray getRay(float u, float v, float &w, Sampler& sampler, bool isLeft = true) const = 0;
+
+        //フィルム上の位置(ピクセル単位)をgetRayに渡す(u, v)に変換する
+        //vは[-1, 1] uは縦横比を保つように高さで割るが 両目のカメラは経度全体を覆うように幅で割る
+        Vec2 rasterToUV(float x, float y) const {
+            const float uScale = two_eyes ? film->width : film->height;
+            return Vec2((2.0f*x - film->width)/uScale, -(2.0f*y - film->height)/film->height);
+        };
+
+        //点pをカメラに接続する場合の重要度関数Weと フィルム上の位置(ピクセル単位)を返す
+        //getRayのwと同じ重みがかかるように フィルム全体の面積で正規化されている
+        //接続に対応していないカメラか 画角の外ならfalseを返す
+        virtual bool importance(const Vec3& p, Vec2& raster, float& we) const {
+            return false;
+        };
+        //getRayで方向dirが生成される確率密度(立体角測度 フィルム全体で一様にサンプリングした場合)
+        virtual float pdfDir(const Vec3& dir) const {
+            return 0.0f;
+        };
 };
 
 
@@ -39,6 +58,32 @@ class PinholeCamera : public Camera {
             w = std::pow(dot(camForward, rayDir), 4.0f);
             return Ray(camPos, rayDir);
         };
+
+        bool importance(const Vec3& p, Vec2& raster, float& we) const {
+            const Vec3 dir = normalize(p - camPos);
+            const float cos_theta = dot(camForward, dir);
+            if(cos_theta <= 0.0f) return false;
+            //距離focusの画像面上での位置
+            const Vec3 q = focus/cos_theta * dir;
+            const float u = dot(q, camRight);
+            const float v = dot(q, camUp);
+            const float width = film->width;
+            const float height = film->height;
+            raster = Vec2((u*height + width)/2.0f, (height - v*height)/2.0f);
+            if(raster.x < 0.0f || raster.x >= width || raster.y < 0.0f || raster.y >= height) return false;
+            //getRayの重みcos^4と 画像面から立体角へのヤコビアンfocus^2/cos^3の積
+            we = focus*focus*cos_theta/filmArea();
+            return true;
+        };
+        float pdfDir(const Vec3& dir) const {
+            const float cos_theta = dot(camForward, dir);
+            if(cos_theta <= 0.0f) return 0.0f;
+            return focus*focus/(filmArea()*cos_theta*cos_theta*cos_theta);
+        };
+        //画像面上でのフィルムの面積 uは[-width/height, width/height] vは[-1, 1]の範囲をとる
+        float filmArea() const {
+            return 4.0f*film->width/film->height;
+        };
 };
 
 
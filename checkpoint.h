@@ -0,0 +1,126 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include "film.h"
+
+
+//FNV-1aハッシュ シーンファイルの同一性の確認に使う
+inline uint64_t hashBytes(const std::string& bytes) {
+    uint64_t h = 14695981039346656037ULL;
+    for(unsigned char c : bytes) {
+        h ^= c;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+
+//レンダリング途中の状態
+//フィルムの生の蓄積バッファ 完了したサンプル数 乱数の状態 シーンのハッシュを保存する
+struct Checkpoint {
+    uint64_t sceneHash = 0;
+    int width = 0;
+    int height = 0;
+    //ビューの数 pixelsには各ビューのピクセルが順に並ぶ
+    int views = 1;
+    //完了したサンプル数
+    int samples = 0;
+    std::vector<Film::Pixel> pixels;
+    std::string rngState;
+
+
+    //一時ファイルに書き出してからrenameで置き換える
+    //途中で落ちても前回のチェックポイントが壊れない
+    bool write(const std::string& filename) const {
+        const std::string tmp = filename + ".tmp";
+        std::ofstream file(tmp, std::ios::binary);
+        if(!file) return false;
+
+        file.write(magic, sizeof(magic));
+        const int32_t pixelSize = sizeof(Film::Pixel);
+        const int32_t rngSize = rngState.size();
+        const int32_t header[] = {width, height, views, samples, pixelSize, rngSize};
+        file.write((const char*)&sceneHash, sizeof(sceneHash));
+        file.write((const char*)header, sizeof(header));
+        file.write((const char*)pixels.data(), pixels.size()*sizeof(Film::Pixel));
+        file.write(rngState.data(), rngState.size());
+        file.close();
+        if(!file) return false;
+
+        return std::rename(tmp.c_str(), filename.c_str()) == 0;
+    };
+
+
+    bool read(const std::string& filename) {
+        std::ifstream file(filename, std::ios::binary);
+        if(!file) return false;
+
+        char m[sizeof(magic)];
+        file.read(m, sizeof(m));
+        if(!file || std::memcmp(m, magic, sizeof(magic)) != 0) return false;
+
+        int32_t header[6];
+        file.read((char*)&sceneHash, sizeof(sceneHash));
+        file.read((char*)header, sizeof(header));
+        if(!file || header[4] != (int32_t)sizeof(Film::Pixel)) return false;
+        width = header[0];
+        height = header[1];
+        views = header[2];
+        samples = header[3];
+        if(views < 1) return false;
+
+        pixels.resize(views*width*height);
+        file.read((char*)pixels.data(), pixels.size()*sizeof(Film::Pixel));
+        rngState.resize(header[5]);
+        file.read(&rngState[0], rngState.size());
+        return (bool)file;
+    };
+
+
+    private:
+        static constexpr char magic[8] = {'R', 'T', 'C', 'K', 'P', 'T', '0', '2'};
+};
+constexpr char Checkpoint::magic[8];
+
+
+//チェックポイントをバックグラウンドのスレッドで書き出す
+//描画スレッドはスナップショットを渡すだけで書き込みを待たない
+class CheckpointWriter {
+    public:
+        std::string filename;
+
+        CheckpointWriter(const std::string& _filename) : filename(_filename), busy(false) {};
+        ~CheckpointWriter() {
+            wait();
+        };
+
+        //前回の書き込みが終わっていなければfalseを返して何もしない
+        bool submit(Checkpoint&& checkpoint) {
+            if(busy) return false;
+            wait();
+            busy = true;
+            worker = std::thread([this](Checkpoint ckpt) {
+                if(!ckpt.write(filename))
+                    std::cerr << "failed to write checkpoint " << filename << std::endl;
+                busy = false;
+            }, std::move(checkpoint));
+            return true;
+        };
+        void wait() {
+            if(worker.joinable())
+                worker.join();
+        };
+
+    private:
+        std::thread worker;
+        std::atomic<bool> busy;
+};
+#endif
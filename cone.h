@@ -0,0 +1,53 @@
+#ifndef CONE_H
+#define CONE_H
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include "vec3.h"
+
+
+//方向の集合を囲むコーン
+//軸wからの角度がacos(cosTheta)以内の方向を含む
+struct DirectionCone {
+    Vec3 w;
+    float cosTheta;
+
+    //空のコーン
+    DirectionCone() : w(Vec3(0, 0, 1)), cosTheta(std::numeric_limits<float>::infinity()) {};
+    DirectionCone(const Vec3& _w, float _cosTheta) : w(normalize(_w)), cosTheta(_cosTheta) {};
+
+    bool isEmpty() const {
+        return cosTheta == std::numeric_limits<float>::infinity();
+    };
+
+    //全方向を含むコーン
+    static DirectionCone entireSphere() {
+        return DirectionCone(Vec3(0, 0, 1), -1.0f);
+    };
+};
+
+
+//2つのコーンを両方含むコーンを返す
+inline DirectionCone unionCone(const DirectionCone& a, const DirectionCone& b) {
+    if(a.isEmpty()) return b;
+    if(b.isEmpty()) return a;
+
+    const float theta_a = std::acos(std::max(-1.0f, std::min(a.cosTheta, 1.0f)));
+    const float theta_b = std::acos(std::max(-1.0f, std::min(b.cosTheta, 1.0f)));
+    const float theta_d = std::acos(std::max(-1.0f, std::min(dot(a.w, b.w), 1.0f)));
+    //片方がもう片方を含む場合
+    if(std::min(theta_d + theta_b, (float)M_PI) <= theta_a) return a;
+    if(std::min(theta_d + theta_a, (float)M_PI) <= theta_b) return b;
+
+    const float theta_o = 0.5f*(theta_a + theta_d + theta_b);
+    if(theta_o >= M_PI) return DirectionCone::entireSphere();
+
+    //aの軸をbの方向にtheta_rだけ回転させたものを新しい軸にする
+    const float theta_r = theta_o - theta_a;
+    const Vec3 wr = cross(a.w, b.w);
+    if(wr.length2() == 0.0f) return DirectionCone::entireSphere();
+    const Vec3 k = normalize(wr);
+    const Vec3 w = a.w*std::cos(theta_r) + cross(k, a.w)*std::sin(theta_r) + k*dot(k, a.w)*(1.0f - std::cos(theta_r));
+    return DirectionCone(w, std::cos(theta_o));
+}
+#endif
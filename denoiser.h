@@ -0,0 +1,293 @@
+#ifndef DENOISER_H
+#define DENOISER_H
+#include <omp.h>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include "vec3.h"
+#include "film.h"
+#include "camera.h"
+#include "sampler.h"
+#include "scene.h"
+#include "aov.h"
+
+
+//デノイザーに渡す最初の衝突点の特徴量
+//アルベド, 法線, 深度をピクセル内でジッターしたレイの平均として求める
+//背景のピクセルはアルベド1, 法線0, 深度0とする
+struct FeatureBuffer {
+    int width = 0;
+    int height = 0;
+    //SoAで保持する
+    std::vector<float> ar, ag, ab;
+    std::vector<float> nx, ny, nz;
+    std::vector<float> depth;
+
+
+    void render(const Scene& scene, const Camera& cam, Sampler& sampler, int samples, bool isLeft = true) {
+        width = cam.film->width;
+        height = cam.film->height;
+        const int n = width*height;
+        for(auto v : {&ar, &ag, &ab, &nx, &ny, &nz, &depth})
+            v->assign(n, 0.0f);
+
+        #pragma omp parallel for schedule(dynamic, 1)
+        for(int j = 0; j < height; j++) {
+            for(int i = 0; i < width; i++) {
+                RGB albedo;
+                Vec3 normal;
+                float z = 0.0f;
+                int nHits = 0;
+                for(int k = 0; k < samples; k++) {
+                    sampler.startPixelSample(i + width*j, k);
+                    const float rx = sampler.getNext();
+                    const float ry = sampler.getNext();
+                    const Vec2 uv = cam.rasterToUV(i + rx, j + ry);
+                    float w;
+                    const Ray ray = cam.getRay(uv.x, uv.y, w, sampler, isLeft);
+                    Hit res;
+                    if(scene.intersect(ray, res)) {
+                        albedo += res.hitPrimitive->areaLight ? RGB(1.0f) : res.hitPrimitive->material->albedo();
+                        //カメラ側を向けておく
+                        normal += dot(res.hitNormal, ray.direction) > 0.0f ? -res.hitNormal : res.hitNormal;
+                        z += res.t;
+                        nHits++;
+                    }
+                    else {
+                        albedo += RGB(1.0f);
+                    }
+                }
+                const int p = i + width*j;
+                albedo /= samples;
+                ar[p] = albedo.x; ag[p] = albedo.y; ab[p] = albedo.z;
+                if(nHits > 0) {
+                    //縁のピクセルでは平均した法線を正規化する
+                    const float len = normal.length();
+                    if(len > 0.0f) normal /= len;
+                    nx[p] = normal.x; ny[p] = normal.y; nz[p] = normal.z;
+                    depth[p] = z/nHits;
+                }
+            }
+        }
+    };
+
+
+    //本描画で記録したAOVから作る
+    void load(const AOVFilm& aov) {
+        width = aov.width;
+        height = aov.height;
+        const int n = width*height;
+        for(auto v : {&ar, &ag, &ab, &nx, &ny, &nz, &depth})
+            v->assign(n, 0.0f);
+        for(int p = 0; p < n; p++) {
+            const RGB albedo = aov.albedo(p);
+            const Vec3 normal = aov.normal(p);
+            ar[p] = albedo.x; ag[p] = albedo.y; ab[p] = albedo.z;
+            nx[p] = normal.x; ny[p] = normal.y; nz[p] = normal.z;
+            depth[p] = aov.depth(p);
+        }
+    };
+};
+
+
+//エッジを保存するÀ-Trousウェーブレットフィルタ(SVGFの空間フィルタ)
+//アルベドで割った照度に 間隔を2倍ずつ広げた5x5のB3スプラインフィルタを繰り返しかける
+//重みは法線, 深度, 照度の差から決め 照度の差はピクセルの分散で正規化する
+//分散もフィルタと一緒に伝播させるので 収束したピクセルほどぼかされない
+//各反復は行ごとに並列化し 同じタップについて行内のピクセルをまとめて計算することでSIMD化する
+class Denoiser {
+    public:
+        int iterations = 5;
+        //照度の差に対する許容度 標準偏差の何倍まで混ぜるか
+        float sigmaLuminance = 4.0f;
+        //深度の差に対する許容度 深度の勾配に対する比
+        float sigmaDepth = 1.0f;
+
+
+        //resolve後のフィルムを置き換える
+        void denoise(Film& film, const FeatureBuffer& features) const {
+            const int width = film.width;
+            const int height = film.height;
+            const int n = width*height;
+
+            //アルベドで割って照度にする
+            Planes cur(n), next(n);
+            std::vector<float> ar(n), ag(n), ab(n), background(n), depthGrad(n);
+            #pragma omp parallel for schedule(static)
+            for(int p = 0; p < n; p++) {
+                const Film::Pixel& pixel = film.pixels[p];
+                ar[p] = features.ar[p] > 1e-3f ? features.ar[p] : 1.0f;
+                ag[p] = features.ag[p] > 1e-3f ? features.ag[p] : 1.0f;
+                ab[p] = features.ab[p] > 1e-3f ? features.ab[p] : 1.0f;
+                cur.r[p] = pixel.color_sum.x/ar[p];
+                cur.g[p] = pixel.color_sum.y/ag[p];
+                cur.b[p] = pixel.color_sum.z/ab[p];
+                //平均値の分散 resolve後のcolor_sumは平均値
+                float var = 0.0f;
+                if(pixel.nsamples > 1) {
+                    const float mean = luminance(pixel.color_sum);
+                    var = std::max(0.0f, pixel.lum_sq_sum/pixel.nsamples - mean*mean)/(pixel.nsamples - 1);
+                }
+                const float a = luminance(RGB(ar[p], ag[p], ab[p]));
+                cur.var[p] = var/(a*a);
+                background[p] = features.depth[p] > 0.0f ? 0.0f : 1.0f;
+            }
+            //深度のスクリーン空間での勾配
+            #pragma omp parallel for schedule(static)
+            for(int j = 0; j < height; j++) {
+                for(int i = 0; i < width; i++) {
+                    const int p = i + width*j;
+                    const float z = features.depth[p];
+                    const float dx = std::max(i > 0 ? std::abs(z - features.depth[p - 1]) : 0.0f, i < width - 1 ? std::abs(features.depth[p + 1] - z) : 0.0f);
+                    const float dy = std::max(j > 0 ? std::abs(z - features.depth[p - width]) : 0.0f, j < height - 1 ? std::abs(features.depth[p + width] - z) : 0.0f);
+                    depthGrad[p] = std::max(dx, dy);
+                }
+            }
+
+            std::vector<float> filteredVar(n);
+            for(int it = 0; it < iterations; it++) {
+                filterVariance(cur.var, filteredVar, width, height);
+                atrous(cur, next, filteredVar, background, depthGrad, features, width, height, 1 << it);
+                std::swap(cur, next);
+            }
+
+            #pragma omp parallel for schedule(static)
+            for(int p = 0; p < n; p++)
+                film.pixels[p].color_sum = RGB(cur.r[p]*ar[p], cur.g[p]*ag[p], cur.b[p]*ab[p]);
+        };
+
+
+    private:
+        struct Planes {
+            std::vector<float> r, g, b, var;
+            Planes(int n) : r(n), g(n), b(n), var(n) {};
+        };
+
+
+        //x <= 0で使うexpの近似 多項式とビット演算だけなのでSIMD化できる
+        static inline float fastExp(float x) {
+            x = std::max(x, -80.0f);
+            const float t = x*1.44269504f;
+            //floorは整数への変換で求める
+            const int32_t ti = (int32_t)t;
+            const int32_t fi = ti - (t < (float)ti);
+            const float f = t - (float)fi;
+            const float p = 1.0f + f*(0.693147182f + f*(0.240226507f + f*(0.0555041087f + f*(0.00961812911f + f*0.00133335581f))));
+            const int32_t bits = (fi + 127) << 23;
+            float scale;
+            std::memcpy(&scale, &bits, sizeof(float));
+            return p*scale;
+        };
+
+
+        //法線の重み SIMD化のために指数は128に固定する
+        static inline float pow128(float x) {
+            x *= x; x *= x; x *= x; x *= x;
+            x *= x; x *= x; x *= x;
+            return x;
+        };
+
+
+        //分散を3x3のガウシアンでぼかしてから重みの計算に使う
+        static void filterVariance(const std::vector<float>& var, std::vector<float>& out, int width, int height) {
+            const float k[3] = {0.25f, 0.5f, 0.25f};
+            #pragma omp parallel for schedule(static)
+            for(int j = 0; j < height; j++) {
+                for(int i = 0; i < width; i++) {
+                    float sum = 0.0f, wsum = 0.0f;
+                    for(int dy = -1; dy <= 1; dy++) {
+                        const int y = j + dy;
+                        if(y < 0 || y >= height) continue;
+                        for(int dx = -1; dx <= 1; dx++) {
+                            const int x = i + dx;
+                            if(x < 0 || x >= width) continue;
+                            const float w = k[dx + 1]*k[dy + 1];
+                            sum += w*var[x + width*y];
+                            wsum += w;
+                        }
+                    }
+                    out[i + width*j] = sum/wsum;
+                }
+            }
+        };
+
+
+        //間隔stepのÀ-Trousフィルタを1回かける
+        void atrous(const Planes& in, Planes& out, const std::vector<float>& filteredVar, const std::vector<float>& background, const std::vector<float>& depthGrad, const FeatureBuffer& f, int width, int height, int step) const {
+            const float kernel[5] = {1.0f/16.0f, 1.0f/4.0f, 3.0f/8.0f, 1.0f/4.0f, 1.0f/16.0f};
+            #pragma omp parallel
+            {
+                //行ごとの累積値
+                std::vector<float> sr(width), sg(width), sb(width), sv(width), sw(width);
+                std::vector<float> lumP(width), invDenL(width), invDenZ(width);
+                #pragma omp for schedule(dynamic, 4)
+                for(int j = 0; j < height; j++) {
+                    const int row = width*j;
+                    for(int i = 0; i < width; i++) {
+                        const int p = row + i;
+                        sr[i] = sg[i] = sb[i] = sv[i] = sw[i] = 0.0f;
+                        lumP[i] = 0.2126f*in.r[p] + 0.7152f*in.g[p] + 0.0722f*in.b[p];
+                        invDenL[i] = 1.0f/(sigmaLuminance*std::sqrt(filteredVar[p]) + 1e-6f);
+                        invDenZ[i] = 1.0f/(sigmaDepth*depthGrad[p]*step + 1e-6f);
+                    }
+
+                    //内側のループで使うポインタ
+                    const float *r = in.r.data(), *g = in.g.data(), *b = in.b.data(), *var = in.var.data();
+                    const float *nx = f.nx.data(), *ny = f.ny.data(), *nz = f.nz.data(), *depth = f.depth.data(), *bg = background.data();
+                    const float *lum = lumP.data(), *denL = invDenL.data(), *denZ = invDenZ.data();
+                    float *accR = sr.data(), *accG = sg.data(), *accB = sb.data(), *accV = sv.data(), *accW = sw.data();
+                    for(int dy = -2; dy <= 2; dy++) {
+                        const int y = j + dy*step;
+                        if(y < 0 || y >= height) continue;
+                        for(int dx = -2; dx <= 2; dx++) {
+                            const int ox = dx*step;
+                            const int iMin = std::max(0, -ox);
+                            const int iMax = std::min(width, width - ox);
+                            const float k = kernel[dx + 2]*kernel[dy + 2];
+                            const float invDist = 1.0f/std::sqrt((float)(dx*dx + dy*dy) + 1e-6f);
+                            const int qrow = width*y + ox;
+                            #pragma omp simd
+                            for(int i = iMin; i < iMax; i++) {
+                                const int p = row + i;
+                                const int q = qrow + i;
+                                //法線 両方背景なら1
+                                const float nd = std::max(0.0f, nx[p]*nx[q] + ny[p]*ny[q] + nz[p]*nz[q]);
+                                const float wn = pow128(nd) + bg[p]*bg[q];
+                                //深度
+                                const float wz = std::abs(depth[p] - depth[q])*denZ[i]*invDist;
+                                //照度
+                                const float lq = 0.2126f*r[q] + 0.7152f*g[q] + 0.0722f*b[q];
+                                const float wl = std::abs(lum[i] - lq)*denL[i];
+                                const float w = k*wn*fastExp(-wz - wl);
+                                accR[i] += w*r[q];
+                                accG[i] += w*g[q];
+                                accB[i] += w*b[q];
+                                accV[i] += w*w*var[q];
+                                accW[i] += w;
+                            }
+                        }
+                    }
+
+                    for(int i = 0; i < width; i++) {
+                        const int p = row + i;
+                        if(sw[i] > 0.0f) {
+                            const float inv = 1.0f/sw[i];
+                            out.r[p] = sr[i]*inv;
+                            out.g[p] = sg[i]*inv;
+                            out.b[p] = sb[i]*inv;
+                            out.var[p] = sv[i]*inv*inv;
+                        }
+                        else {
+                            out.r[p] = in.r[p];
+                            out.g[p] = in.g[p];
+                            out.b[p] = in.b[p];
+                            out.var[p] = in.var[p];
+                        }
+                    }
+                }
+            }
+        };
+};
+#endif
@@ -0,0 +1,176 @@
+#ifndef DISTRIBUTION_H
+#define DISTRIBUTION_H
+#include <vector>
+#include <algorithm>
+#include <memory>
+#include "vec2.h"
+
+
+//区分的定数関数に比例したサンプリングを行う
+//離散的なサンプリング(添字を選ぶ)と[0, 1)上の連続的なサンプリングの両方に使える
+class Distribution1D {
+    public:
+        std::vector<float> func;
+        std::vector<float> cdf;
+        //funcの[0, 1)上での積分値
+        float funcInt;
+
+
+        Distribution1D(const std::vector<float>& _func) : func(_func), cdf(_func.size() + 1) {
+            const int n = func.size();
+            cdf[0] = 0.0f;
+            for(int i = 1; i < n + 1; i++)
+                cdf[i] = cdf[i - 1] + func[i - 1]/n;
+            funcInt = cdf[n];
+
+            //全て0の場合は一様分布にする
+            if(funcInt == 0.0f) {
+                for(int i = 1; i < n + 1; i++)
+                    cdf[i] = (float)i/n;
+            }
+            else {
+                for(int i = 1; i < n + 1; i++)
+                    cdf[i] /= funcInt;
+            }
+        };
+
+
+        int count() const {
+            return func.size();
+        };
+
+
+        //cdf[i] <= u < cdf[i + 1]となるiを返す
+        int findInterval(float u) const {
+            const int i = std::upper_bound(cdf.begin(), cdf.end(), u) - cdf.begin() - 1;
+            return std::max(0, std::min(i, count() - 1));
+        };
+
+
+        //funcに比例して添字を選ぶ
+        int sampleDiscrete(float u, float& pmf) const {
+            const int i = findInterval(u);
+            pmf = discretePmf(i);
+            return i;
+        };
+        float discretePmf(int i) const {
+            return cdf[i + 1] - cdf[i];
+        };
+
+
+        //funcに比例して[0, 1)上の点を選ぶ offsetには選ばれた区間の添字を返す
+        float sampleContinuous(float u, float& pdf, int& offset) const {
+            offset = findInterval(u);
+            float du = u - cdf[offset];
+            if(cdf[offset + 1] - cdf[offset] > 0.0f)
+                du /= cdf[offset + 1] - cdf[offset];
+            pdf = funcInt > 0.0f ? func[offset]/funcInt : 1.0f;
+            return (offset + du)/count();
+        };
+};
+
+
+//Walkerのエイリアス法による離散分布
+//重みに比例した添字のサンプリングをO(1)で行う
+class AliasTable {
+    public:
+        struct Bin {
+            //このビンの添字自身を選ぶ確率
+            float q;
+            //自身を選ばなかった場合に選ぶ添字
+            int alias;
+            //この添字が選ばれる確率
+            float pmf;
+        };
+        std::vector<Bin> bins;
+
+
+        AliasTable(const std::vector<float>& weights) : bins(weights.size()) {
+            const int n = weights.size();
+            double sum = 0.0;
+            for(float w : weights) sum += w;
+            for(int i = 0; i < n; i++)
+                bins[i].pmf = sum > 0.0 ? weights[i]/sum : 1.0f/n;
+
+            //平均より小さいものと大きいものに分け 小さいビンの余りを大きいものから埋める
+            std::vector<int> under, over;
+            std::vector<float> p(n);
+            for(int i = 0; i < n; i++) {
+                p[i] = bins[i].pmf*n;
+                bins[i].alias = i;
+                if(p[i] < 1.0f)
+                    under.push_back(i);
+                else
+                    over.push_back(i);
+            }
+            while(!under.empty() && !over.empty()) {
+                const int u = under.back(); under.pop_back();
+                const int o = over.back(); over.pop_back();
+                bins[u].q = p[u];
+                bins[u].alias = o;
+                p[o] -= 1.0f - p[u];
+                if(p[o] < 1.0f)
+                    under.push_back(o);
+                else
+                    over.push_back(o);
+            }
+            //丸め誤差で残ったものは自身を必ず選ぶ
+            for(int i : under) bins[i].q = 1.0f;
+            for(int i : over) bins[i].q = 1.0f;
+        };
+
+
+        int count() const {
+            return bins.size();
+        };
+
+
+        int sample(float u, float& pmf) const {
+            const float up = u*count();
+            const int i = std::min((int)up, count() - 1);
+            const int index = up - i < bins[i].q ? i : bins[i].alias;
+            pmf = bins[index].pmf;
+            return index;
+        };
+};
+
+
+//2次元の区分的定数関数に比例したサンプリング
+//vごとのuの条件付き分布とvの周辺分布からなる
+class Distribution2D {
+    public:
+        std::vector<std::unique_ptr<Distribution1D>> conditional;
+        std::unique_ptr<Distribution1D> marginal;
+
+
+        //funcはnu*nvの配列でfunc[u + nu*v]の順に並ぶ
+        Distribution2D(const std::vector<float>& func, int nu, int nv) {
+            std::vector<float> marginalFunc(nv);
+            for(int v = 0; v < nv; v++) {
+                conditional.emplace_back(new Distribution1D(std::vector<float>(func.begin() + nu*v, func.begin() + nu*(v + 1))));
+                marginalFunc[v] = conditional[v]->funcInt;
+            }
+            marginal = std::unique_ptr<Distribution1D>(new Distribution1D(marginalFunc));
+        };
+
+
+        //[0, 1)^2上の点をサンプリングする
+        Vec2 sampleContinuous(const Vec2& u, float& pdf) const {
+            float pdf_v, pdf_u;
+            int v;
+            const float d1 = marginal->sampleContinuous(u.y, pdf_v, v);
+            int iu;
+            const float d0 = conditional[v]->sampleContinuous(u.x, pdf_u, iu);
+            pdf = pdf_u*pdf_v;
+            return Vec2(d0, d1);
+        };
+        float pdf(const Vec2& p) const {
+            const int nu = conditional[0]->count();
+            const int nv = marginal->count();
+            const int iu = std::max(0, std::min((int)(p.x*nu), nu - 1));
+            const int iv = std::max(0, std::min((int)(p.y*nv), nv - 1));
+            if(marginal->funcInt == 0.0f) return 0.0f;
+            return conditional[iv]->func[iu]/marginal->funcInt;
+        };
+};
+#endif
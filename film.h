@@ -4,6 +4,8 @@
 #include <fstream>
 #include <string>
 #include <memory>
+#include <limits>
+#include <algorithm>
 #include "util.h"
 #include "vec3.h"
 #include "filter.h"
@@ -12,9 +14,15 @@ class Film {
         struct Pixel {
             RGB color_sum;
             float filter_sum;
-
-            Pixel() : color_sum(RGB(0)), filter_sum(0.0f) {};
-            Pixel(const RGB& _color_sum, float _filter_sum) : color_sum(_color_sum), filter_sum(_filter_sum) {};
+            //分散の推定に使う輝度の二乗和
+            float lum_sq_sum;
+            //addSampleされたサンプル数
+            int nsamples;
+            //他のピクセルのサンプルから加えられた寄与(光源側から辿ったパスなど)
+            RGB splat_sum;
+
+            Pixel() : color_sum(RGB(0)), filter_sum(0.0f), lum_sq_sum(0.0f), nsamples(0), splat_sum(RGB(0)) {};
+            Pixel(const RGB& _color_sum, float _filter_sum) : color_sum(_color_sum), filter_sum(_filter_sum), lum_sq_sum(0.0f), nsamples(0), splat_sum(RGB(0)) {};
         };
 
 
@@ -48,7 +56,22 @@ class Film {
                 return;
             }
             */
-            pixels[i + width*j].color_sum += c;
+            Pixel& pixel = pixels[i + width*j];
+            pixel.color_sum += c;
+            const float lum = luminance(c);
+            pixel.lum_sq_sum += lum*lum;
+            pixel.nsamples++;
+        };
+        //任意のスレッドから任意のピクセルに寄与を加える
+        //サンプルごとに1本ずつ追跡したパスの寄与を想定し resolveでそのピクセルのサンプル数で割る
+        void addSplat(int i, int j, const RGB& c) {
+            Pixel& pixel = pixels[i + width*j];
+            #pragma omp atomic
+            pixel.splat_sum.x += c.x;
+            #pragma omp atomic
+            pixel.splat_sum.y += c.y;
+            #pragma omp atomic
+            pixel.splat_sum.z += c.z;
         };
         void addSampleByFilter(float i, float j, const RGB& c) {
             int pminX = inrangeX(std::ceil(i - filter->radius.x));
@@ -68,13 +91,24 @@ class Film {
         void clear() {
             for(int i = 0; i < width; i++) {
                 for(int j = 0; j < height; j++) {
-                    pixels[i + width*j].color_sum = 0;
-                    pixels[i + width*j].filter_sum = 0;
+                    pixels[i + width*j] = Pixel();
                 }
             }
         };
 
 
+        //輝度の平均値の相対標準誤差
+        //暗いピクセルで発散しないよう分母にepsを足す
+        float relativeError(int i, int j, float eps = 1e-2f) const {
+            const Pixel& pixel = pixels[i + width*j];
+            const int n = pixel.nsamples;
+            if(n < 2) return std::numeric_limits<float>::infinity();
+            const float mean = luminance(pixel.color_sum)/n;
+            const float var = std::max(0.0f, (pixel.lum_sq_sum/n - mean*mean)*n/(n - 1));
+            return std::sqrt(var/n)/(mean + eps);
+        };
+
+
         void divide(int k) {
             for(int i = 0; i < width; i++) {
                 for(int j = 0; j < height; j++) {
@@ -83,6 +117,17 @@ class Film {
                 }
             }
         };
+        //各ピクセルをそのピクセルのサンプル数で割る
+        //ピクセルごとにサンプル数が異なる場合に使う
+        void resolve() {
+            for(int i = 0; i < width; i++) {
+                for(int j = 0; j < height; j++) {
+                    Pixel& pixel = pixels[i + width*j];
+                    if(pixel.nsamples > 0)
+                        pixel.color_sum = (pixel.color_sum + pixel.splat_sum)/pixel.nsamples;
+                }
+            }
+        };
         void finalize() {
             for(int i = 0; i < width; i++) {
                 for(int j = 0; j < height; j++) {
@@ -138,6 +183,51 @@ class Film {
         };
 
 
+        //ppm_outputで書き出したP3形式の参照画像とのRMSEを計算する
+        //各チャンネルを[0, 1]に正規化して比較する 読み込みに失敗したら負の値を返す
+        float rmse(const std::string filename) const {
+            std::ifstream file(filename);
+            std::string magic;
+            int w, h, maxval;
+            file >> magic >> w >> h >> maxval;
+            if(!file || magic != "P3" || w != width || h != height) return -1.0f;
+
+            double sum = 0.0;
+            for(int j = 0; j < height; j++) {
+                for(int i = 0; i < width; i++) {
+                    int r, g, b;
+                    file >> r >> g >> b;
+                    if(!file) return -1.0f;
+                    const RGB c = getPixel(i, j);
+                    const RGB ref = RGB(r, g, b)/maxval;
+                    const RGB d = RGB(clamp(c.x, 0.0f, 1.0f), clamp(c.y, 0.0f, 1.0f), clamp(c.z, 0.0f, 1.0f)) - ref;
+                    sum += (d.x*d.x + d.y*d.y + d.z*d.z)/3.0;
+                }
+            }
+            return std::sqrt(sum/(width*height));
+        };
+
+
+        //ピクセルごとのサンプル数を最大値で正規化したグレースケール画像として書き出す
+        void spp_output(const std::string filename) const {
+            int maxSamples = 1;
+            for(int k = 0; k < width*height; k++)
+                maxSamples = std::max(maxSamples, pixels[k].nsamples);
+            std::ofstream file(filename);
+            file << "P3" << std::endl;
+            file << width << " " << height << std::endl;
+            file << 255 << std::endl;
+            for(int j = 0; j < height; j++) {
+                for(int i = 0; i < width; i++) {
+                    int c = 255*pixels[i + width*j].nsamples/maxSamples;
+                    file << c << " " << c << " " << c << std::endl;
+                }
+            }
+            file.close();
+            std::cout << filename << " written out (max " << maxSamples << "spp)" << std::endl;
+        };
+
+
     private:
         int inrangeX(int x) const {
             if(x < 0) return 0;
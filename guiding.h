@@ -0,0 +1,186 @@
+#ifndef GUIDING_H
+#define GUIDING_H
+#include <omp.h>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include "integrator.h"
+#include "sdtree.h"
+
+
+//パスガイディング(Practical Path Guiding)
+//最初に1, 2, 4, ...sppのパスで学習し 各反復で衝突点に届いた放射輝度をSD-treeに記録する
+//次の反復からは学習した方向分布とBRDFを1サンプルMISで混ぜて方向をサンプリングする
+//学習が終わったらSD-treeを固定してpixelSamplesで本番の描画を行う
+//間接光しか届かない場所のようにBRDFサンプリングでは光源に届きにくい場合に有効
+class GuidedPathTrace : public TiledIntegrator {
+    public:
+        //学習の反復回数 k回目は2^k spp
+        int trainingIterations = 5;
+        //BRDFサンプリングを選ぶ確率
+        float bsdfSamplingFraction = 0.5f;
+        //空間の葉を分割するサンプル数の係数 小さい画像では小さくする
+        float spatialThreshold = 12000.0f;
+
+        GuidedPathTrace(std::shared_ptr<Camera> _cam, std::shared_ptr<Sampler> _sampler, int _pixelSamples, int _maxDepth) : TiledIntegrator(_cam, _sampler, _pixelSamples, _maxDepth) {};
+
+
+        void render(const Scene& scene) const {
+            train(scene);
+            TiledIntegrator::render(scene);
+        };
+        void compute(const Scene& scene) const {
+            if(!trained) train(scene);
+            TiledIntegrator::compute(scene);
+        };
+
+
+        RGB Li(const Ray& _ray, const Scene& scene) const {
+            RGB L;
+            PathState path(_ray);
+            //放射輝度を記録する頂点
+            GuidingVertex vertices[maxGuidingVertices];
+            int nVertices = 0;
+            while(true) {
+                sampler->startDimension(bounceDimension(path.depth));
+                //ロシアンルーレット
+                if(path.depth > 10) {
+                    if(sampler->getNext() < 1.0f - path.roulette) {
+                        break;
+                    }
+                    path.roulette *= 0.9f;
+                }
+
+                if(path.depth > maxDepth)
+                    break;
+
+                Hit res;
+                if(!scene.intersect(path.ray, res)) {
+                    addRadiance(L, path.throughput * scene.sky->getSky(path.ray), vertices, nVertices);
+                    break;
+                }
+                //もし光源に当たったら終了
+                if(res.hitPrimitive->areaLight != nullptr) {
+                    addRadiance(L, path.throughput * res.hitPrimitive->areaLight->Le(res)/path.roulette, vertices, nVertices);
+                    break;
+                }
+                const Material* hitMaterial = res.hitPrimitive->material.get();
+
+                //ローカル座標系の構築
+                const Vec3 wo = -path.ray.direction;
+                const bool specular = hitMaterial->type == MATERIAL_TYPE::SPECULAR;
+                //BRDFは表側でしか定義されないので 法線をwoの側に向ける
+                const Vec3 n = (!specular && dot(res.hitNormal, wo) < 0.0f) ? -res.hitNormal : res.hitNormal;
+                const Vec3 s = res.dpdu;
+                const Vec3 t = normalize(cross(s, n));
+                const Vec3 wo_local = worldToLocal(wo, n, s, t);
+
+                Vec3 wi_local;
+                Vec3 wi;
+                RGB brdf_f;
+                float pdf = 1.0f;
+                DTreeWrapper* dtree = specular ? nullptr : sdTree.lookup(res.hitPos);
+                if(dtree && dtree->valid()) {
+                    //学習した分布とBRDFのどちらかでサンプリングし 混合分布のpdfで割る
+                    if(sampler->getNext() < bsdfSamplingFraction) {
+                        float brdf_pdf;
+                        hitMaterial->sample(wo_local, wi_local, *sampler, brdf_pdf);
+                        if(iszero(wi_local)) break;
+                        wi = localToWorld(wi_local, n, s, t);
+                    }
+                    else {
+                        wi = dtree->sample(sampler->getNext2D());
+                        wi_local = worldToLocal(wi, n, s, t);
+                    }
+                    pdf = bsdfSamplingFraction*hitMaterial->pdf(wo_local, wi_local) + (1.0f - bsdfSamplingFraction)*dtree->pdf(wi);
+                    brdf_f = wi_local.y > 0.0f ? hitMaterial->f(wo_local, wi_local) : RGB(0.0f);
+                }
+                else {
+                    brdf_f = hitMaterial->sample(wo_local, wi_local, *sampler, pdf);
+                    if(iszero(wi_local)) break;
+                    wi = localToWorld(wi_local, n, s, t);
+                }
+                if(pdf == 0.0f) break;
+
+                const RGB k = 1.0f/(path.roulette*pdf) * std::abs(wi_local.y) * brdf_f;
+                if(isnan(k) || isinf(k) || iszero(k)) break;
+
+                //次の頂点へ
+                path.throughput *= k;
+                if(training && dtree && nVertices < maxGuidingVertices)
+                    vertices[nVertices++] = GuidingVertex(dtree, wi, path.throughput, pdf);
+                path.ray = Ray(res.hitPos, wi);
+                path.depth++;
+            }
+
+            if(training) {
+                for(int v = 0; v < nVertices; v++)
+                    vertices[v].dtree->record(vertices[v].wi, luminance(vertices[v].radiance)/vertices[v].pdf);
+            }
+            return L;
+        };
+
+
+        RGB radiance(const Ray& ray, const Scene& scene) const {
+            return Li(ray, scene);
+        };
+
+
+    private:
+        mutable SDTree sdTree;
+        mutable bool training = false;
+        mutable bool trained = false;
+
+        //記録する頂点の数の上限
+        static constexpr int maxGuidingVertices = 32;
+        struct GuidingVertex {
+            DTreeWrapper* dtree;
+            Vec3 wi;
+            //この頂点で方向を選んだ後のスループット
+            RGB throughput;
+            float pdf;
+            //wiから届いた放射輝度
+            RGB radiance;
+
+            GuidingVertex() {};
+            GuidingVertex(DTreeWrapper* _dtree, const Vec3& _wi, const RGB& _throughput, float _pdf) : dtree(_dtree), wi(_wi), throughput(_throughput), pdf(_pdf) {};
+        };
+
+
+        //パスの寄与cをLに加え それまでの頂点に届いた放射輝度にも加える
+        static void addRadiance(RGB& L, const RGB& c, GuidingVertex* vertices, int nVertices) {
+            L += c;
+            for(int v = 0; v < nVertices; v++) {
+                const RGB& tp = vertices[v].throughput;
+                vertices[v].radiance += RGB(tp.x > 0.0f ? c.x/tp.x : 0.0f, tp.y > 0.0f ? c.y/tp.y : 0.0f, tp.z > 0.0f ? c.z/tp.z : 0.0f);
+            }
+        };
+
+
+        //2^k sppずつ描画してSD-treeを学習する 学習中の画像は捨てる
+        void train(const Scene& scene) const {
+            Timer timer;
+            timer.start();
+            sdTree.clear(scene.accel->worldBound());
+            sdTree.streeThreshold = spatialThreshold;
+            //全ビューのレイで学習する
+            const std::vector<View> views = makeViews();
+            const std::vector<Tile> tiles = makeTiles(cam->film->width, cam->film->height, tileSize);
+            training = true;
+            //本番の描画と同じ乱数を使わないように pixelSamples番目以降のサンプル番号で学習する
+            int sampleStart = pixelSamples;
+            for(int iter = 0; iter < trainingIterations; iter++) {
+                renderTiles(scene, views, tiles, sampleStart, sampleStart + (1 << iter));
+                sampleStart += 1 << iter;
+                sdTree.update(iter);
+            }
+            training = false;
+            trained = true;
+            for(const View& view : views)
+                view.film->clear();
+            std::cout << std::endl;
+            timer.stop("Training Finished");
+            std::cout << "SD-tree: " << sdTree.dtrees.size() << " spatial leaves" << std::endl;
+        };
+};
+#endif
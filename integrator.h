@@ -2,11 +2,24 @@
 #define INTEGRATOR_H
 #include <omp.h>
 #include <memory>
+#include <atomic>
+#include <vector>
+#include <cstdint>
+#include <string>
+#include <limits>
+#include <sstream>
+#include <chrono>
+#include <functional>
 #include "camera.h"
 #include "film.h"
 #include "sampler.h"
 #include "timer.h"
+#include "tile.h"
+#include "checkpoint.h"
+#include "aov.h"
+#include "denoiser.h"
 #include "util.h"
+#include "perthread.h"
 class Integrator {
     public:
         std::shared_ptr<Camera> cam;
@@ -272,40 +285,462 @@ class PathTraceDepthRenderer : public Integrator {
 };
 
 
-class PathTrace : public Integrator {
+//同時に描画する視点
+//ODSカメラの左右の目や 複数のカメラのそれぞれが1つのビューになり ビューごとにフィルムを持つ
+struct View {
+    std::shared_ptr<Camera> cam;
+    //サンプルを蓄積するフィルム 右目ではカメラのフィルムとは別に確保する
+    std::shared_ptr<Film> film;
+    //AOVを記録しない場合はnullptr
+    std::shared_ptr<AOVFilm> aovs;
+    bool isLeft;
+    //出力ファイル名に付ける名前 ビューが1つなら空
+    std::string label;
+
+    View(std::shared_ptr<Camera> _cam, std::shared_ptr<Film> _film, bool _isLeft, const std::string& _label = "") : cam(_cam), film(_film), isLeft(_isLeft), label(_label) {};
+
+    //baseにラベルを付けたファイル名 (output, "") -> output.ppm, (spp, left) -> spp_left.ppm
+    std::string filename(const std::string& base) const {
+        if(label.empty()) return base + ".ppm";
+        return base.empty() ? label + ".ppm" : base + "_" + label + ".ppm";
+    };
+};
+
+
+//タイル単位でピクセルを並列に処理するIntegrator
+//スレッドはMorton順に並んだタイルを空いたものから取っていき、タイル内の全サンプル(あるいはtileSamples個)を計算してから次のタイルに移る
+//サンプルごとにスレッド間の同期を取る必要がなく、Filmへの書き込みもタイル内の行方向に連続する
+//ODSの両目や複数のカメラは全ビューのタイルを1つのプールに入れて同時に描画する
+//派生クラスは1サンプル分の放射輝度を返すradianceを実装する
+class TiledIntegrator : public Integrator {
     public:
         int pixelSamples;
         int maxDepth;
+        //タイルの一辺のピクセル数
+        int tileSize = 16;
+        //タイルを一度に処理するサンプル数 0なら全サンプルを一度に処理する
+        int tileSamples = 0;
+        //描画時間の上限[秒] 0なら制限しない
+        //指定した場合pixelSamplesは最大サンプル数になり 期限を過ぎたら各ピクセルのサンプル数で割って打ち切る
+        float timeLimit = 0.0f;
+        //適応的サンプリング
+        //パイロットパスの後 相対誤差がしきい値を下回るまで未収束のピクセルだけにサンプルを追加する
+        //pixelSamplesはピクセルあたりの最大サンプル数になる
+        bool adaptive = false;
+        int pilotSamples = 16;
+        float errorThreshold = 0.02f;
+        //ピクセルごとのサンプル数を画像として書き出すか
+        bool sppMap = false;
+        //参照画像 指定されていれば描画後にRMSEを表示する
+        std::string reference;
+        //Scene::lightSamplerがある場合に1頂点あたりに選ぶ光源の数
+        int lightSamples = 1;
+        //チェックポイントの書き出し先 空なら書き出さない
+        std::string checkpointPath;
+        //チェックポイントを書き出す間隔[秒]
+        float checkpointInterval = 300.0f;
+        //シーンファイルのハッシュ チェックポイントに記録する
+        uint64_t sceneHash = 0;
+        //チェックポイントから再開する場合の完了済みサンプル数と 全ビューのピクセルをビューの順に並べたもの
+        //乱数の状態は復元済みであるとする
+        int resumeSamples = 0;
+        std::vector<Film::Pixel> resumePixels;
+        //描画後にアルベド, 法線, 深度を使ってデノイズする
+        bool denoise = false;
+        //特徴量を求めるときのピクセルあたりのレイの数
+        int featureSamples = 4;
+        //AOVを記録するか
+        bool aov = false;
+        //camと同時に描画するカメラ それぞれ自分のフィルムを持つ
+        std::vector<std::shared_ptr<Camera>> extraCameras;
+        //カメラが複数の場合に出力ファイル名に付ける名前 camが先頭 足りなければcamera0, camera1, ...
+        std::vector<std::string> cameraNames;
+
+        TiledIntegrator(std::shared_ptr<Camera> _cam, std::shared_ptr<Sampler> _sampler, int _pixelSamples, int _maxDepth) : Integrator(_cam, _sampler), pixelSamples(_pixelSamples), maxDepth(_maxDepth) {};
+
+        //カメラレイ1本に対する寄与を返す
+        virtual RGB radiance(const Ray& ray, const Scene& scene) const = 0;
+        //AOVを記録しながらradianceを計算する
+        //対応していない積分器では最初の衝突点だけを別のレイで求め 寄与は分割せずに間接光に入れる
+        virtual RGB radianceAOV(const Ray& ray, const Scene& scene, AOVSample& aov) const {
+            Hit res;
+            if(scene.intersect(ray, res))
+                aov.recordFirstHit(ray, res);
+            const RGB L = radiance(ray, scene);
+            aov.indirect += L;
+            return L;
+        };
 
-        PathTrace(std::shared_ptr<Camera> _cam, std::shared_ptr<Sampler> _sampler, int _pixelSamples, int _maxDepth) : Integrator(_cam, _sampler), pixelSamples(_pixelSamples), maxDepth(_maxDepth) {};
 
-        RGB Li(const Ray& ray, const Scene& scene, int depth = 0, float roulette = 1.0f) const {
-            //ロシアンルーレット
-            if(depth > 10) {
-                if(sampler->getNext() < 1.0f - roulette) {
-                    return RGB(0.0f);
+        void render(const Scene& scene) const {
+            Timer timer;
+            const std::vector<View> views = makeViews();
+            const std::vector<Tile> tiles = makeTiles(views[0].film->width, views[0].film->height, tileSize);
+            //時間制限がある場合は全ピクセルのサンプル数が揃うように1サンプルずつ処理する
+            //チェックポイントはパスの区切りでしか書けないので 最初は1サンプルで処理し その時間からcheckpointInterval分のサンプル数を求めて以降のパスの大きさにする
+            int batch = tileSamples > 0 ? std::min(tileSamples, pixelSamples) : (checkpointPath.empty() && timeLimit <= 0.0f ? pixelSamples : 1);
+            const bool growBatch = tileSamples <= 0 && !checkpointPath.empty() && timeLimit <= 0.0f;
+
+            //チェックポイントから再開する
+            int kStart = 0;
+            if(!resumePixels.empty()) {
+                auto src = resumePixels.begin();
+                for(const View& view : views) {
+                    const int n = view.film->width*view.film->height;
+                    std::copy(src, src + n, view.film->pixels);
+                    src += n;
                 }
-                roulette *= 0.9f;
+                kStart = resumeSamples;
             }
 
-            if(depth > maxDepth)
-                return RGB(0.0f);
+            //パスが終わるたびに呼ばれ 前回から一定時間が経っていればチェックポイントを書き出す
+            CheckpointWriter writer(checkpointPath);
+            auto lastCheckpoint = std::chrono::steady_clock::now();
+            const std::function<void(int)> passDone = [&](int samples) {
+                if(checkpointPath.empty()) return;
+                const auto now = std::chrono::steady_clock::now();
+                if(std::chrono::duration<float>(now - lastCheckpoint).count() < checkpointInterval) return;
+
+                Checkpoint ckpt;
+                ckpt.sceneHash = sceneHash;
+                ckpt.width = views[0].film->width;
+                ckpt.height = views[0].film->height;
+                ckpt.views = views.size();
+                ckpt.samples = samples;
+                for(const View& view : views)
+                    ckpt.pixels.insert(ckpt.pixels.end(), view.film->pixels, view.film->pixels + ckpt.width*ckpt.height);
+                std::ostringstream rng;
+                sampler->saveState(rng);
+                ckpt.rngState = rng.str();
+                if(writer.submit(std::move(ckpt)))
+                    lastCheckpoint = now;
+            };
+
+            timer.start();
+            const auto renderStart = std::chrono::steady_clock::now();
+            const uint64_t raysStart = scene.rayCount();
+            if(timeLimit > 0.0f) {
+                deadline = renderStart + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float>(timeLimit));
+                timeLimited = true;
+            }
+            if(!adaptive) {
+                for(int k = kStart; k < pixelSamples && !timeUp(); k += batch) {
+                    const int kEnd = std::min(k + batch, pixelSamples);
+                    const auto passStart = std::chrono::steady_clock::now();
+                    renderTiles(scene, views, tiles, k, kEnd);
+                    passDone(kEnd);
+                    if(growBatch) {
+                        const float secondsPerSample = std::chrono::duration<float>(std::chrono::steady_clock::now() - passStart).count()/(kEnd - k);
+                        if(secondsPerSample > 0.0f)
+                            batch = std::max(1, std::min(pixelSamples, static_cast<int>(checkpointInterval/secondsPerSample)));
+                    }
+                }
+            }
+            else {
+                renderAdaptive(scene, views, tiles, kStart, passDone);
+            }
+            timeLimited = false;
+            std::cout << progressbar(1, 1) << " " << percentage(1, 1) << std::endl;
+            timer.stop("Rendering Finished");
+            const float seconds = std::chrono::duration<float>(std::chrono::steady_clock::now() - renderStart).count();
+            printStatistics(views, scene.rayCount() - raysStart, seconds);
+
+            for(const View& view : views) {
+                Film& film = *view.film;
+                //ピクセルごとにサンプル数が異なりうるのでそれぞれのサンプル数で割る
+                film.resolve();
+                if(denoise) {
+                    timer.start();
+                    //AOVがあれば同じカメラレイで求めた特徴量を使う
+                    FeatureBuffer features;
+                    if(view.aovs)
+                        features.load(*view.aovs);
+                    else
+                        features.render(scene, *view.cam, *sampler, featureSamples, view.isLeft);
+                    Denoiser().denoise(film, features);
+                    timer.stop("Denoising Finished");
+                }
+                film.gamma_correction();
+                film.ppm_output(view.label.empty() ? "output.ppm" : view.filename(""));
+                if(!reference.empty()) {
+                    const float error = film.rmse(reference);
+                    if(error >= 0.0f)
+                        std::cout << "RMSE against " << reference << ": " << error << std::endl;
+                    else
+                        std::cerr << "failed to compare with " << reference << std::endl;
+                }
+                if(sppMap)
+                    film.spp_output(view.filename("spp"));
+                if(view.aovs)
+                    view.aovs->ppm_output(view.label.empty() ? "" : view.label + "_");
+            }
+        };
+        void compute(const Scene& scene) const {
+            const std::vector<View> views(1, View(cam, cam->film, true));
+            const std::vector<Tile> tiles = makeTiles(cam->film->width, cam->film->height, tileSize);
+            //呼ばれるたびに次のサンプル番号を使う
+            renderTiles(scene, views, tiles, computedSamples, computedSamples + 1);
+            computedSamples++;
+        };
 
-            Hit res;
-            RGB col;
-            if(scene.intersect(ray, res)) {
+
+        //描画するビューを作る
+        //camとextraCamerasのそれぞれについて ODSカメラなら左右の目の2つ それ以外は1つ
+        std::vector<View> makeViews() const {
+            std::vector<std::shared_ptr<Camera>> cameras(1, cam);
+            cameras.insert(cameras.end(), extraCameras.begin(), extraCameras.end());
+            std::vector<View> views;
+            for(size_t c = 0; c < cameras.size(); c++) {
+                const std::shared_ptr<Camera>& camera = cameras[c];
+                std::string name;
+                if(cameras.size() > 1)
+                    name = c < cameraNames.size() ? cameraNames[c] : "camera" + std::to_string(c);
+                if(!camera->two_eyes) {
+                    views.emplace_back(camera, camera->film, true, name);
+                }
+                else {
+                    const std::string prefix = name.empty() ? "" : name + "_";
+                    views.emplace_back(camera, camera->film, true, prefix + "left");
+                    //タイル描画ではフィルタを使わない
+                    views.emplace_back(camera, std::make_shared<Film>(camera->film->width, camera->film->height, nullptr), false, prefix + "right");
+                }
+            }
+            if(aov) {
+                for(View& view : views)
+                    view.aovs = std::make_shared<AOVFilm>(view.film->width, view.film->height);
+            }
+            return views;
+        };
+
+
+        //パイロットパスの後 未収束のピクセルにだけサンプルを追加していく
+        //kStart > 0の場合はパイロットパスを終えたところから再開する
+        void renderAdaptive(const Scene& scene, const std::vector<View>& views, const std::vector<Tile>& tiles, int kStart, const std::function<void(int)>& passDone) const {
+            const int width = views[0].film->width;
+            const int height = views[0].film->height;
+            const int nViews = views.size();
+            const int pilot = std::min(pilotSamples, pixelSamples);
+            const int step = tileSamples > 0 ? tileSamples : std::max(pilot, 1);
+
+            if(kStart < pilot) {
+                renderTiles(scene, views, tiles, 0, pilot);
+                passDone(pilot);
+            }
+
+            //ビューの順に並べた全ピクセルの印
+            std::vector<uint8_t> active(nViews*width*height);
+            for(int k = std::max(kStart, pilot); k < pixelSamples && !timeUp(); k += step) {
+                //まだサンプルが必要なピクセルに印をつける
+                int nActive = 0;
+                for(int v = 0; v < nViews; v++) {
+                    const Film& film = *views[v].film;
+                    uint8_t* flags = active.data() + v*width*height;
+                    #pragma omp parallel for schedule(static) reduction(+:nActive)
+                    for(int j = 0; j < height; j++) {
+                        for(int i = 0; i < width; i++) {
+                            const bool a = film.pixels[i + width*j].nsamples < pixelSamples && film.relativeError(i, j) > errorThreshold;
+                            flags[i + width*j] = a;
+                            nActive += a;
+                        }
+                    }
+                }
+                if(nActive == 0) break;
+
+                renderTiles(scene, views, tiles, k, std::min(k + step, pixelSamples), &active);
+                passDone(std::min(k + step, pixelSamples));
+            }
+
+            long long totalSamples = 0;
+            for(const View& view : views) {
+                for(int n = 0; n < width*height; n++)
+                    totalSamples += view.film->pixels[n].nsamples;
+            }
+            std::cout << std::endl << "adaptive sampling: average " << (float)totalSamples/(nViews*width*height) << "spp (max " << pixelSamples << "spp)" << std::endl;
+        };
+
+
+        //[sampleStart, sampleEnd)番目のサンプルを全ビューの全タイルについて計算する
+        //同じタイルの各ビューを続けて処理するので 両目のように近いレイはまとめて追跡される
+        //activeが与えられた場合は印のついたピクセルだけを計算する
+        //時間制限を過ぎたら残りのタイルは飛ばす ただし最初のサンプルは全ピクセルで計算する
+        //画面全体をまとめて処理する派生クラスはこれを上書きする
+        virtual void renderTiles(const Scene& scene, const std::vector<View>& views, const std::vector<Tile>& tiles, int sampleStart, int sampleEnd, const std::vector<uint8_t>* active = nullptr) const {
+            const int nViews = views.size();
+            const int nItems = tiles.size()*nViews;
+            const int width = views[0].film->width;
+            const int height = views[0].film->height;
+            std::atomic<int> finished(0);
+            #pragma omp parallel for schedule(dynamic, 1)
+            for(int n = 0; n < nItems; n++) {
+                const Tile& tile = tiles[n/nViews];
+                const int v = n%nViews;
+                const View& view = views[v];
+                const uint8_t* flags = active ? active->data() + v*width*height : nullptr;
+                for(int k = sampleStart; k < sampleEnd; k++) {
+                    if(k > 0 && timeUp()) break;
+                    for(int j = tile.y0; j < tile.y1; j++) {
+                        for(int i = tile.x0; i < tile.x1; i++) {
+                            if(flags && !flags[i + width*j]) continue;
+                            //乱数はビューとピクセルとサンプル番号から決まるので どのスレッドが計算しても同じ結果になる
+                            sampler->startPixelSample((uint64_t)(v*height + j)*width + i, k);
+                            view.film->addSample(i, j, samplePixel(scene, view, i, j));
+                        }
+                    }
+                }
+
+                const int done = ++finished;
+                if(omp_get_thread_num() == 0) {
+                    const float progress = sampleStart + (float)done/nItems*(sampleEnd - sampleStart);
+                    std::cout << progressbar(progress, pixelSamples) << " " << percentage(progress, pixelSamples) << '\r' << std::flush;
+                }
+            }
+        };
+
+
+        //描画時間の上限を過ぎたか
+        bool timeUp() const {
+            return timeLimited && std::chrono::steady_clock::now() >= deadline;
+        };
+
+
+        //達成したサンプル数とレイの速度を表示する
+        void printStatistics(const std::vector<View>& views, uint64_t rays, float seconds) const {
+            long long totalSamples = 0;
+            int minSamples = std::numeric_limits<int>::max();
+            int maxSamples = 0;
+            long long nPixels = 0;
+            for(const View& view : views) {
+                const int n = view.film->width*view.film->height;
+                for(int k = 0; k < n; k++) {
+                    const int ns = view.film->pixels[k].nsamples;
+                    totalSamples += ns;
+                    minSamples = std::min(minSamples, ns);
+                    maxSamples = std::max(maxSamples, ns);
+                }
+                nPixels += n;
+            }
+            std::cout << "samples: average " << (float)totalSamples/nPixels << "spp (min " << minSamples << ", max " << maxSamples << ")" << std::endl;
+            std::cout << "rays: " << rays << " (" << (seconds > 0.0f ? rays/seconds/1e6f : 0.0f) << "M rays/s)" << std::endl;
+        };
+
+
+        //1頂点での光源サンプリングの回数
+        //lightSamplerがなければ全光源を1回ずつサンプリングする
+        int lightCount(const Scene& scene) const {
+            return scene.lightSampler ? lightSamples : scene.lights.size();
+        };
+        //l番目の光源サンプリングで使う光源を選ぶ
+        //pmfにはその光源が選ばれる確率とサンプリング回数の積を返す
+        const Light* pickLight(const Scene& scene, const Hit& res, int l, float& pmf) const {
+            if(!scene.lightSampler) {
+                pmf = 1.0f;
+                return scene.lights[l].get();
+            }
+            const Light* light = scene.lightSampler->sample(res, sampler->getNext(), pmf);
+            pmf *= lightSamples;
+            return light;
+        };
+        //resでの光源サンプリングでlightが選ばれる確率 MISの重みに使う
+        float lightPmf(const Scene& scene, const Hit& res, const Light* light) const {
+            if(!scene.lightSampler) return 1.0f;
+            return lightSamples * scene.lightSampler->pmf(res, light);
+        };
+
+
+        //カメラ(ピクセル内の位置とレンズ)に使う次元の数と 反射1回に割り当てる次元の数
+        //低食い違い量列の同じ次元が反射ごとに同じ用途に使われるようにする
+        static constexpr int cameraDimensions = 4;
+        static constexpr int bounceDimensions = 8;
+        static uint32_t bounceDimension(int depth) {
+            return cameraDimensions + depth*bounceDimensions;
+        };
+
+
+        //ビューのピクセル(i, j)の1サンプルを計算する
+        //ピクセル以外にも寄与を加える派生クラスはこれを上書きする
+        virtual RGB samplePixel(const Scene& scene, const View& view, int i, int j) const {
+            const float rx = sampler->getNext();
+            const float ry = sampler->getNext();
+            const Vec2 uv = view.cam->rasterToUV(i + rx, j + ry);
+            float w;
+            Ray ray = view.cam->getRay(uv.x, uv.y, w, *sampler, view.isLeft);
+            if(view.aovs) {
+                AOVSample aov;
+                const RGB L = w*radianceAOV(ray, scene, aov);
+                aov.direct *= w;
+                aov.indirect *= w;
+                view.aovs->addSample(i, j, aov);
+                return L;
+            }
+            return w*radiance(ray, scene);
+        };
+
+
+    private:
+        //computeで計算したサンプル数
+        mutable int computedSamples = 0;
+        //timeLimitがある場合のrender中の期限
+        mutable std::chrono::steady_clock::time_point deadline;
+        mutable bool timeLimited = false;
+};
+
+
+//パスの追跡状態
+//Liは再帰せずにこの状態を更新しながら反射ごとにループする
+struct PathState {
+    Ray ray;
+    //これまでの頂点での係数の積
+    RGB throughput;
+    int depth;
+    float roulette;
+
+    PathState(const Ray& _ray) : ray(_ray), throughput(RGB(1.0f)), depth(0), roulette(1.0f) {};
+};
+
+
+class PathTrace : public TiledIntegrator {
+    public:
+        PathTrace(std::shared_ptr<Camera> _cam, std::shared_ptr<Sampler> _sampler, int _pixelSamples, int _maxDepth) : TiledIntegrator(_cam, _sampler, _pixelSamples, _maxDepth) {};
+
+        //aovが与えられた場合は最初の衝突点と 反射回数で分けた寄与を記録する
+        RGB Li(const Ray& _ray, const Scene& scene, AOVSample* aov = nullptr) const {
+            RGB L;
+            PathState path(_ray);
+            while(true) {
+                //反射ごとに決まった次元の乱数を使う
+                sampler->startDimension(bounceDimension(path.depth));
+                //ロシアンルーレット
+                if(path.depth > 10) {
+                    if(sampler->getNext() < 1.0f - path.roulette) {
+                        break;
+                    }
+                    path.roulette *= 0.9f;
+                }
+
+                if(path.depth > maxDepth)
+                    break;
+
+                Hit res;
+                if(!scene.intersect(path.ray, res)) {
+                    const RGB c = path.throughput * scene.sky->getSky(path.ray);
+                    L += c;
+                    if(aov) aov->addRadiance(c, path.depth);
+                    break;
+                }
+                if(aov && path.depth == 0)
+                    aov->recordFirstHit(path.ray, res);
                 //もし光源に当たったら終了
                 if(res.hitPrimitive->areaLight != nullptr) {
-                    return res.hitPrimitive->areaLight->Le(res)/roulette;
+                    const RGB c = path.throughput * res.hitPrimitive->areaLight->Le(res)/path.roulette;
+                    L += c;
+                    if(aov) aov->addRadiance(c, path.depth);
+                    break;
                 }
                 //マテリアル
-                const std::shared_ptr<Material> hitMaterial = res.hitPrimitive->material;
+                const Material* hitMaterial = res.hitPrimitive->material.get();
 
                 //ローカル座標系の構築
-                const Vec3 wo = -ray.direction;
-                if(iszero(wo)) {
-                    std::cout << res.t << std::endl;
-                }
+                const Vec3 wo = -path.ray.direction;
                 const Vec3 n = res.hitNormal;
                 const Vec3 s = res.dpdu;
                 const Vec3 t = normalize(cross(s, n));
@@ -317,7 +752,7 @@ class PathTrace : public Integrator {
                 float brdf_pdf = 1.0f;
                 const RGB brdf_f = hitMaterial->sample(wo_local, wi_local, *sampler, brdf_pdf);
                 //もしサンプリングが失敗したら終了
-                if(iszero(wi_local)) return RGB(0.0f);
+                if(iszero(wi_local)) break;
                 //サンプリングされた方向をワールド座標系に戻す
                 Vec3 wi = localToWorld(wi_local, n, s, t);
 
@@ -327,7 +762,7 @@ class PathTrace : public Integrator {
 
 
                 //係数
-                RGB k = 1.0f/(roulette*brdf_pdf) * cos_term * brdf_f;
+                RGB k = 1.0f/(path.roulette*brdf_pdf) * cos_term * brdf_f;
                 if(k.x < 0.0f || k.y < 0.0f || k.z < 0.0f) {
                     std::cout << "minus k detected" << std::endl;
                     std::cout << "wo: " << wo << std::endl;
@@ -344,154 +779,89 @@ class PathTrace : public Integrator {
                     std::cout << "inf or nan k detected" << std::endl;
                     std::cout << "brdf_pdf: " << brdf_pdf << std::endl;
                     std::cout << "brdf_f: " << brdf_f << std::endl;
-                    return RGB(0);
+                    break;
                 }
 
-                //レンダリング方程式の計算
-                Ray nextRay(res.hitPos, wi);
-                col += k * Li(nextRay, scene, depth + 1, roulette);
+                //次の頂点へ
+                path.throughput *= k;
+                path.ray = Ray(res.hitPos, wi);
+                path.depth++;
             }
-            else {
-                col = scene.sky->getSky(ray);
-            }
-            return col;
+            return L;
         };
 
 
-        void render(const Scene& scene) const {
-            Timer timer;
-            if(!cam->two_eyes) {
-                timer.start();
-                for(int k = 0; k < pixelSamples; k++) {
-                    #pragma omp parallel for schedule(dynamic, 1)
-                    for(int i = 0; i < cam->film->width; i++) {
-                        for(int j = 0; j < cam->film->height; j++) {
-                            float rx = sampler->getNext();
-                            float ry = sampler->getNext();
-                            float px = i + rx;
-                            float py = j + ry;
-                            float u = (2.0*(i + rx) - cam->film->width)/cam->film->height;
-                            float v = -(2.0*(j + ry) - cam->film->height)/cam->film->height;
-                            float w;
-                            Ray ray = cam->getRay(u, v, w, *sampler);
-                            RGB col = Li(ray, scene);
-                            cam->film->addSample(i, j, w*col);
-                        }
-                    }
-                    std::cout << progressbar(k, pixelSamples) << " " << percentage(k, pixelSamples) << '\r' << std::flush;
-                }
-                timer.stop("Rendering Finished");
-                cam->film->divide(pixelSamples);
-                cam->film->gamma_correction();
-                cam->film->ppm_output("output.ppm");
-            }
-            else {
-                timer.start();
-                for(int k = 0; k < pixelSamples; k++) {
-                    #pragma omp parallel for schedule(dynamic, 1)
-                    for(int i = 0; i < cam->film->width; i++) {
-                        for(int j = 0; j < cam->film->height; j++) {
-                            float rx = sampler->getNext();
-                            float ry = sampler->getNext();
-                            float px = i + rx;
-                            float py = j + ry;
-                            float u = (2.0*(i + rx) - cam->film->width)/cam->film->width;
-                            float v = -(2.0*(j + ry) - cam->film->height)/cam->film->height;
-                            float w;
-                            Ray ray = cam->getRay(u, v, w, *sampler);
-                            RGB col = Li(ray, scene);
-                            cam->film->addSample(i, j, w*col);
-                        }
-                    }
-                    std::cout << progressbar(k, pixelSamples) << " " << percentage(k, pixelSamples) << '\r' << std::flush;
-                }
-                timer.stop("Rendering Finished");
-                cam->film->divide(pixelSamples);
-                cam->film->gamma_correction();
-                cam->film->ppm_output("left.ppm");
-
-                timer.start();
-                cam->film->clear();
-                for(int k = 0; k < pixelSamples; k++) {
-                    #pragma omp parallel for schedule(dynamic, 1)
-                    for(int i = 0; i < cam->film->width; i++) {
-                        for(int j = 0; j < cam->film->height; j++) {
-                            float rx = sampler->getNext();
-                            float ry = sampler->getNext();
-                            float px = i + rx;
-                            float py = j + ry;
-                            float u = (2.0*(i + rx) - cam->film->width)/cam->film->width;
-                            float v = -(2.0*(j + ry) - cam->film->height)/cam->film->height;
-                            float w;
-                            Ray ray = cam->getRay(u, v, w, *sampler, false);
-                            RGB col = Li(ray, scene);
-                            cam->film->addSample(i, j, w*col);
-                        }
-                    }
-                    std::cout << progressbar(k, pixelSamples) << " " << percentage(k, pixelSamples) << '\r' << std::flush;
-                }
-                timer.stop("Rendering Finished");
-                cam->film->divide(pixelSamples);
-                cam->film->gamma_correction();
-                cam->film->ppm_output("right.ppm");
-
-            }
+        RGB radiance(const Ray& ray, const Scene& scene) const {
+            return Li(ray, scene);
         };
-        void compute(const Scene& scene) const {
-            #pragma omp parallel for schedule(dynamic, 1)
-            for(int i = 0; i < cam->film->width; i++) {
-                for(int j = 0; j < cam->film->height; j++) {
-                    float rx = sampler->getNext();
-                    float ry = sampler->getNext();
-                    float px = i + rx;
-                    float py = j + ry;
-                    float u = (2.0*(i + rx) - cam->film->width)/cam->film->height;
-                    float v = -(2.0*(j + ry) - cam->film->height)/cam->film->height;
-                    float w;
-                    Ray ray = cam->getRay(u, v, w, *sampler);
-                    RGB col = Li(ray, scene);
-                    cam->film->addSample(i, j, w*col);
-                }
-            }
+        RGB radianceAOV(const Ray& ray, const Scene& scene, AOVSample& aov) const {
+            return Li(ray, scene, &aov);
         };
 };
 
 
-class PathTraceExplicit : public Integrator {
+class PathTraceExplicit : public TiledIntegrator {
     public:
-        int pixelSamples;
-        int maxDepth;
+        //点光源と平行光源へのシャドウレイを遮った物体をスレッドごと光源ごとに覚えておき 次はまずそれと交差判定する
+        //隣り合う衝突点は同じ物体(木の葉など)に遮られることが多いので BVHをたどる回数が減る
+        bool occluderCache = true;
+
+        PathTraceExplicit(std::shared_ptr<Camera> _cam, std::shared_ptr<Sampler> _sampler, int _pixelSamples, int _maxDepth) : TiledIntegrator(_cam, _sampler, _pixelSamples, _maxDepth) {};
 
-        PathTraceExplicit(std::shared_ptr<Camera> _cam, std::shared_ptr<Sampler> _sampler, int _pixelSamples, int _maxDepth) : Integrator(_cam, _sampler), pixelSamples(_pixelSamples), maxDepth(_maxDepth) {};
 
-        RGB Li(const Ray& ray, const Scene& scene, Vec3& hit_le, int depth = 0, float roulette = 1.0f) const {
-            //ロシアンルーレット
-            if(depth > 10) {
-                if(sampler->getNext() < 1.0f - roulette) {
-                    return RGB(0.0f);
+        void render(const Scene& scene) const {
+            //描画を始める時点のスレッド数で作り直す
+            occluderCaches = PerThread<OccluderCache>();
+            TiledIntegrator::render(scene);
+            if(occluderCache)
+                printOccluderCacheStatistics();
+        };
+
+        //aovが与えられた場合は最初の衝突点と 反射回数で分けた寄与を記録する
+        RGB Li(const Ray& _ray, const Scene& scene, Vec3& hit_le, AOVSample* aov = nullptr) const {
+            RGB L;
+            PathState path(_ray);
+            //直前の頂点で光源サンプリングをしなかったか カメラレイも含む
+            bool specularBounce = true;
+            while(true) {
+                //反射ごとに決まった次元の乱数を使う
+                sampler->startDimension(bounceDimension(path.depth));
+                //ロシアンルーレット
+                if(path.depth > 10) {
+                    if(sampler->getNext() < 1.0f - path.roulette) {
+                        break;
+                    }
+                    path.roulette *= 0.9f;
                 }
-                roulette *= 0.9f;
-            }
 
-            if(depth > maxDepth)
-                return RGB(0.0f);
+                if(path.depth > maxDepth)
+                    break;
 
-            Hit res;
-            RGB col;
-            if(scene.intersect(ray, res)) {
+                Hit res;
+                if(!scene.intersect(path.ray, res)) {
+                    //環境光を光源サンプリングしている場合は二重に数えないようにする
+                    if(!scene.envLight || specularBounce) {
+                        const RGB c = path.throughput * scene.sky->getSky(path.ray);
+                        L += c;
+                        if(aov) aov->addRadiance(c, path.depth);
+                    }
+                    break;
+                }
+                if(aov && path.depth == 0)
+                    aov->recordFirstHit(path.ray, res);
                 //光源に当たった場合
                 if(res.hitPrimitive->areaLight != nullptr) {
                     //直接光源に当たった場合
-                    if(depth == 0) {
+                    if(path.depth == 0) {
                         hit_le = res.hitPrimitive->areaLight->Le(res);
                     }
-                    return RGB(0.0f);
+                    break;
                 }
 
                 //マテリアル
-                const std::shared_ptr<Material> hitMaterial = res.hitPrimitive->material;
+                const Material* hitMaterial = res.hitPrimitive->material.get();
                 //ローカル座標系の構築
-                const Vec3 wo = -ray.direction;
+                const Vec3 wo = -path.ray.direction;
                 const Vec3 n = res.hitNormal;
                 const Vec3 s = res.dpdu;
                 const Vec3 t = normalize(cross(s, n));
@@ -500,12 +870,19 @@ class PathTraceExplicit : public Integrator {
 
                 //各光源からの寄与を計算
                 //DiffuseあるいはGlossyの場合のみに寄与を計算する
+                RGB Ld;
                 if(hitMaterial->type == MATERIAL_TYPE::DIFFUSE || hitMaterial->type == MATERIAL_TYPE::GLOSSY) {
-                    for(const std::shared_ptr<Light> light : scene.lights) {
+                    const int nLights = lightCount(scene);
+                    for(int l = 0; l < nLights; l++) {
+                        //光源を選ぶ
+                        float light_pmf;
+                        const Light* light = pickLight(scene, res, l, light_pmf);
+                        if(light == nullptr) continue;
                         //光源上で点をサンプリング
                         float light_pdf = 1.0f;
                         Vec3 wi_light;
                         const RGB le = light->sample(res, *sampler, wi_light, light_pdf);
+                        light_pdf *= light_pmf;
                         const Vec3 wi_light_local = worldToLocal(wi_light, n, s, t);
 
                         //光源に向かうシャドウレイを生成
@@ -515,23 +892,23 @@ class PathTraceExplicit : public Integrator {
                         if(light->type == LIGHT_TYPE::AREA) {
                         //シャドウレイが物体に当たったとき、それがサンプリング生成元の光源だった場合は寄与を蓄積
                             if(scene.intersect(shadowRay, shadow_res)) {
-                                if(shadow_res.hitPrimitive->areaLight == light) {
-                                    col += hitMaterial->f(wo_local, wi_light_local) * le/light_pdf * std::max(wi_light_local.y, 0.0f);
-                                }
-                                else {
-                                    //std::cout << "shadow ray missed" << std::endl;
+                                if(shadow_res.hitPrimitive->areaLight.get() == light) {
+                                    Ld += hitMaterial->f(wo_local, wi_light_local) * le/light_pdf * std::max(wi_light_local.y, 0.0f);
                                 }
                             }
                         }
-                        //PointLight
-                        else if(light->type == LIGHT_TYPE::POINT) {
-                            if(!scene.intersect(shadowRay, shadow_res))
-                                col += hitMaterial->f(wo_local, wi_light_local) * le/light_pdf * std::max(wi_light_local.y, 0.0f);
+                        //PointLight, DirectionalLight
+                        else if(light->isDelta()) {
+                            //点光源より向こうの物体には遮られない
+                            if(light->type == LIGHT_TYPE::POINT)
+                                shadowRay.tmax = (static_cast<const PointLight*>(light)->lightPos - res.hitPos).length();
+                            if(!occluded(scene, shadowRay, light, path.depth))
+                                Ld += hitMaterial->f(wo_local, wi_light_local) * le/light_pdf * std::max(wi_light_local.y, 0.0f);
                         }
-                        //DirectionalLight
-                        else if(light->type == LIGHT_TYPE::DIRECTIONAL) {
+                        //EnvironmentLight
+                        else if(light->type == LIGHT_TYPE::ENVIRONMENT) {
                             if(!scene.intersect(shadowRay, shadow_res))
-                                col += hitMaterial->f(wo_local, wi_light_local) * le/light_pdf * std::max(wi_light_local.y, 0.0f);
+                                Ld += hitMaterial->f(wo_local, wi_light_local) * le/light_pdf * std::max(wi_light_local.y, 0.0f);
                         }
                     }
                 }
@@ -542,7 +919,8 @@ class PathTraceExplicit : public Integrator {
                 float brdf_pdf = 1.0f;
                 const RGB brdf_f = hitMaterial->sample(wo_local, wi_local, *sampler, brdf_pdf);
                 //もしサンプリングが失敗したら終了
-                if(iszero(wi_local)) return RGB(0.0f);
+                //再帰版と同じく、この頂点での直接光の寄与も捨てる
+                if(iszero(wi_local)) break;
                 //サンプリングされた方向をワールド座標系に戻す
                 Vec3 wi = localToWorld(wi_local, n, s, t);
 
@@ -552,7 +930,7 @@ class PathTraceExplicit : public Integrator {
 
 
                 //係数
-                RGB k = 1.0f/(roulette*brdf_pdf) * cos_term * brdf_f;
+                RGB k = 1.0f/(path.roulette*brdf_pdf) * cos_term * brdf_f;
                 if(k.x < 0.0f || k.y < 0.0f || k.z < 0.0f) {
                     std::cout << "minus k detected" << std::endl;
                     std::cout << "wo: " << wo << std::endl;
@@ -567,140 +945,285 @@ class PathTraceExplicit : public Integrator {
                 }
                 if(isnan(k) || isinf(k)) {
                     std::cout << "inf or nan k detected" << std::endl;
-                    return RGB(0);
+                    break;
                 }
 
-                //レンダリング方程式の計算
-                Ray nextRay(res.hitPos, wi);
-                col += k * Li(nextRay, scene, hit_le, depth + 1, roulette);
+                //次の頂点へ
+                L += path.throughput * Ld;
+                if(aov) aov->addRadiance(path.throughput * Ld, path.depth + 1);
+                path.throughput *= k;
+                path.ray = Ray(res.hitPos, wi);
+                path.depth++;
+                specularBounce = hitMaterial->type == MATERIAL_TYPE::SPECULAR;
             }
-            else {
-                col = scene.sky->getSky(ray);
+            return L;
+        };
+
+
+        RGB radiance(const Ray& ray, const Scene& scene) const {
+            Vec3 hit_le;
+            RGB col = Li(ray, scene, hit_le);
+            //カメラレイが直接光源に当たった場合は光源の放射輝度
+            if(nonzero(hit_le))
+                return hit_le;
+            return col;
+        };
+        RGB radianceAOV(const Ray& ray, const Scene& scene, AOVSample& aov) const {
+            Vec3 hit_le;
+            RGB col = Li(ray, scene, hit_le, &aov);
+            if(nonzero(hit_le)) {
+                aov.direct = hit_le;
+                aov.indirect = RGB(0.0f);
+                return hit_le;
             }
             return col;
         };
 
 
-        void render(const Scene& scene) const {
-            Timer timer;
-            if(!cam->two_eyes) {
-                timer.start();
-                for(int k = 0; k < pixelSamples; k++) {
-                    #pragma omp parallel for schedule(dynamic, 1)
-                    for(int i = 0; i < cam->film->width; i++) {
-                        for(int j = 0; j < cam->film->height; j++) {
-                            float rx = sampler->getNext();
-                            float ry = sampler->getNext();
-                            float px = i + rx;
-                            float py = j + ry;
-                            float u = (2.0*(i + rx) - cam->film->width)/cam->film->height;
-                            float v = -(2.0*(j + ry) - cam->film->height)/cam->film->height;
-                            float w;
-                            Ray ray = cam->getRay(u, v, w, *sampler);
-                            Vec3 hit_le;
-                            RGB col = Li(ray, scene, hit_le);
-                            if(!nonzero(hit_le)) {
-                                cam->film->addSample(i, j, w*col);
-                            }
-                            else {
-                                cam->film->addSample(i, j, w*hit_le);
-                            };
-                        }
-                    }
-                    std::cout << progressbar(k, pixelSamples) << " " << percentage(k, pixelSamples) << '\r' << std::flush;
-                }
-                timer.stop("Rendering Finished");
-                cam->film->divide(pixelSamples);
-                cam->film->gamma_correction();
-                cam->film->ppm_output("output.ppm");
+    protected:
+        //デルタ光源lightに向かうシャドウレイが遮られるか depthはシャドウレイを飛ばす頂点の反射回数
+        bool occluded(const Scene& scene, const Ray& shadowRay, const Light* light, int depth) const {
+            Hit res;
+            if(!occluderCache)
+                return scene.intersect(shadowRay, res);
+
+            OccluderCache& cache = occluderCaches.get();
+            if(cache.occluders.size() != 2*scene.lights.size())
+                cache.occluders.assign(2*scene.lights.size(), nullptr);
+            //カメラから見える点とそれ以降の点は場所のまとまりが違うので別々に覚える
+            const Primitive*& occluder = cache.occluders[2*light->id + (depth > 0 ? 1 : 0)];
+            //一定の間隔で キャッシュした物体との判定とBVHの探索の時間を測る
+            const bool timed = (cache.lookups++ % occluderTimingInterval) == 0;
+
+            auto start = timed ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+            const bool cached = occluder && occluder->intersect(shadowRay, res);
+            if(timed) {
+                const auto end = std::chrono::steady_clock::now();
+                cache.timedLookups++;
+                cache.testSeconds += std::chrono::duration<double>(end - start).count();
+                start = end;
             }
-            else {
-                timer.start();
-                for(int k = 0; k < pixelSamples; k++) {
-                    #pragma omp parallel for schedule(dynamic, 1)
-                    for(int i = 0; i < cam->film->width; i++) {
-                        for(int j = 0; j < cam->film->height; j++) {
-                            float rx = sampler->getNext();
-                            float ry = sampler->getNext();
-                            float px = i + rx;
-                            float py = j + ry;
-                            float u = (2.0*(i + rx) - cam->film->width)/cam->film->width;
-                            float v = -(2.0*(j + ry) - cam->film->height)/cam->film->height;
-                            float w;
-                            Ray ray = cam->getRay(u, v, w, *sampler);
-                            Vec3 hit_le;
-                            RGB col = Li(ray, scene, hit_le);
-                            if(!nonzero(hit_le)) {
-                                cam->film->addSample(i, j, w*col);
-                            }
-                            else {
-                                cam->film->addSample(i, j, w*hit_le);
-                            }
-                        }
-                    }
-                    std::cout << progressbar(k, pixelSamples) << " " << percentage(k, pixelSamples) << '\r' << std::flush;
-                }
-                timer.stop("Rendering Finished");
-                cam->film->divide(pixelSamples);
-                cam->film->gamma_correction();
-                cam->film->ppm_output("left.ppm");
-
-                timer.start();
-                cam->film->clear();
-                for(int k = 0; k < pixelSamples; k++) {
-                    #pragma omp parallel for schedule(dynamic, 1)
-                    for(int i = 0; i < cam->film->width; i++) {
-                        for(int j = 0; j < cam->film->height; j++) {
-                            float rx = sampler->getNext();
-                            float ry = sampler->getNext();
-                            float px = i + rx;
-                            float py = j + ry;
-                            float u = (2.0*(i + rx) - cam->film->width)/cam->film->width;
-                            float v = -(2.0*(j + ry) - cam->film->height)/cam->film->height;
-                            float w;
-                            Ray ray = cam->getRay(u, v, w, *sampler, false);
-                            Vec3 hit_le;
-                            RGB col = Li(ray, scene, hit_le);
-                            if(!nonzero(hit_le)) {
-                                cam->film->addSample(i, j, w*col);
-                            }
-                            else {
-                                cam->film->addSample(i, j, w*hit_le);
-                            }
-                        }
-                    }
-                    std::cout << progressbar(k, pixelSamples) << " " << percentage(k, pixelSamples) << '\r' << std::flush;
-                }
-                timer.stop("Rendering Finished");
-                cam->film->divide(pixelSamples);
-                cam->film->gamma_correction();
-                cam->film->ppm_output("right.ppm");
+            if(cached) {
+                cache.hits++;
+                return true;
+            }
+
+            const bool hit = scene.intersect(shadowRay, res);
+            if(timed) {
+                cache.timedTraversals++;
+                cache.traversalSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            }
+            if(hit) {
+                cache.misses++;
+                occluder = res.hitPrimitive;
             }
+            return hit;
         };
 
 
-        void compute(const Scene& scene) const {
-            #pragma omp parallel for schedule(dynamic, 1)
-            for(int i = 0; i < cam->film->width; i++) {
-                for(int j = 0; j < cam->film->height; j++) {
-                    float rx = sampler->getNext();
-                    float ry = sampler->getNext();
-                    float px = i + rx;
-                    float py = j + ry;
-                    float u = (2.0*(i + rx) - cam->film->width)/cam->film->height;
-                    float v = -(2.0*(j + ry) - cam->film->height)/cam->film->height;
-                    float w;
-                    Ray ray = cam->getRay(u, v, w, *sampler);
-                    Vec3 hit_le;
-                    RGB col = Li(ray, scene, hit_le);
-                    if(!nonzero(hit_le)) {
-                        cam->film->addSample(i, j, w*col);
+    private:
+        //スレッドごとのキャッシュ
+        struct OccluderCache {
+            //光源ごとに最後に遮った物体 最初の衝突点とそれ以降の点で2つずつ持つ
+            std::vector<const Primitive*> occluders;
+            uint64_t lookups = 0;
+            uint64_t hits = 0;
+            //遮られていたがキャッシュした物体では判定できなかった回数
+            uint64_t misses = 0;
+            //時間を測った回数と合計の時間
+            uint64_t timedLookups = 0;
+            uint64_t timedTraversals = 0;
+            double testSeconds = 0.0;
+            double traversalSeconds = 0.0;
+        };
+        //時間を測る判定の間隔
+        static constexpr uint64_t occluderTimingInterval = 64;
+        mutable PerThread<OccluderCache> occluderCaches;
+
+
+        //キャッシュのヒット率と シャドウレイの判定の速度の向上の見積もりを表示する
+        //キャッシュがない場合は全てのシャドウレイでBVHを探索したとして occluderTimingInterval回に1回だけ測った平均の時間から見積もる
+        void printOccluderCacheStatistics() const {
+            uint64_t lookups = 0;
+            uint64_t hits = 0;
+            uint64_t misses = 0;
+            uint64_t timedLookups = 0;
+            uint64_t timedTraversals = 0;
+            double testSeconds = 0.0;
+            double traversalSeconds = 0.0;
+            for(int i = 0; i < occluderCaches.size(); i++) {
+                const OccluderCache& cache = occluderCaches[i];
+                lookups += cache.lookups;
+                hits += cache.hits;
+                misses += cache.misses;
+                timedLookups += cache.timedLookups;
+                timedTraversals += cache.timedTraversals;
+                testSeconds += cache.testSeconds;
+                traversalSeconds += cache.traversalSeconds;
+            }
+            if(lookups == 0) return;
+            std::cout << "occluder cache: " << hits << " hits of " << lookups << " shadow rays (" << 100.0*hits/lookups << "%, " << (hits + misses > 0 ? 100.0*hits/(hits + misses) : 0.0) << "% of occluded rays)";
+            if(timedTraversals > 0) {
+                const double traversal = traversalSeconds/timedTraversals;
+                const double withCache = testSeconds/timedLookups + (double)(lookups - hits)/lookups*traversal;
+                std::cout << ", estimated shadow ray speedup " << traversal/withCache << "x (extrapolated from every " << occluderTimingInterval << "th lookup)";
+            }
+            std::cout << std::endl;
+        };
+};
+
+
+//MISの重み(パワーヒューリスティック)
+//pdf_aの戦略でサンプリングしたときの重みを返す
+inline float powerHeuristic(float pdf_a, float pdf_b) {
+    if(std::isinf(pdf_a)) return 1.0f;
+    const float a2 = pdf_a*pdf_a;
+    const float b2 = pdf_b*pdf_b;
+    if(a2 + b2 == 0.0f) return 0.0f;
+    return a2/(a2 + b2);
+}
+
+
+//光源サンプリングとBRDFサンプリングをパワーヒューリスティックで組み合わせるパストレーサー
+//光源にBRDFサンプリングで当たった場合も放射輝度をMISの重みをつけて蓄積する
+class PathTraceMIS : public TiledIntegrator {
+    public:
+        PathTraceMIS(std::shared_ptr<Camera> _cam, std::shared_ptr<Sampler> _sampler, int _pixelSamples, int _maxDepth) : TiledIntegrator(_cam, _sampler, _pixelSamples, _maxDepth) {};
+
+        RGB Li(const Ray& _ray, const Scene& scene) const {
+            RGB L;
+            PathState path(_ray);
+            //直前の頂点がスペキュラーだったか カメラレイはスペキュラーとして扱う
+            bool specularBounce = true;
+            //直前の頂点とそこでのBRDFサンプリングのpdf
+            Hit prev;
+            float brdf_pdf = 0.0f;
+            while(true) {
+                //反射ごとに決まった次元の乱数を使う
+                sampler->startDimension(bounceDimension(path.depth));
+                //ロシアンルーレット
+                if(path.depth > 10) {
+                    if(sampler->getNext() < 1.0f - path.roulette) {
+                        break;
+                    }
+                    path.roulette *= 0.9f;
+                }
+
+                if(path.depth > maxDepth)
+                    break;
+
+                Hit res;
+                if(!scene.intersect(path.ray, res)) {
+                    const RGB sky = scene.sky->getSky(path.ray);
+                    //環境光が光源サンプリングされている場合はMISの重みをつける
+                    if(!scene.envLight || specularBounce) {
+                        L += path.throughput * sky;
+                    }
+                    else {
+                        const float light_pdf = scene.envLight->pdf(prev, path.ray.direction, res) * lightPmf(scene, prev, scene.envLight);
+                        L += powerHeuristic(brdf_pdf, light_pdf) * path.throughput * sky;
+                    }
+                    break;
+                }
+                //光源に当たった場合
+                if(res.hitPrimitive->areaLight != nullptr) {
+                    const Light* light = res.hitPrimitive->areaLight.get();
+                    const RGB le = light->Le(res);
+                    //スペキュラー反射の後は光源サンプリングでは当たらないので重みは1
+                    if(specularBounce) {
+                        L += path.throughput * le;
                     }
                     else {
-                        cam->film->addSample(i, j, w*hit_le);
+                        const float light_pdf = light->pdf(prev, path.ray.direction, res) * lightPmf(scene, prev, light);
+                        L += powerHeuristic(brdf_pdf, light_pdf) * path.throughput * le;
+                    }
+                    break;
+                }
+
+                //マテリアル
+                const Material* hitMaterial = res.hitPrimitive->material.get();
+                const bool specular = hitMaterial->type == MATERIAL_TYPE::SPECULAR;
+                //ローカル座標系の構築
+                const Vec3 wo = -path.ray.direction;
+                const Vec3 n = res.hitNormal;
+                const Vec3 s = res.dpdu;
+                const Vec3 t = normalize(cross(s, n));
+                const Vec3 wo_local = worldToLocal(wo, n, s, t);
+
+
+                //光源サンプリング
+                if(!specular) {
+                    RGB Ld;
+                    const int nLights = lightCount(scene);
+                    for(int l = 0; l < nLights; l++) {
+                        float light_pmf;
+                        const Light* light = pickLight(scene, res, l, light_pmf);
+                        if(light == nullptr) continue;
+                        float light_pdf = 1.0f;
+                        Vec3 wi_light;
+                        const RGB le = light->sample(res, *sampler, wi_light, light_pdf);
+                        //光源を選ぶ確率も含めたpdf
+                        light_pdf *= light_pmf;
+                        if(light_pdf == 0.0f || std::isinf(light_pdf)) continue;
+                        const Vec3 wi_light_local = worldToLocal(wi_light, n, s, t);
+                        const float cos_term = std::max(wi_light_local.y, 0.0f);
+                        if(cos_term == 0.0f) continue;
+
+                        //シャドウレイによる可視判定
+                        Ray shadowRay(res.hitPos, wi_light);
+                        Hit shadow_res;
+                        bool visible;
+                        if(light->type == LIGHT_TYPE::AREA) {
+                            visible = scene.intersect(shadowRay, shadow_res) && shadow_res.hitPrimitive->areaLight.get() == light;
+                        }
+                        else {
+                            //点光源より奥の物体は遮蔽物にならない
+                            if(light->type == LIGHT_TYPE::POINT)
+                                shadowRay.tmax = (static_cast<const PointLight*>(light)->lightPos - res.hitPos).length();
+                            visible = !scene.intersect(shadowRay, shadow_res);
+                        }
+                        if(!visible) continue;
+
+                        //デルタ光源はBRDFサンプリングで当たらないので重みは1
+                        const float w = !light->isDelta() ? powerHeuristic(light_pdf, hitMaterial->pdf(wo_local, wi_light_local)) : 1.0f;
+                        Ld += w * hitMaterial->f(wo_local, wi_light_local) * le/light_pdf * cos_term;
                     }
+                    L += path.throughput * Ld;
+                }
+
+
+                //BRDFの計算と方向のサンプリング
+                Vec3 wi_local;
+                float pdf = 1.0f;
+                RGB brdf_f = hitMaterial->sample(wo_local, wi_local, *sampler, pdf);
+                if(iszero(wi_local)) break;
+                //MISの重みと整合するように 非スペキュラーの場合はBRDF全体の値とpdfを使う
+                if(!specular) {
+                    brdf_f = hitMaterial->f(wo_local, wi_local);
+                    pdf = hitMaterial->pdf(wo_local, wi_local);
                 }
+                if(pdf == 0.0f) break;
+                const Vec3 wi = localToWorld(wi_local, n, s, t);
+
+                //係数
+                const float cos_term = std::abs(wi_local.y);
+                const RGB k = 1.0f/(path.roulette*pdf) * cos_term * brdf_f;
+                if(isnan(k) || isinf(k)) break;
+
+                //次の頂点へ
+                path.throughput *= k;
+                specularBounce = specular;
+                prev = res;
+                brdf_pdf = pdf;
+                path.ray = Ray(res.hitPos, wi);
+                path.depth++;
             }
+            return L;
+        };
+
+
+        RGB radiance(const Ray& ray, const Scene& scene) const {
+            return Li(ray, scene);
         };
 };
 #endif
@@ -0,0 +1,392 @@
+#ifndef IRRADIANCECACHE_H
+#define IRRADIANCECACHE_H
+#include <cmath>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include "integrator.h"
+
+
+//放射照度キャッシュのレコード
+struct IrradianceRecord {
+    Vec3 p;
+    Vec3 n;
+    //間接光による放射照度
+    RGB E;
+    //半球上の衝突点までの距離の調和平均 レコードが有効な範囲の目安
+    float R;
+    //回転と平行移動についての勾配 RGBの各成分ごと
+    Vec3 rotGrad[3];
+    Vec3 transGrad[3];
+
+    //点p, 法線nでの放射照度を勾配で外挿する
+    RGB extrapolate(const Vec3& _p, const Vec3& _n) const {
+        const Vec3 nc = cross(n, _n);
+        const Vec3 d = _p - p;
+        RGB result;
+        result.x = E.x + dot(rotGrad[0], nc) + dot(transGrad[0], d);
+        result.y = E.y + dot(rotGrad[1], nc) + dot(transGrad[1], d);
+        result.z = E.z + dot(rotGrad[2], nc) + dot(transGrad[2], d);
+        return max(result, RGB(0.0f));
+    };
+};
+
+
+//レコードを格納する8分木
+//レコードは有効範囲を覆う程度の大きさのノードに登録し 探索では点を含むノードを根から辿る
+//子ノードとレコードのリストはCASで追加するので 探索と追加を複数のスレッドから同時に行える
+//レコードは削除しない
+class IrradianceOctree {
+    public:
+        AABB bounds;
+        std::atomic<int> count;
+
+
+        IrradianceOctree(const AABB& _bounds) : count(0) {
+            //立方体にして少し広げる
+            const Vec3 size = _bounds.pMax - _bounds.pMin;
+            const float maxSize = 1.01f*std::max(size.x, std::max(size.y, size.z)) + 1e-3f;
+            const Vec3 center = 0.5f*(_bounds.pMin + _bounds.pMax);
+            bounds = AABB(center - 0.5f*maxSize, center + 0.5f*maxSize);
+        };
+
+
+        //pを中心とする半径radiusの範囲で有効なレコードを追加する
+        void add(const IrradianceRecord& record, float radius) {
+            add(&root, bounds, record, AABB(record.p - radius, record.p + radius), 0);
+            count++;
+        };
+
+
+        //pを含むノードに登録されたレコードについてfを呼ぶ
+        template<typename F>
+        void lookup(const Vec3& p, F f) const {
+            const Node* node = &root;
+            AABB nodeBounds = bounds;
+            for(int depth = 0; node && depth <= maxDepth; depth++) {
+                for(const Entry* e = node->records.load(std::memory_order_acquire); e; e = e->next)
+                    f(e->record);
+                const int c = childIndex(nodeBounds, p);
+                nodeBounds = childBounds(nodeBounds, c);
+                node = node->children[c].load(std::memory_order_acquire);
+            }
+        };
+
+
+    private:
+        struct Entry {
+            IrradianceRecord record;
+            Entry* next;
+        };
+        struct Node {
+            std::atomic<Node*> children[8];
+            std::atomic<Entry*> records;
+
+            Node() : records(nullptr) {
+                for(auto& c : children) c = nullptr;
+            };
+            ~Node() {
+                for(auto& c : children) delete c.load();
+                Entry* e = records.load();
+                while(e) {
+                    Entry* next = e->next;
+                    delete e;
+                    e = next;
+                }
+            };
+        };
+
+        static constexpr int maxDepth = 16;
+        Node root;
+
+
+        static int childIndex(const AABB& b, const Vec3& p) {
+            const Vec3 center = 0.5f*(b.pMin + b.pMax);
+            return (p.x > center.x ? 1 : 0) | (p.y > center.y ? 2 : 0) | (p.z > center.z ? 4 : 0);
+        };
+        static AABB childBounds(const AABB& b, int c) {
+            const Vec3 center = 0.5f*(b.pMin + b.pMax);
+            return AABB(Vec3((c & 1) ? center.x : b.pMin.x, (c & 2) ? center.y : b.pMin.y, (c & 4) ? center.z : b.pMin.z),
+                        Vec3((c & 1) ? b.pMax.x : center.x, (c & 2) ? b.pMax.y : center.y, (c & 4) ? b.pMax.z : center.z));
+        };
+
+
+        void add(Node* node, const AABB& nodeBounds, const IrradianceRecord& record, const AABB& recordBounds, int depth) {
+            //ノードがレコードの範囲と同程度まで小さくなったらここに登録する
+            if(depth == maxDepth || (nodeBounds.pMax - nodeBounds.pMin).length2() < (recordBounds.pMax - recordBounds.pMin).length2()) {
+                Entry* e = new Entry{record, node->records.load(std::memory_order_relaxed)};
+                while(!node->records.compare_exchange_weak(e->next, e, std::memory_order_release, std::memory_order_relaxed));
+                return;
+            }
+            //範囲が重なる子全てに登録する
+            const Vec3 center = 0.5f*(nodeBounds.pMin + nodeBounds.pMax);
+            for(int c = 0; c < 8; c++) {
+                if((c & 1) ? recordBounds.pMax.x < center.x : recordBounds.pMin.x > center.x) continue;
+                if((c & 2) ? recordBounds.pMax.y < center.y : recordBounds.pMin.y > center.y) continue;
+                if((c & 4) ? recordBounds.pMax.z < center.z : recordBounds.pMin.z > center.z) continue;
+                Node* child = node->children[c].load(std::memory_order_acquire);
+                if(!child) {
+                    Node* created = new Node();
+                    if(node->children[c].compare_exchange_strong(child, created, std::memory_order_acq_rel))
+                        child = created;
+                    else
+                        delete created;
+                }
+                add(child, childBounds(nodeBounds, c), record, recordBounds, depth + 1);
+            }
+        };
+};
+
+
+//放射照度キャッシュによる大域照明のプレビュー
+//拡散面では直接光を光源サンプリングで求め 間接光の放射照度は近くのレコードを勾配つきで補間する
+//使えるレコードがなければ半球を層別サンプリングしてその場でレコードを作る
+//レコードはワールド座標で保持するので 同じセッション中はパスやカメラが変わっても使い回す
+//スペキュラー面では反射・屈折を辿り 光沢面ではPathTraceExplicitで計算する
+class IrradianceCache : public PathTraceExplicit {
+    public:
+        //レコードを作るときの半球上のサンプル数
+        int hemisphereSamples = 256;
+        //補間の許容誤差 小さいほどレコードが密になる
+        float maxError = 0.2f;
+        //レコードの有効半径の範囲 シーンの大きさに対する比
+        float minSpacing = 0.01f;
+        float maxSpacing = 0.2f;
+
+        IrradianceCache(std::shared_ptr<Camera> _cam, std::shared_ptr<Sampler> _sampler, int _pixelSamples, int _maxDepth) : PathTraceExplicit(_cam, _sampler, _pixelSamples, _maxDepth) {};
+
+
+        void render(const Scene& scene) const {
+            initCache(scene);
+            PathTraceExplicit::render(scene);
+            std::cout << "irradiance cache: " << cache->count << " records" << std::endl;
+        };
+        void compute(const Scene& scene) const {
+            initCache(scene);
+            PathTraceExplicit::compute(scene);
+        };
+
+
+        RGB Li(const Ray& _ray, const Scene& scene) const {
+            RGB L;
+            PathState path(_ray);
+            while(path.depth <= maxDepth) {
+                Hit res;
+                if(!scene.intersect(path.ray, res)) {
+                    L += path.throughput * scene.sky->getSky(path.ray);
+                    break;
+                }
+                if(res.hitPrimitive->areaLight != nullptr) {
+                    L += path.throughput * res.hitPrimitive->areaLight->Le(res);
+                    break;
+                }
+                const Material* hitMaterial = res.hitPrimitive->material.get();
+
+                //光沢面はパストレーシングに任せる
+                if(hitMaterial->type == MATERIAL_TYPE::GLOSSY) {
+                    Vec3 hit_le;
+                    L += path.throughput * PathTraceExplicit::Li(path.ray, scene, hit_le);
+                    break;
+                }
+
+                const Vec3 wo = -path.ray.direction;
+                const bool diffuse = hitMaterial->type == MATERIAL_TYPE::DIFFUSE;
+                const Vec3 n = (diffuse && dot(res.hitNormal, wo) < 0.0f) ? -res.hitNormal : res.hitNormal;
+                const Vec3 s = res.dpdu;
+                const Vec3 t = normalize(cross(s, n));
+                const Vec3 wo_local = worldToLocal(wo, n, s, t);
+
+                if(diffuse) {
+                    const RGB f = hitMaterial->f(wo_local, Vec3(0, 1, 0));
+                    L += path.throughput * (directLight(scene, res, hitMaterial, n, s, t, wo_local) + f*irradiance(scene, res.hitPos, n, s, t));
+                    break;
+                }
+
+                //スペキュラー面では反射・屈折を辿る
+                Vec3 wi_local;
+                float pdf = 1.0f;
+                const RGB f = hitMaterial->sample(wo_local, wi_local, *sampler, pdf);
+                if(iszero(wi_local) || pdf == 0.0f) break;
+                path.throughput *= f * std::abs(wi_local.y)/pdf;
+                if(iszero(path.throughput) || isnan(path.throughput) || isinf(path.throughput)) break;
+                path.ray = Ray(res.hitPos, localToWorld(wi_local, n, s, t));
+                path.depth++;
+            }
+            return L;
+        };
+
+
+        RGB radiance(const Ray& ray, const Scene& scene) const {
+            return Li(ray, scene);
+        };
+        //PathTraceExplicitの分割はキャッシュの寄与を含まないので 最初の衝突点だけを記録する
+        RGB radianceAOV(const Ray& ray, const Scene& scene, AOVSample& aov) const {
+            return TiledIntegrator::radianceAOV(ray, scene, aov);
+        };
+
+
+    private:
+        mutable std::unique_ptr<IrradianceOctree> cache;
+        mutable float sceneSize = 1.0f;
+
+
+        void initCache(const Scene& scene) const {
+            if(cache) return;
+            const AABB bounds = scene.accel->worldBound();
+            sceneSize = (bounds.pMax - bounds.pMin).length();
+            cache = std::unique_ptr<IrradianceOctree>(new IrradianceOctree(bounds));
+        };
+
+
+        //各光源を1回ずつサンプリングした直接光
+        RGB directLight(const Scene& scene, const Hit& res, const Material* material, const Vec3& n, const Vec3& s, const Vec3& t, const Vec3& wo_local) const {
+            RGB Ld;
+            const int nLights = lightCount(scene);
+            for(int l = 0; l < nLights; l++) {
+                float light_pmf;
+                const Light* light = pickLight(scene, res, l, light_pmf);
+                if(light == nullptr) continue;
+                float light_pdf = 1.0f;
+                Vec3 wi_light;
+                const RGB le = light->sample(res, *sampler, wi_light, light_pdf);
+                if(light_pdf == 0.0f || iszero(le)) continue;
+                const Vec3 wi_light_local = worldToLocal(wi_light, n, s, t);
+                if(wi_light_local.y <= 0.0f) continue;
+
+                Ray shadowRay(res.hitPos, wi_light);
+                Hit shadow_res;
+                bool visible;
+                if(light->type == LIGHT_TYPE::AREA) {
+                    visible = scene.intersect(shadowRay, shadow_res) && shadow_res.hitPrimitive->areaLight.get() == light;
+                }
+                else {
+                    if(light->type == LIGHT_TYPE::POINT)
+                        shadowRay.tmax = (static_cast<const PointLight*>(light)->lightPos - res.hitPos).length();
+                    visible = !scene.intersect(shadowRay, shadow_res);
+                }
+                if(visible)
+                    Ld += material->f(wo_local, wi_light_local) * le/(light_pmf*light_pdf) * wi_light_local.y;
+            }
+            return Ld;
+        };
+
+
+        //点p, 法線nでの間接光の放射照度
+        //有効なレコードの重み付き平均 なければ新しいレコードを作る
+        RGB irradiance(const Scene& scene, const Vec3& p, const Vec3& n, const Vec3& s, const Vec3& t) const {
+            RGB sum;
+            float weightSum = 0.0f;
+            cache->lookup(p, [&](const IrradianceRecord& record) {
+                //レコードより手前にある点には使わない
+                if(dot(p - record.p, n + record.n) < -0.02f*record.R) return;
+                const float error = (p - record.p).length()/record.R + std::sqrt(std::max(0.0f, 1.0f - dot(n, record.n)));
+                if(error >= maxError) return;
+                //誤差の上限で0になる重み 補間の境目が目立たない
+                const float w = 1.0f/std::max(error, 1e-4f) - 1.0f/maxError;
+                sum += w*record.extrapolate(p, n);
+                weightSum += w;
+            });
+            if(weightSum > 0.0f)
+                return sum/weightSum;
+
+            IrradianceRecord record = computeRecord(scene, p, n, s, t);
+            cache->add(record, maxError*record.R);
+            return record.E;
+        };
+
+
+        //半球をM*Nに層別してコサインに比例したサンプリングを行い 放射照度と勾配を求める
+        //勾配はWard and Heckbert(1992)の式による
+        IrradianceRecord computeRecord(const Scene& scene, const Vec3& p, const Vec3& n, const Vec3& s, const Vec3& t) const {
+            const int M = std::max(2, (int)std::sqrt(hemisphereSamples/M_PI));
+            const int N = std::max(3, hemisphereSamples/M);
+            std::vector<RGB> Ls(M*N);
+            std::vector<float> rs(M*N);
+
+            IrradianceRecord record;
+            record.p = p;
+            record.n = n;
+            float invDistSum = 0.0f;
+            for(int j = 0; j < M; j++) {
+                for(int k = 0; k < N; k++) {
+                    const float sinTheta = std::sqrt((j + sampler->getNext())/M);
+                    const float cosTheta = std::sqrt(std::max(0.0f, 1.0f - sinTheta*sinTheta));
+                    const float phi = 2.0f*M_PI*(k + sampler->getNext())/N;
+                    const Vec3 wi = localToWorld(Vec3(sinTheta*std::cos(phi), cosTheta, sinTheta*std::sin(phi)), n, s, t);
+
+                    //光源は直接光で計算しているので 最初の衝突点の放射は含めない
+                    const Ray ray(p, wi);
+                    Hit res;
+                    RGB L;
+                    float r = std::numeric_limits<float>::infinity();
+                    if(!scene.intersect(ray, res)) {
+                        if(!scene.envLight)
+                            L = scene.sky->getSky(ray);
+                    }
+                    else {
+                        r = res.t;
+                        invDistSum += 1.0f/r;
+                        if(res.hitPrimitive->areaLight == nullptr) {
+                            Vec3 hit_le;
+                            L = PathTraceExplicit::Li(ray, scene, hit_le);
+                        }
+                    }
+                    Ls[j + M*k] = L;
+                    rs[j + M*k] = r;
+                    record.E += L;
+
+                    //回転の勾配 法線をphi + pi/2の方向に傾けると-tan(theta)*Lの割合で変化する
+                    //地平線付近でtan(theta)が発散しないように層の中心の値を使う
+                    const Vec3 v = localToWorld(Vec3(-std::sin(phi), 0.0f, std::cos(phi)), n, s, t);
+                    const float tanTheta = std::sqrt((j + 0.5f)/(M - j - 0.5f));
+                    for(int c = 0; c < 3; c++)
+                        record.rotGrad[c] -= (float)(M_PI/(M*N))*tanTheta*L[c]*v;
+                }
+            }
+            record.E *= M_PI/(M*N);
+
+            //有効半径はシーンの大きさに対して一定の範囲に収める
+            const float R = invDistSum > 0.0f ? M*N/invDistSum : std::numeric_limits<float>::infinity();
+            record.R = clamp(R, minSpacing*sceneSize, maxSpacing*sceneSize);
+
+            //平行移動の勾配
+            for(int k = 0; k < N; k++) {
+                const float phi = 2.0f*M_PI*(k + 0.5f)/N;
+                const Vec3 u = localToWorld(Vec3(std::cos(phi), 0.0f, std::sin(phi)), n, s, t);
+                const float phiMinus = 2.0f*M_PI*k/N;
+                const Vec3 vMinus = localToWorld(Vec3(-std::sin(phiMinus), 0.0f, std::cos(phiMinus)), n, s, t);
+                const int kPrev = (k + N - 1)%N;
+
+                //thetaの境界をまたぐ変化
+                RGB sumTheta;
+                for(int j = 1; j < M; j++) {
+                    const float sinThetaMinus = std::sqrt((float)j/M);
+                    const float cos2ThetaMinus = 1.0f - (float)j/M;
+                    const float r = std::min(rs[j + M*k], rs[j - 1 + M*k]);
+                    sumTheta += sinThetaMinus*cos2ThetaMinus/r * (Ls[j + M*k] - Ls[j - 1 + M*k]);
+                }
+                //phiの境界をまたぐ変化
+                RGB sumPhi;
+                for(int j = 0; j < M; j++) {
+                    const float sinThetaMinus = std::sqrt((float)j/M);
+                    const float sinThetaPlus = std::sqrt((float)(j + 1)/M);
+                    const float r = std::min(rs[j + M*k], rs[j + M*kPrev]);
+                    sumPhi += (sinThetaPlus - sinThetaMinus)/r * (Ls[j + M*k] - Ls[j + M*kPrev]);
+                }
+                for(int c = 0; c < 3; c++)
+                    record.transGrad[c] += (float)(2.0f*M_PI/N)*sumTheta[c]*u + sumPhi[c]*vMinus;
+            }
+
+            //勾配による外挿が有効範囲内で放射照度自体より大きく変化しないように制限する
+            for(int c = 0; c < 3; c++) {
+                const float transLimit = record.E[c]/record.R;
+                if(record.transGrad[c].length() > transLimit)
+                    record.transGrad[c] *= transLimit/record.transGrad[c].length();
+                if(record.rotGrad[c].length() > record.E[c])
+                    record.rotGrad[c] *= record.E[c]/record.rotGrad[c].length();
+            }
+            return record;
+        };
+};
+#endif
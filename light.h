@@ -2,12 +2,15 @@
 #define LIGHT_H
 #include "vec3.h"
 #include "shape.h"
+#include "sky.h"
+#include "distribution.h"
 
 
 enum class LIGHT_TYPE {
     POINT,
     DIRECTIONAL,
-    AREA
+    AREA,
+    ENVIRONMENT
 };
 
 
@@ -15,12 +18,37 @@ class Light {
     public:
         RGB power;
         LIGHT_TYPE type;
+        //Scene::lightsの添字
+        int id = -1;
 
         Light() {};
         Light(const RGB& _power, const LIGHT_TYPE& _type) : power(_power), type(_type) {};
 
         virtual RGB Le(const Hit& res) const = 0;
         virtual RGB sample(const Hit& res, Sampler& sampler, Vec3& wi, float &pdf) const = 0;
+        //resから方向wiに進んで光源上の点lightResに当たったとき
+        //その方向がsampleで選ばれる確率密度(立体角測度)
+        //デルタ光源はレイが当たることがないので0を返す
+        virtual float pdf(const Hit& res, const Vec3& wi, const Hit& lightRes) const {
+            return 0.0f;
+        };
+        //光源から出るレイをサンプリングする 双方向パストレーシングの光源側の部分パスに使う
+        //pdfPosは位置の面積測度 pdfDirは方向の立体角測度のpdf
+        //点光源の位置はデルタ分布なので sampleLeのpdfPosは1 pdfLeのpdfPosは0とする
+        //光源から出るレイを生成できない光源(平行光源 環境光)はpdfを0にする
+        virtual RGB sampleLe(Sampler& sampler, Ray& ray, Vec3& normal, float& pdfPos, float& pdfDir) const {
+            pdfPos = pdfDir = 0.0f;
+            return RGB(0.0f);
+        };
+        //法線normalの光源上の点から方向wに出るレイがsampleLeで選ばれる確率密度
+        virtual void pdfLe(const Vec3& normal, const Vec3& w, float& pdfPos, float& pdfDir) const {
+            pdfPos = pdfDir = 0.0f;
+        };
+
+        //位置あるいは方向がデルタ分布の光源か
+        bool isDelta() const {
+            return type == LIGHT_TYPE::POINT || type == LIGHT_TYPE::DIRECTIONAL;
+        };
 };
 
 
@@ -39,6 +67,19 @@ class PointLight : public Light {
             wi = normalize(lightPos - res.hitPos);
             return power;
         };
+        RGB sampleLe(Sampler& sampler, Ray& ray, Vec3& normal, float& pdfPos, float& pdfDir) const {
+            //全方向に一様
+            const Vec3 w = sampleHemisphere(sampler.getNext2D());
+            ray = Ray(lightPos, sampler.getNext() < 0.5f ? w : -w);
+            normal = Vec3(0.0f);
+            pdfPos = 1.0f;
+            pdfDir = 1.0f/(4.0f*M_PI);
+            return power;
+        };
+        void pdfLe(const Vec3& normal, const Vec3& w, float& pdfPos, float& pdfDir) const {
+            pdfPos = 0.0f;
+            pdfDir = 1.0f/(4.0f*M_PI);
+        };
 };
 
 
@@ -62,26 +103,105 @@ class DirectionalLight : public Light {
 class AreaLight : public Light {
     public:
         std::shared_ptr<Shape> shape;
+        //shapeの表面積 pdfの計算のたびに求めないように保持しておく
+        float area;
 
 
-        AreaLight(std::shared_ptr<Shape> _shape, const RGB& _power) : Light(_power, LIGHT_TYPE::AREA), shape(_shape) {};
+        AreaLight(std::shared_ptr<Shape> _shape, const RGB& _power) : Light(_power, LIGHT_TYPE::AREA), shape(_shape) {
+            shape->initSampling();
+            area = shape->surfaceArea();
+        };
 
         
         RGB Le(const Hit& res) const {
             return power;
         };
         RGB sample(const Hit& res, Sampler& sampler, Vec3& wi, float &pdf) const {
-            float point_pdf;
-            //Primitive上で点をサンプリング
+            //衝突点から見た立体角測度でPrimitive上の点をサンプリング
             Vec3 normal;
-            Vec3 shapePos = shape->sample(sampler, normal, point_pdf);
-            float distance2 = (shapePos - res.hitPos).length2();
+            const Vec3 shapePos = shape->sampleSolidAngle(res.hitPos, sampler, normal, pdf);
+            //裏側の点を選んだときなどは寄与を0にする 方向は発散しないように適当に決める
+            if(pdf == 0.0f) {
+                wi = res.hitNormal;
+                pdf = 1.0f;
+                return RGB(0.0f);
+            }
             //衝突点からサンプリングされた点に向かう方向ベクトルを生成
             wi = normalize(shapePos - res.hitPos);
-            float cos_term = std::max(dot(-wi, normal), 0.0f);
-            //面積測度を立体角測度に変換
-            pdf = point_pdf * distance2/cos_term;
             return power;
         };
+        float pdf(const Hit& res, const Vec3& wi, const Hit& lightRes) const {
+            return shape->pdfSolidAngle(res.hitPos, wi, lightRes.hitPos, lightRes.hitNormal);
+        };
+        //Leは面の両側に放射されるので 表裏を等確率で選んでコサインに比例した方向を選ぶ
+        RGB sampleLe(Sampler& sampler, Ray& ray, Vec3& normal, float& pdfPos, float& pdfDir) const {
+            const Vec3 pos = shape->sample(sampler, normal, pdfPos);
+            Vec3 w = sampleCosineHemisphere(sampler.getNext2D());
+            if(sampler.getNext() < 0.5f) w.y = -w.y;
+            Vec3 s, t;
+            orthonormalBasis(normal, s, t);
+            ray = Ray(pos, localToWorld(w, normal, s, t));
+            pdfDir = std::abs(w.y)/(2.0f*M_PI);
+            return power;
+        };
+        void pdfLe(const Vec3& normal, const Vec3& w, float& pdfPos, float& pdfDir) const {
+            pdfPos = 1.0f/area;
+            pdfDir = std::abs(dot(normal, w))/(2.0f*M_PI);
+        };
+};
+
+
+//IBLを光源として扱い 輝度とsin(theta)に比例して方向をサンプリングする
+//光源サンプリングで選ばれた方向がシーンから抜ければ寄与を加える
+class EnvironmentLight : public Light {
+    public:
+        std::shared_ptr<IBL> ibl;
+        std::unique_ptr<Distribution2D> distribution;
+
+
+        EnvironmentLight(std::shared_ptr<IBL> _ibl) : Light(RGB(0.0f), LIGHT_TYPE::ENVIRONMENT), ibl(_ibl) {
+            const int w = ibl->width;
+            const int h = ibl->height;
+            std::vector<float> func(w*h);
+            RGB sum;
+            float sinSum = 0.0f;
+            for(int v = 0; v < h; v++) {
+                //回転を考慮した この行の方向の天頂角
+                const float cos_theta = ibl->uvToDirection(Vec2(0.5f/w, (v + 0.5f)/h)).y;
+                const float sin_theta = std::sqrt(std::max(0.0f, 1.0f - cos_theta*cos_theta));
+                for(int u = 0; u < w; u++) {
+                    const RGB c = ibl->texel(u, v);
+                    func[u + w*v] = luminance(c) * sin_theta;
+                    sum += sin_theta * c;
+                    sinSum += sin_theta;
+                }
+            }
+            distribution = std::unique_ptr<Distribution2D>(new Distribution2D(func, w, h));
+            //立体角で平均した放射輝度 光源の選択に使う
+            power = sinSum > 0.0f ? sum/sinSum : RGB(0.0f);
+        };
+
+
+        RGB Le(const Hit& res) const {
+            return RGB(0.0f);
+        };
+        RGB sample(const Hit& res, Sampler& sampler, Vec3& wi, float &pdf) const {
+            float map_pdf;
+            const Vec2 uv = distribution->sampleContinuous(sampler.getNext2D(), map_pdf);
+            wi = ibl->uvToDirection(uv);
+            const float sin_theta = std::sqrt(std::max(0.0f, 1.0f - wi.y*wi.y));
+            if(map_pdf == 0.0f || sin_theta == 0.0f) {
+                pdf = 1.0f;
+                return RGB(0.0f);
+            }
+            //UV座標のpdfを立体角測度に変換
+            pdf = map_pdf/(2.0f*M_PI*M_PI*sin_theta);
+            return ibl->getSky(Ray(res.hitPos, wi));
+        };
+        float pdf(const Hit& res, const Vec3& wi, const Hit& lightRes) const {
+            const float sin_theta = std::sqrt(std::max(0.0f, 1.0f - wi.y*wi.y));
+            if(sin_theta == 0.0f) return 0.0f;
+            return distribution->pdf(ibl->directionToUV(wi))/(2.0f*M_PI*M_PI*sin_theta);
+        };
 };
 #endif
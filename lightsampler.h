@@ -0,0 +1,368 @@
+#ifndef LIGHTSAMPLER_H
+#define LIGHTSAMPLER_H
+#include <cmath>
+#include <cassert>
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <unordered_map>
+#include "vec3.h"
+#include "hit.h"
+#include "aabb.h"
+#include "cone.h"
+#include "light.h"
+#include "distribution.h"
+
+
+//光源のおおよその放射束(輝度)
+//平行光源と環境光はシーンを覆う球に入射する量とする
+inline float lightPower(const Light& light, float sceneRadius) {
+    if(light.type == LIGHT_TYPE::AREA)
+        return M_PI * luminance(light.power) * static_cast<const AreaLight&>(light).area;
+    else if(light.type == LIGHT_TYPE::POINT)
+        return 4.0f * M_PI * luminance(light.power);
+    else if(light.type == LIGHT_TYPE::ENVIRONMENT)
+        return 4.0f * M_PI * M_PI * sceneRadius*sceneRadius * luminance(light.power);
+    else
+        return M_PI * sceneRadius*sceneRadius * luminance(light.power);
+}
+
+
+//光源サンプリングでどの光源を選ぶかを決める
+//全光源を毎回サンプリングする代わりに 衝突点ごとに少数の光源を確率的に選ぶ
+class LightSampler {
+    public:
+        //resから見て重要な光源を選び その確率をpmfに返す 選べなければnullptrを返す
+        virtual const Light* sample(const Hit& res, float u, float& pmf) const = 0;
+        //resからlightが選ばれる確率
+        virtual float pmf(const Hit& res, const Light* light) const = 0;
+};
+
+
+//放射束に比例して光源を選ぶ 衝突点によらない
+class PowerLightSampler : public LightSampler {
+    public:
+        std::vector<const Light*> lights;
+        std::unique_ptr<Distribution1D> distribution;
+        std::unordered_map<const Light*, int> lightToIndex;
+
+
+        PowerLightSampler(const std::vector<std::shared_ptr<Light>>& _lights, const AABB& sceneBound) {
+            const float sceneRadius = 0.5f*(sceneBound.pMax - sceneBound.pMin).length();
+            std::vector<float> power;
+            for(const auto& light : _lights) {
+                lightToIndex[light.get()] = lights.size();
+                lights.push_back(light.get());
+                power.push_back(lightPower(*light, sceneRadius));
+            }
+            if(!lights.empty())
+                distribution = std::unique_ptr<Distribution1D>(new Distribution1D(power));
+        };
+
+
+        const Light* sample(const Hit& res, float u, float& pmf) const {
+            if(lights.empty()) return nullptr;
+            return lights[distribution->sampleDiscrete(u, pmf)];
+        };
+        float pmf(const Hit& res, const Light* light) const {
+            auto itr = lightToIndex.find(light);
+            if(itr == lightToIndex.end()) return 0.0f;
+            return distribution->discretePmf(itr->second);
+        };
+};
+
+
+//光源の位置 放射方向 放射束の範囲
+//ある点から見たときの光源(の集合)の寄与の上界の目安を計算する
+struct LightBounds {
+    AABB bounds;
+    //放射面の法線を囲むコーン
+    DirectionCone normal;
+    //放射面の法線からの放射が届く角度のコサイン 拡散放射なら0(90度)
+    float cosTheta_e;
+    float phi;
+    //法線の裏側にも放射するか(AreaLight::Leは両面)
+    bool twoSided;
+
+    LightBounds() : cosTheta_e(1.0f), phi(0.0f), twoSided(false) {};
+    LightBounds(const AABB& _bounds, const DirectionCone& _normal, float _cosTheta_e, float _phi, bool _twoSided) : bounds(_bounds), normal(_normal), cosTheta_e(_cosTheta_e), phi(_phi), twoSided(_twoSided) {};
+
+    Vec3 centroid() const {
+        return 0.5f*(bounds.pMin + bounds.pMax);
+    };
+
+
+    //点pと法線nを持つ面から見た重要度
+    //距離の二乗に反比例し 放射方向と受光面の向きの範囲を考慮する
+    float importance(const Vec3& p, const Vec3& n) const {
+        const Vec3 pc = centroid();
+        const float radius = 0.5f*(bounds.pMax - bounds.pMin).length();
+        float d2 = (p - pc).length2();
+        //光源の中にいる場合に発散しないよう下限を設ける
+        const float d2_clamped = std::max(d2, radius);
+
+        //点から見て光源を囲む球が占める角度
+        float cosTheta_b = -1.0f;
+        if(d2 > radius*radius)
+            cosTheta_b = std::sqrt(std::max(0.0f, 1.0f - radius*radius/d2));
+        const float theta_b = std::acos(cosTheta_b);
+
+        //光源から点への方向と放射面の法線のなす角から 放射コーンとバウンディング球の分を引く
+        const Vec3 wi = d2 > 0.0f ? normalize(p - pc) : Vec3(0, 1, 0);
+        //両面なら裏側の点も法線側にあるものとして扱う
+        float cosTheta_w = dot(normal.w, wi);
+        if(twoSided) cosTheta_w = std::abs(cosTheta_w);
+        const float theta_w = std::acos(std::max(-1.0f, std::min(cosTheta_w, 1.0f)));
+        const float theta_o = std::acos(std::max(-1.0f, std::min(normal.cosTheta, 1.0f)));
+        const float cosTheta_p = std::cos(std::max(0.0f, theta_w - theta_o - theta_b));
+        if(cosTheta_p <= cosTheta_e) return 0.0f;
+
+        float importance = phi * cosTheta_p/d2_clamped;
+
+        //受光面の法線との角度
+        if(nonzero(n)) {
+            const float theta_i = std::acos(std::max(-1.0f, std::min(dot(-wi, n), 1.0f)));
+            const float cosTheta_ip = std::cos(std::max(0.0f, theta_i - theta_b));
+            importance *= std::max(cosTheta_ip, 0.0f);
+        }
+        return std::max(importance, 0.0f);
+    };
+};
+
+
+inline LightBounds unionBounds(const LightBounds& a, const LightBounds& b) {
+    if(a.phi == 0.0f) return b;
+    if(b.phi == 0.0f) return a;
+    return LightBounds(mergeAABB(a.bounds, b.bounds), unionCone(a.normal, b.normal), std::min(a.cosTheta_e, b.cosTheta_e), a.phi + b.phi, a.twoSided || b.twoSided);
+}
+
+
+//光源のBVH
+//各ノードは子孫の光源の位置 向き 放射束を保持し
+//衝突点から見た重要度に比例して子ノードを確率的に辿って光源を選ぶ
+//位置を持たない平行光源と環境光はBVHに入れず 一定の確率で一様に選ぶ
+class BVHLightSampler : public LightSampler {
+    public:
+        struct LightBVHNode {
+            LightBounds lb;
+            //葉なら光源の添字 内部ノードなら2番目の子の添字(1番目の子は直後に並ぶ)
+            int index;
+            bool isLeaf;
+        };
+
+        std::vector<const Light*> bvhLights;
+        std::vector<const Light*> infiniteLights;
+        std::vector<LightBVHNode> nodes;
+        //根から光源の葉までの経路 i番目のビットがi段目で2番目の子に進むかどうか
+        std::unordered_map<const Light*, uint64_t> lightToBitTrail;
+
+
+        BVHLightSampler(const std::vector<std::shared_ptr<Light>>& _lights, const AABB& sceneBound) {
+            const float sceneRadius = 0.5f*(sceneBound.pMax - sceneBound.pMin).length();
+            std::vector<std::pair<int, LightBounds>> bvhInfo;
+            for(const auto& light : _lights) {
+                const float phi = lightPower(*light, sceneRadius);
+                if(light->type == LIGHT_TYPE::DIRECTIONAL || light->type == LIGHT_TYPE::ENVIRONMENT) {
+                    infiniteLights.push_back(light.get());
+                    continue;
+                }
+                if(phi <= 0.0f) continue;
+
+                LightBounds lb;
+                if(light->type == LIGHT_TYPE::AREA) {
+                    const auto& shape = static_cast<const AreaLight&>(*light).shape;
+                    lb = LightBounds(shape->worldBound(), shape->normalBounds(), 0.0f, phi, true);
+                }
+                else {
+                    const Vec3 p = static_cast<const PointLight&>(*light).lightPos;
+                    lb = LightBounds(AABB(p, p), DirectionCone::entireSphere(), 0.0f, phi, false);
+                }
+                bvhInfo.push_back(std::make_pair((int)bvhLights.size(), lb));
+                bvhLights.push_back(light.get());
+            }
+            if(!bvhInfo.empty())
+                build(bvhInfo, 0, bvhInfo.size(), 0, 0);
+        };
+
+
+        const Light* sample(const Hit& res, float u, float& pmf) const {
+            if(infiniteLights.empty() && nodes.empty()) return nullptr;
+            //平行光源を選ぶ確率
+            const float pInfinite = (float)infiniteLights.size()/(infiniteLights.size() + (nodes.empty() ? 0 : 1));
+            if(u < pInfinite) {
+                const int index = std::min((int)(u/pInfinite*infiniteLights.size()), (int)infiniteLights.size() - 1);
+                pmf = pInfinite/infiniteLights.size();
+                return infiniteLights[index];
+            }
+            if(nodes.empty()) return nullptr;
+
+            u = std::min((u - pInfinite)/(1.0f - pInfinite), oneMinusEpsilon);
+            pmf = 1.0f - pInfinite;
+            int nodeIndex = 0;
+            while(true) {
+                const LightBVHNode& node = nodes[nodeIndex];
+                if(node.isLeaf) {
+                    if(nodeIndex > 0 || node.lb.importance(res.hitPos, res.hitNormal) > 0.0f)
+                        return bvhLights[node.index];
+                    return nullptr;
+                }
+
+                const float c0 = nodes[nodeIndex + 1].lb.importance(res.hitPos, res.hitNormal);
+                const float c1 = nodes[node.index].lb.importance(res.hitPos, res.hitNormal);
+                if(c0 == 0.0f && c1 == 0.0f) return nullptr;
+                const float p0 = c0/(c0 + c1);
+                if(u < p0) {
+                    nodeIndex = nodeIndex + 1;
+                    u = std::min(u/p0, oneMinusEpsilon);
+                    pmf *= p0;
+                }
+                else {
+                    nodeIndex = node.index;
+                    u = std::min((u - p0)/(1.0f - p0), oneMinusEpsilon);
+                    pmf *= 1.0f - p0;
+                }
+            }
+        };
+
+
+        float pmf(const Hit& res, const Light* light) const {
+            if(infiniteLights.empty() && nodes.empty()) return 0.0f;
+            const float pInfinite = (float)infiniteLights.size()/(infiniteLights.size() + (nodes.empty() ? 0 : 1));
+            if(light->type == LIGHT_TYPE::DIRECTIONAL || light->type == LIGHT_TYPE::ENVIRONMENT)
+                return pInfinite/infiniteLights.size();
+
+            auto itr = lightToBitTrail.find(light);
+            if(itr == lightToBitTrail.end()) return 0.0f;
+            uint64_t bitTrail = itr->second;
+
+            //sampleと同じく 根が葉ならその重要度が0のときは選ばれない
+            if(nodes[0].isLeaf && nodes[0].lb.importance(res.hitPos, res.hitNormal) == 0.0f) return 0.0f;
+
+            float pmf = 1.0f - pInfinite;
+            int nodeIndex = 0;
+            while(!nodes[nodeIndex].isLeaf) {
+                const LightBVHNode& node = nodes[nodeIndex];
+                const float c0 = nodes[nodeIndex + 1].lb.importance(res.hitPos, res.hitNormal);
+                const float c1 = nodes[node.index].lb.importance(res.hitPos, res.hitNormal);
+                if(c0 == 0.0f && c1 == 0.0f) return 0.0f;
+                pmf *= (bitTrail & 1 ? c1 : c0)/(c0 + c1);
+                nodeIndex = bitTrail & 1 ? node.index : nodeIndex + 1;
+                bitTrail >>= 1;
+            }
+            return pmf;
+        };
+
+
+    private:
+        static constexpr float oneMinusEpsilon = 0.99999994f;
+        //lightToBitTrailで表せる根からの深さ
+        static constexpr int maxTrailDepth = 64;
+
+
+        //放射束と向きの広がりを考慮したコーンの立体角の尺度
+        static float momentOmega(const LightBounds& lb) {
+            const float theta_o = std::acos(std::max(-1.0f, std::min(lb.normal.cosTheta, 1.0f)));
+            const float theta_e = std::acos(std::max(-1.0f, std::min(lb.cosTheta_e, 1.0f)));
+            const float theta_w = std::min(theta_o + theta_e, (float)M_PI);
+            const float sinTheta_o = std::sin(theta_o);
+            const float M_omega = 2.0f*M_PI*(1.0f - std::cos(theta_o)) + M_PI/2.0f*(2.0f*theta_w*sinTheta_o - std::cos(theta_o - 2.0f*theta_w) - 2.0f*theta_o*sinTheta_o + std::cos(theta_o));
+            //両面の光源は裏側にも同じだけ広がる
+            return lb.twoSided ? 2.0f*M_omega : M_omega;
+        };
+
+
+        //分割のコスト 放射束 向きの広がり 表面積が小さいほど良い
+        //細長い分割を避けるため分割軸に沿った長さの比を掛ける
+        static float evaluateCost(const LightBounds& lb, const AABB& bounds, int dim) {
+            const Vec3 d = bounds.pMax - bounds.pMin;
+            const float maxLength = std::max(d.x, std::max(d.y, d.z));
+            const float Kr = d[dim] > 0.0f ? maxLength/d[dim] : 1.0f;
+            return lb.phi * momentOmega(lb) * Kr * std::max(lb.bounds.surfaceArea(), 1e-6f);
+        };
+
+
+        //[start, end)の光源からノードを構築し そのノードの添字を返す
+        int build(std::vector<std::pair<int, LightBounds>>& bvhInfo, int start, int end, uint64_t bitTrail, int depth) {
+            assert(depth <= maxTrailDepth);
+            if(end - start == 1) {
+                const int nodeIndex = nodes.size();
+                nodes.push_back({bvhInfo[start].second, bvhInfo[start].first, true});
+                lightToBitTrail[bvhLights[bvhInfo[start].first]] = bitTrail;
+                return nodeIndex;
+            }
+
+            AABB bounds, centroidBounds;
+            for(int i = start; i < end; i++) {
+                bounds = mergeAABB(bounds, bvhInfo[i].second.bounds);
+                const Vec3 pc = bvhInfo[i].second.centroid();
+                centroidBounds = mergeAABB(centroidBounds, AABB(pc, pc));
+            }
+
+            //各軸についてバケットに分けてコストが最小になる分割を探す
+            constexpr int nBuckets = 12;
+            float minCost = std::numeric_limits<float>::infinity();
+            int minCostSplitBucket = -1;
+            int minCostSplitDim = -1;
+            for(int dim = 0; dim < 3; dim++) {
+                if(centroidBounds.pMax[dim] == centroidBounds.pMin[dim]) continue;
+
+                LightBounds bucketLightBounds[nBuckets];
+                for(int i = start; i < end; i++) {
+                    const int b = bucketIndex(bvhInfo[i].second.centroid(), centroidBounds, dim, nBuckets);
+                    bucketLightBounds[b] = unionBounds(bucketLightBounds[b], bvhInfo[i].second);
+                }
+
+                for(int i = 0; i < nBuckets - 1; i++) {
+                    LightBounds b0, b1;
+                    for(int j = 0; j <= i; j++)
+                        b0 = unionBounds(b0, bucketLightBounds[j]);
+                    for(int j = i + 1; j < nBuckets; j++)
+                        b1 = unionBounds(b1, bucketLightBounds[j]);
+                    const float cost = evaluateCost(b0, bounds, dim) + evaluateCost(b1, bounds, dim);
+                    if(cost > 0.0f && cost < minCost) {
+                        minCost = cost;
+                        minCostSplitBucket = i;
+                        minCostSplitDim = dim;
+                    }
+                }
+            }
+
+            //経路のビット列はmaxTrailDepth段までしか表せないので 残りの段数で足りなくなる場合は
+            //中央で等分して残りの深さをlog2(光源数)に抑える
+            int levels = 0;
+            while((1 << levels) < end - start) levels++;
+            int mid;
+            if(minCostSplitDim == -1 || depth + levels >= maxTrailDepth) {
+                mid = (start + end)/2;
+            }
+            else {
+                auto itr = std::partition(bvhInfo.begin() + start, bvhInfo.begin() + end, [&](const std::pair<int, LightBounds>& info) {
+                        return bucketIndex(info.second.centroid(), centroidBounds, minCostSplitDim, nBuckets) <= minCostSplitBucket;
+                        });
+                mid = itr - bvhInfo.begin();
+                if(mid == start || mid == end)
+                    mid = (start + end)/2;
+            }
+
+            //先に自分を確保して1番目の子を直後に並べる
+            assert(depth < maxTrailDepth);
+            const int nodeIndex = nodes.size();
+            nodes.push_back({LightBounds(), 0, false});
+            const int child0 = build(bvhInfo, start, mid, bitTrail, depth + 1);
+            const int child1 = build(bvhInfo, mid, end, bitTrail | ((uint64_t)1 << depth), depth + 1);
+            nodes[nodeIndex].lb = unionBounds(nodes[child0].lb, nodes[child1].lb);
+            nodes[nodeIndex].index = child1;
+            return nodeIndex;
+        };
+
+
+        static int bucketIndex(const Vec3& pc, const AABB& centroidBounds, int dim, int nBuckets) {
+            const int b = nBuckets * (pc[dim] - centroidBounds.pMin[dim])/(centroidBounds.pMax[dim] - centroidBounds.pMin[dim]);
+            return std::max(0, std::min(b, nBuckets - 1));
+        };
+};
+constexpr float BVHLightSampler::oneMinusEpsilon;
+constexpr int BVHLightSampler::maxTrailDepth;
+#endif
@@ -3,8 +3,13 @@
 
 #include <iostream>
 #include <map>
+#include <set>
+#include <fstream>
 #include <omp.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <sstream>
+#include <iterator>
 #include "vec3.h"
 #include "film.h"
 #include "ray.h"
@@ -20,19 +25,71 @@
 #include "sampler.h"
 #include "material.h"
 #include "integrator.h"
+#include "wavefront.h"
+#include "bdpt.h"
+#include "sppm.h"
+#include "guiding.h"
+#include "irradiancecache.h"
+#include "pssmlt.h"
+#include "restir.h"
 #include "sky.h"
 #include "rtoutput.h"
 
 
+//[camera]のテーブルからカメラを作る
+std::shared_ptr<Camera> loadCamera(const std::shared_ptr<cpptoml::table>& camera, std::shared_ptr<Film> film) {
+    auto camera_type = *camera->get_as<std::string>("type");
+    auto camera_transform = camera->get_table("transform");
+    auto camera_transform_type = *camera_transform->get_as<std::string>("type");
+    auto camera_transform_origin = *camera_transform->get_array_of<double>("origin");
+    auto camera_transform_target = *camera_transform->get_array_of<double>("target");
+    Vec3 camPos(camera_transform_origin[0], camera_transform_origin[1], camera_transform_origin[2]);
+    Vec3 camTarget(camera_transform_target[0], camera_transform_target[1], camera_transform_target[2]);
+    Vec3 camForward = normalize(camTarget - camPos);
+    if(camera_type == "ideal-pinhole") {
+        auto fov = *camera->get_as<double>("fov");
+        return std::make_shared<PinholeCamera>(camPos, camForward, film, toRad(fov));
+    }
+    if(camera_type == "full-degree") {
+        return std::make_shared<FullDegreeCamera>(camPos, camForward, film); 
+    }
+    if(camera_type == "thin-lens") {
+        auto lensDistance = *camera->get_as<double>("lens-distance");
+        auto focusPoint = *camera->get_array_of<double>("focus-point");
+        auto fnumber = *camera->get_as<double>("f-number");
+        return std::make_shared<ThinLensCamera>(camPos, camForward, film, lensDistance, Vec3(focusPoint[0], focusPoint[1], focusPoint[2]), fnumber);
+    }
+    if(camera_type == "ods") {
+        auto IPD = *camera->get_as<double>("ipd");
+        if(film->width != film->height) {
+            std::cerr << "Invalid Resolution" << std::endl;
+            std::exit(1);
+        }
+        return std::make_shared<ODSCamera>(camPos, camForward, film, IPD);
+    }
+    std::cerr << "invalid camera type" << std::endl;
+    std::exit(1);
+}
+
+
 int main(int argc, char** argv) {
     //ファイルパスの読み込み ./a.out -i scene.toml  のように読み込む
+    //--resumeをつけると前回のチェックポイントから再開する
     std::string filepath;
+    bool resume = false;
+    const struct option longopts[] = {
+        {"resume", no_argument, nullptr, 'r'},
+        {nullptr, 0, nullptr, 0}
+    };
     int opt;
-    while((opt = getopt(argc, argv, "i:on")) != -1) {
+    while((opt = getopt_long(argc, argv, "i:on", longopts, nullptr)) != -1) {
         switch(opt) {
             case 'i':
                 filepath = optarg;
                 break;
+            case 'r':
+                resume = true;
+                break;
         }
     }
 
@@ -40,6 +97,14 @@ int main(int argc, char** argv) {
 
     //tomlの読み込み
     auto toml = cpptoml::parse_file(filepath);
+    //スレッド数 指定がなければOpenMPの既定値
+    //スレッドごとの状態(PerThread)は作った時点のスレッド数で確保されるので 何かを作る前に設定する
+    const auto renderer_table = toml->get_table("renderer");
+    if(renderer_table) {
+        auto threads = renderer_table->get_as<int>("threads");
+        if(threads) omp_set_num_threads(*threads);
+    }
+    std::cout << "threads:" << omp_get_max_threads() << std::endl;
 
 
 
@@ -56,63 +121,47 @@ int main(int argc, char** argv) {
     //sky
     auto sky = toml->get_table("sky");
     auto sky_type = *sky->get_as<std::string>("type");
-    Sky* sky_ptr;
+    std::shared_ptr<Sky> sky_ptr;
+    //IBLを光源サンプリングする場合の光源
+    std::shared_ptr<Light> env_light;
     if(sky_type == "ibl") {
         auto path = *sky->get_as<std::string>("path");
         auto theta_offset = *sky->get_as<double>("theta-offset");
         auto phi_offset = *sky->get_as<double>("phi-offset");
-        sky_ptr = new IBL(path, phi_offset, theta_offset);
+        auto ibl = std::make_shared<IBL>(path, phi_offset, theta_offset);
+        sky_ptr = ibl;
+        if(sky->get_as<bool>("importance").value_or(true))
+            env_light = std::make_shared<EnvironmentLight>(ibl);
     }
     else if(sky_type == "test") {
-        sky_ptr = new TestSky();
+        sky_ptr = std::make_shared<TestSky>();
     }
     else if(sky_type == "uniform") {
         auto color = *sky->get_array_of<double>("color");
-        sky_ptr = new UniformSky(Vec3(color[0], color[1], color[2]));
+        sky_ptr = std::make_shared<UniformSky>(Vec3(color[0], color[1], color[2]));
     }
     else if(sky_type == "simple") {
-        sky_ptr = new SimpleSky();
+        sky_ptr = std::make_shared<SimpleSky>();
     }
     std::cout << "sky loaded" << std::endl;
 
 
 
     //camera
-    auto camera = toml->get_table("camera");
-    auto camera_type = *camera->get_as<std::string>("type");
-    auto camera_transform = camera->get_table("transform");
-    auto camera_transform_type = *camera_transform->get_as<std::string>("type");
-    auto camera_transform_origin = *camera_transform->get_array_of<double>("origin");
-    auto camera_transform_target = *camera_transform->get_array_of<double>("target");
-    Vec3 camPos(camera_transform_origin[0], camera_transform_origin[1], camera_transform_origin[2]);
-    Vec3 camTarget(camera_transform_target[0], camera_transform_target[1], camera_transform_target[2]);
-    Vec3 camForward = normalize(camTarget - camPos);
-    std::shared_ptr<Camera> cam;
-    if(camera_type == "ideal-pinhole") {
-        auto fov = *camera->get_as<double>("fov");
-        cam = std::make_shared<PinholeCamera>(camPos, camForward, film, toRad(fov));
-    }
-    else if(camera_type == "full-degree") {
-        cam = std::make_shared<FullDegreeCamera>(camPos, camForward, film); 
-    }
-    else if(camera_type == "thin-lens") {
-        auto lensDistance = *camera->get_as<double>("lens-distance");
-        auto focusPoint = *camera->get_array_of<double>("focus-point");
-        auto fnumber = *camera->get_as<double>("f-number");
-        cam = std::make_shared<ThinLensCamera>(camPos, camForward, film, lensDistance, Vec3(focusPoint[0], focusPoint[1], focusPoint[2]), fnumber);
-    }
-    else if(camera_type == "ods") {
-        auto IPD = *camera->get_as<double>("ipd");
-        if(resolution[0] != resolution[1]) {
-            std::cerr << "Invalid Resolution" << std::endl;
-            std::exit(1);
+    //[[camera]]を複数書いた場合はタイル単位の積分器(bdptを除く)で全てのカメラを同時に描画する 2つ目以降はそれぞれ別のフィルムを持つ
+    std::vector<std::shared_ptr<Camera>> cameras;
+    std::vector<std::string> camera_names;
+    if(auto camera_array = toml->get_table_array("camera")) {
+        for(const auto& camera : *camera_array) {
+            std::shared_ptr<Film> camera_film = cameras.empty() ? film : std::make_shared<Film>(resolution[0], resolution[1], std::unique_ptr<Filter>(new GaussianFilter(Vec2(1), 1.0f)));
+            camera_names.push_back(camera->get_as<std::string>("name").value_or("camera" + std::to_string(cameras.size())));
+            cameras.push_back(loadCamera(camera, camera_film));
         }
-        cam = std::make_shared<ODSCamera>(camPos, camForward, film, IPD);
     }
     else {
-        std::cerr << "invalid camera type" << std::endl;
-        std::exit(1);
+        cameras.push_back(loadCamera(toml->get_table("camera"), film));
     }
+    std::shared_ptr<Camera> cam = cameras[0];
     std::cout << "camera loaded" << std::endl;
 
 
@@ -155,9 +204,10 @@ int main(int argc, char** argv) {
         std::string type;
         std::string path;
         float radius;
+        bool quads;
 
         ShapeData() {};
-        ShapeData(const std::string& _type, const std::string& _path, float _radius) : type(_type), path(_path), radius(_radius) {};
+        ShapeData(const std::string& _type, const std::string& _path, float _radius, bool _quads = true) : type(_type), path(_path), radius(_radius), quads(_quads) {};
     };
     std::map<std::string, ShapeData> mesh_map;
     auto meshes = toml->get_table_array("mesh");
@@ -170,6 +220,13 @@ int main(int argc, char** argv) {
             shapedata = ShapeData(type, "", radius);
         }
         else if(type == "obj") {
+            std::string path = *mesh->get_as<std::string>("path");
+            //quads = falseで四角形も三角形分割する(比較用)
+            bool quads = mesh->get_as<bool>("quads").value_or(true);
+            shapedata = ShapeData(type, path, 0.0f, quads);
+        }
+        //1行に"x y z r"を並べたテキストファイルから球の集合を読み込む
+        else if(type == "spheres") {
             std::string path = *mesh->get_as<std::string>("path");
             shapedata = ShapeData(type, path, 0.0f);
         }
@@ -179,8 +236,25 @@ int main(int argc, char** argv) {
 
 
 
+    //AreaLightとして参照されるobject名
+    //これらの球は名前で参照するため個別のSphereとして残す
+    auto light_toml = toml->get_table_array("light");
+    std::set<std::string> emitter_names;
+    if(light_toml) {
+        for(const auto& light : *light_toml) {
+            if(*light->get_as<std::string>("type") == "area")
+                emitter_names.insert(*light->get_as<std::string>("object"));
+        }
+    }
+
+
+
     //objects
     auto objects = toml->get_table_array("object");
+    //batch-spheres = trueなら 光源でない球はマテリアルごとにSphereSetにまとめる
+    //まとめた球は名前で参照できなくなる
+    const bool batch_spheres = renderer_table && renderer_table->get_as<bool>("batch-spheres").value_or(false);
+    std::map<std::string, std::pair<std::vector<Vec3>, std::vector<float>>> sphere_batches;
     //プリミティブの配列
     std::vector<std::shared_ptr<Primitive>> prims;
     //ライトの配列
@@ -209,7 +283,11 @@ int main(int argc, char** argv) {
         
         ShapeData shapedata = mesh_map.at(mesh);
         std::shared_ptr<Material> mat = material_map.at(material);
-        if(shapedata.type == "sphere") {
+        if(shapedata.type == "sphere" && batch_spheres && emitter_names.count(name) == 0) {
+            sphere_batches[material].first.push_back(center);
+            sphere_batches[material].second.push_back(shapedata.radius);
+        }
+        else if(shapedata.type == "sphere") {
             std::shared_ptr<Shape> shape = std::shared_ptr<Shape>(new Sphere(center, shapedata.radius));
             std::shared_ptr<Primitive> prim = std::shared_ptr<Primitive>(new GeometricPrimitive(mat, nullptr, shape));
             prims.push_back(prim);
@@ -217,15 +295,42 @@ int main(int argc, char** argv) {
             prim_map.insert(std::make_pair(name, prim));
         }
         else if(shapedata.type == "obj") {
-            loadObj(prims, lights, shapedata.path, center, scale, mat, name, prim_map, shape_map);
+            loadObj(prims, lights, shapedata.path, center, scale, mat, name, prim_map, shape_map, shapedata.quads);
         }
+        else if(shapedata.type == "spheres") {
+            std::ifstream file(shapedata.path);
+            if(!file) {
+                std::cerr << "failed to open " << shapedata.path << std::endl;
+                std::exit(1);
+            }
+            std::vector<Vec3> centers;
+            std::vector<float> radii;
+            float x, y, z, r;
+            while(file >> x >> y >> z >> r) {
+                centers.push_back(center + scale*Vec3(x, y, z));
+                radii.push_back(scale.x*r);
+            }
+            std::shared_ptr<Shape> shape = std::shared_ptr<Shape>(new SphereSet(centers, radii));
+            std::shared_ptr<Primitive> prim = std::shared_ptr<Primitive>(new GeometricPrimitive(mat, nullptr, shape));
+            prims.push_back(prim);
+            shape_map.insert(std::make_pair(name, shape));
+            prim_map.insert(std::make_pair(name, prim));
+        }
+    }
+    for(const auto& batch : sphere_batches) {
+        std::shared_ptr<Shape> shape;
+        if(batch.second.first.size() == 1)
+            shape = std::shared_ptr<Shape>(new Sphere(batch.second.first[0], batch.second.second[0]));
+        else
+            shape = std::shared_ptr<Shape>(new SphereSet(batch.second.first, batch.second.second));
+        prims.push_back(std::shared_ptr<Primitive>(new GeometricPrimitive(material_map.at(batch.first), nullptr, shape)));
+        std::cout << "batched " << batch.second.first.size() << " spheres of material " << batch.first << std::endl;
     }
     std::cout << "objects loaded" << std::endl;
 
 
 
     //lights
-    auto light_toml = toml->get_table_array("light");
     if(light_toml) {
         for(const auto& light : *light_toml) {
             auto light_emission = *light->get_array_of<double>("emission");
@@ -259,17 +364,27 @@ int main(int argc, char** argv) {
     //sampler
     std::shared_ptr<Sampler> sampler;
     auto sampler_toml = toml->get_table("sampler");
-    auto sampler_type = *sampler_toml->get_as<std::string>("type");
+    auto sampler_type = sampler_toml->get_as<std::string>("type").value_or("counter");
     if(sampler_type == "mt") {
         sampler = std::shared_ptr<Sampler>(new UniformSampler(RNG_TYPE::MT));
     }
-    else {
+    else if(sampler_type == "minstd") {
         sampler = std::shared_ptr<Sampler>(new UniformSampler(RNG_TYPE::MINSTD));
     }
+    else if(sampler_type == "sobol") {
+        const int64_t seed = sampler_toml->get_as<int64_t>("seed").value_or(0);
+        sampler = std::shared_ptr<Sampler>(new SobolSampler(seed));
+    }
+    else {
+        //スレッド数によらず同じ画像になる
+        const int64_t seed = sampler_toml->get_as<int64_t>("seed").value_or(0);
+        sampler = std::shared_ptr<Sampler>(new CounterSampler(seed));
+    }
 
 
     //シーンの初期化
-    Scene scene(prims, lights, std::shared_ptr<Sky>(sky_ptr));
+    if(env_light) lights.push_back(env_light);
+    Scene scene(prims, lights, sky_ptr);
 
 
 
@@ -280,6 +395,16 @@ int main(int argc, char** argv) {
     int depth_limit = *renderer->get_as<int>("depth-limit");
     std::string integrator = *renderer->get_as<std::string>("integrator");
     bool renderer_show = *renderer->get_as<bool>("show");
+
+    //光源の選び方 all:全光源 power:放射束に比例 bvh:光源のBVH
+    std::string light_sampler = renderer->get_as<std::string>("light-sampler").value_or("all");
+    if(light_sampler == "power") {
+        scene.lightSampler = std::make_shared<PowerLightSampler>(scene.lights, scene.accel->worldBound());
+    }
+    else if(light_sampler == "bvh") {
+        scene.lightSampler = std::make_shared<BVHLightSampler>(scene.lights, scene.accel->worldBound());
+    }
+    std::cout << "light sampler:" << light_sampler << std::endl;
     bool renderer_profile = *renderer->get_as<bool>("profile");
 
     Integrator* integ;
@@ -304,10 +429,156 @@ int main(int argc, char** argv) {
     else if(integrator == "pt-explicit") {
         integ = new PathTraceExplicit(cam, sampler, samples, depth_limit);
     }
+    else if(integrator == "pt-mis") {
+        integ = new PathTraceMIS(cam, sampler, samples, depth_limit);
+    }
+    else if(integrator == "restir") {
+        ReSTIR* restir = new ReSTIR(cam, sampler, samples, depth_limit);
+        restir->candidates = renderer->get_as<int>("restir-candidates").value_or(32);
+        restir->spatialSamples = renderer->get_as<int>("restir-spatial-samples").value_or(5);
+        if(restir->spatialSamples > ReSTIR::maxSpatialSamples) {
+            std::cerr << "restir-spatial-samples is limited to " << ReSTIR::maxSpatialSamples << std::endl;
+            restir->spatialSamples = ReSTIR::maxSpatialSamples;
+        }
+        restir->spatialRadius = renderer->get_as<double>("restir-radius").value_or(30.0);
+        restir->temporal = renderer->get_as<bool>("restir-temporal").value_or(true);
+        integ = restir;
+    }
+    else if(integrator == "bdpt") {
+        BDPT* bdpt = new BDPT(cam, sampler, samples, depth_limit);
+        bdpt->strategyImages = renderer->get_as<bool>("strategy-images").value_or(false);
+        integ = bdpt;
+    }
+    else if(integrator == "pt-guided") {
+        GuidedPathTrace* guided = new GuidedPathTrace(cam, sampler, samples, depth_limit);
+        guided->trainingIterations = renderer->get_as<int>("training-iterations").value_or(5);
+        guided->bsdfSamplingFraction = renderer->get_as<double>("bsdf-sampling-fraction").value_or(0.5);
+        integ = guided;
+    }
+    else if(integrator == "irradiance-cache") {
+        IrradianceCache* ic = new IrradianceCache(cam, sampler, samples, depth_limit);
+        ic->hemisphereSamples = renderer->get_as<int>("hemisphere-samples").value_or(256);
+        ic->maxError = renderer->get_as<double>("cache-error").value_or(0.2);
+        integ = ic;
+    }
+    else if(integrator == "sppm") {
+        //samplesは反復回数として扱う
+        int photons = renderer->get_as<int>("photons-per-iteration").value_or(1 << 18);
+        double radius = renderer->get_as<double>("radius").value_or(0.0);
+        integ = new SPPM(cam, sampler, samples, depth_limit, photons, radius);
+    }
+    else if(integrator == "pssmlt") {
+        //samplesは1ピクセルあたりの変異の回数として扱う
+        PSSMLT* mlt = new PSSMLT(cam, sampler, samples, depth_limit);
+        mlt->bootstrapSamples = renderer->get_as<int>("bootstrap-samples").value_or(100000);
+        mlt->chains = renderer->get_as<int>("chains").value_or(1000);
+        mlt->largeStepProbability = renderer->get_as<double>("large-step-probability").value_or(0.3);
+        mlt->sigma = renderer->get_as<double>("mutation-sigma").value_or(0.01);
+        integ = mlt;
+    }
+    else if(integrator == "wavefront") {
+        int pool_size = renderer->get_as<int>("pool-size").value_or(1 << 16);
+        WavefrontPathTrace* wavefront = new WavefrontPathTrace(cam, sampler, samples, depth_limit, pool_size);
+        wavefront->lightSamples = renderer->get_as<int>("light-samples").value_or(1);
+        integ = wavefront;
+    }
     else {
         integ = new PathTrace(cam, sampler, 10, 100);
     }
 
+    //点光源と平行光源へのシャドウレイで最後に遮った物体を覚えておく
+    if(auto pt = dynamic_cast<PathTraceExplicit*>(integ)) {
+        pt->occluderCache = renderer->get_as<bool>("occluder-cache").value_or(true);
+    }
+
+    //タイルスケジューラの設定
+    if(auto tiled = dynamic_cast<TiledIntegrator*>(integ)) {
+        tiled->tileSize = renderer->get_as<int>("tile-size").value_or(16);
+        tiled->tileSamples = renderer->get_as<int>("tile-samples").value_or(0);
+        //描画時間の上限[秒] samplesは最大サンプル数として扱う
+        tiled->timeLimit = renderer->get_as<double>("time-limit").value_or(0.0);
+        //期限でパスの途中で打ち切るとピクセルごとのサンプル数が揃わず 光源側から加えた寄与の正規化がずれる
+        if(tiled->timeLimit > 0.0f && integrator == "bdpt") {
+            std::cerr << "time-limit is not supported by bdpt" << std::endl;
+            tiled->timeLimit = 0.0f;
+        }
+        //適応的サンプリング samplesは最大サンプル数として扱う
+        tiled->adaptive = renderer->get_as<bool>("adaptive").value_or(false);
+        //光源側から加える寄与はピクセルごとのサンプル数が揃っていることを前提とする
+        if(tiled->adaptive && integrator == "bdpt") {
+            std::cerr << "adaptive sampling is not supported by bdpt" << std::endl;
+            tiled->adaptive = false;
+        }
+        tiled->pilotSamples = renderer->get_as<int>("pilot-samples").value_or(16);
+        tiled->errorThreshold = renderer->get_as<double>("error-threshold").value_or(0.02);
+        tiled->sppMap = renderer->get_as<bool>("spp-map").value_or(false);
+        tiled->reference = renderer->get_as<std::string>("reference").value_or("");
+        tiled->lightSamples = renderer->get_as<int>("light-samples").value_or(1);
+        tiled->denoise = renderer->get_as<bool>("denoise").value_or(false);
+        tiled->featureSamples = renderer->get_as<int>("feature-samples").value_or(4);
+        //法線, 深度, アルベド, ID, 直接光と間接光を本描画と同じカメラレイで書き出す
+        if(renderer->get_as<bool>("aov").value_or(false)) {
+            if(integrator == "bdpt" || integrator == "restir")
+                std::cerr << "aov is not supported by " << integrator << std::endl;
+            else
+                tiled->aov = true;
+        }
+        //2つ目以降のカメラは同じタイルのプールで描画する
+        //bdptは光源側から辿ったパスを最初のカメラにしか接続できない
+        if(cameras.size() > 1 && integrator == "bdpt") {
+            std::cerr << "multiple cameras are not supported by bdpt, rendering " << camera_names[0] << " only" << std::endl;
+        }
+        else if(cameras.size() > 1) {
+            tiled->extraCameras.assign(cameras.begin() + 1, cameras.end());
+            tiled->cameraNames = camera_names;
+        }
+
+        //チェックポイント
+        tiled->checkpointPath = renderer->get_as<std::string>("checkpoint").value_or(resume ? "checkpoint.bin" : "");
+        tiled->checkpointInterval = renderer->get_as<double>("checkpoint-interval").value_or(300.0);
+        std::ifstream scenefile(filepath, std::ios::binary);
+        tiled->sceneHash = hashBytes(std::string(std::istreambuf_iterator<char>(scenefile), std::istreambuf_iterator<char>()));
+        if(resume) {
+            Checkpoint ckpt;
+            if(!ckpt.read(tiled->checkpointPath)) {
+                std::cerr << "failed to read checkpoint " << tiled->checkpointPath << std::endl;
+                std::exit(1);
+            }
+            if(ckpt.sceneHash != tiled->sceneHash || ckpt.width != film->width || ckpt.height != film->height || ckpt.views != (int)tiled->makeViews().size()) {
+                std::cerr << "checkpoint " << tiled->checkpointPath << " does not match the scene" << std::endl;
+                std::exit(1);
+            }
+            std::istringstream rng(ckpt.rngState);
+            sampler->loadState(rng);
+            tiled->resumePixels = std::move(ckpt.pixels);
+            tiled->resumeSamples = ckpt.samples;
+            std::cout << "resumed from " << tiled->checkpointPath << " at " << ckpt.samples << "spp" << std::endl;
+        }
+    }
+    else {
+        //タイル単位でない積分器は最初のカメラだけを描画する
+        if(cameras.size() > 1)
+            std::cerr << "multiple cameras are not supported by " << integrator << ", rendering " << camera_names[0] << " only" << std::endl;
+        //タイルスケジューラの機能は使えない
+        //時間制限と再開は守れないまま最後まで描画してしまうので終了する
+        if(renderer->get_as<double>("time-limit").value_or(0.0) > 0.0) {
+            std::cerr << "time-limit is not supported by " << integrator << std::endl;
+            std::exit(1);
+        }
+        if(resume) {
+            std::cerr << "--resume is not supported by " << integrator << std::endl;
+            std::exit(1);
+        }
+        for(const std::string option : {"adaptive", "denoise", "aov", "spp-map"}) {
+            if(renderer->get_as<bool>(option).value_or(false))
+                std::cerr << option << " is not supported by " << integrator << std::endl;
+        }
+        for(const std::string option : {"checkpoint", "reference"}) {
+            if(renderer->get_as<std::string>(option))
+                std::cerr << option << " is not supported by " << integrator << std::endl;
+        }
+    }
+
 
     if(renderer_show) {
         //openGLで表示
@@ -63,16 +63,35 @@ enum class MATERIAL_TYPE {
 };
 
 
+//光を運ぶ方向
+//RADIANCEはカメラから 光源から辿るIMPORTANCEでは屈折でのeta^2のスケーリングを行わない
+enum class TRANSPORT_MODE {
+    RADIANCE,
+    IMPORTANCE
+};
+
+
 class Material {
     public:
         const MATERIAL_TYPE type;
+        //Sceneが割り当てる通し番号
+        int id = 0;
 
         Material(const MATERIAL_TYPE& _type) : type(_type) {};
 
         //BRDFを計算する ローカル座標系の方向ベクトルを受け取る
         virtual RGB f(const Vec3& wo, const Vec3& wi) const = 0;
         //BRDFを計算し、BRDFに比例した方向のサンプリングを行う
-        virtual RGB sample(const Vec3& wo, Vec3& wi, Sampler& sampler, float &pdf) const = 0;
+        virtual RGB sample(const Vec3& wo, Vec3& wi, Sampler& sampler, float &pdf, TRANSPORT_MODE mode = TRANSPORT_MODE::RADIANCE) const = 0;
+        //sampleでwiがサンプリングされる確率密度(立体角測度)
+        //デルタ分布のスペキュラーマテリアルは0を返す
+        virtual float pdf(const Vec3& wo, const Vec3& wi) const {
+            return 0.0f;
+        };
+        //反射率(方向によらない色) デノイザーの特徴量に使う
+        virtual RGB albedo() const {
+            return RGB(1.0f);
+        };
 };
 
 
@@ -85,7 +104,7 @@ class Lambert : public Material {
         RGB f(const Vec3& wo, const Vec3& wi) const {
             return reflectance/M_PI;
         };
-        RGB sample(const Vec3& wo, Vec3& wi, Sampler& sampler, float &pdf) const {
+        RGB sample(const Vec3& wo, Vec3& wi, Sampler& sampler, float &pdf, TRANSPORT_MODE mode = TRANSPORT_MODE::RADIANCE) const {
             //コサインに比例した半球サンプリング
             Vec2 u = sampler.getNext2D();
             wi = sampleCosineHemisphere(u);
@@ -93,6 +112,12 @@ class Lambert : public Material {
             pdf = absCosTheta(wi)/M_PI;
             return f(wo, wi);
         };
+        float pdf(const Vec3& wo, const Vec3& wi) const {
+            return cosTheta(wi) > 0.0f ? cosTheta(wi)/M_PI : 0.0f;
+        };
+        RGB albedo() const {
+            return reflectance;
+        };
 };
 
 
@@ -106,11 +131,14 @@ class Mirror : public Material {
         RGB f(const Vec3& wo, const Vec3& wi) const {
             return RGB(0.0f);
         };
-        RGB sample(const Vec3& wo, Vec3& wi, Sampler& sampler, float &pdf) const {
+        RGB sample(const Vec3& wo, Vec3& wi, Sampler& sampler, float &pdf, TRANSPORT_MODE mode = TRANSPORT_MODE::RADIANCE) const {
             pdf = 1.0f;
             wi = reflect(wo, Vec3(0, 1, 0));
             return 1.0f/absCosTheta(wi)*RGB(1.0f)*reflectance;
         };
+        RGB albedo() const {
+            return RGB(reflectance);
+        };
 };
 
 
@@ -122,12 +150,31 @@ class Phong : public Material {
 
         Phong(const Vec3& _reflectance, float _kd, float _alpha) : Material(MATERIAL_TYPE::GLOSSY), reflectance(_reflectance), kd(_kd), alpha(_alpha) {};
 
+        //拡散成分と鏡面成分の和
         RGB f(const Vec3& wo, const Vec3& wi) const {
+            return kd * reflectance/M_PI + specular(wo, wi);
+        };
+        //鏡面成分
+        RGB specular(const Vec3& wo, const Vec3& wi) const {
             //ハーフベクトル
             const Vec3 wh = normalize(wo + wi);
             return (1.0f - kd)*RGB(1.0f)*(alpha + 2.0f)/(2.0f*M_PI) * std::pow(absCosTheta(wh), alpha);
         };
-        RGB sample(const Vec3& wo, Vec3& wi, Sampler& sampler, float &pdf) const {
+        //cos^alphaに比例してサンプリングされたハーフベクトルのpdf
+        float pdf_wh(const Vec3& wh) const {
+            return (alpha + 1.0f)/(2.0f*M_PI) * std::pow(absCosTheta(wh), alpha);
+        };
+        //拡散成分と鏡面成分を選ぶ確率も含めたpdf
+        float pdf(const Vec3& wo, const Vec3& wi) const {
+            if(cosTheta(wi) <= 0.0f) return 0.0f;
+            const Vec3 wh = normalize(wo + wi);
+            return kd * cosTheta(wi)/M_PI + (1.0f - kd) * pdf_wh(wh)/(4.0f*std::abs(dot(wo, wh)) + 1e-6);
+        };
+        //鏡面成分は白
+        RGB albedo() const {
+            return kd * reflectance + (1.0f - kd) * RGB(1.0f);
+        };
+        RGB sample(const Vec3& wo, Vec3& wi, Sampler& sampler, float &pdf, TRANSPORT_MODE mode = TRANSPORT_MODE::RADIANCE) const {
             Vec2 u = sampler.getNext2D();
             //diffuse
             if(sampler.getNext() < kd) {
@@ -147,11 +194,9 @@ class Phong : public Material {
                 wi = reflect(wo, wh);
                 //物体表面より下の方向がサンプリングされたら黒を返す
                 if(wi.y < 0.0f) return RGB(0.0f);
-                //ハーフベクトルのpdf
-                float pdf_wh = (alpha + 2.0f)/(2*M_PI) * std::pow(absCosTheta(wh), alpha);
                 //入射ベクトルのpdf
-                pdf = (1.0f - kd) * pdf_wh/(4.0f*std::abs(dot(wo, wh)) + 1e-6);
-                return f(wo, wi);
+                pdf = (1.0f - kd) * pdf_wh(wh)/(4.0f*std::abs(dot(wo, wh)) + 1e-6);
+                return specular(wo, wi);
             }
         };
 };
@@ -166,7 +211,7 @@ class Glass : public Material {
         RGB f(const Vec3& wo, const Vec3& wi) const {
             return RGB(0.0f);
         };
-        RGB sample(const Vec3& wo, Vec3& wi, Sampler& sampler, float &pdf) const {
+        RGB sample(const Vec3& wo, Vec3& wi, Sampler& sampler, float &pdf, TRANSPORT_MODE mode = TRANSPORT_MODE::RADIANCE) const {
             float ior1, ior2;
             Vec3 normal;
             //物体に入っているか?
@@ -196,7 +241,8 @@ class Glass : public Material {
             else {
                 if(refract(wo, wi, normal, ior1, ior2)) {
                     pdf = 1.0f - fr;
-                    return (1.0 - fr) * eta*eta * 1.0f/dot(wi, -normal)*RGB(1.0f);
+                    const float scale = mode == TRANSPORT_MODE::RADIANCE ? eta*eta : 1.0f;
+                    return (1.0 - fr) * scale * 1.0f/dot(wi, -normal)*RGB(1.0f);
                 }
                 //全反射
                 else {
@@ -19,8 +19,8 @@
 #include "primitive.h"
 
 
-void loadPolygon(const std::vector<std::shared_ptr<Triangle>>& triangles, const std::shared_ptr<Material> _mat, bool mtl, const tinyobj::material_t material, std::vector<std::shared_ptr<Primitive>>& prims, std::vector<std::shared_ptr<Light>>& lights, bool map_insert, const std::string& name, std::map<std::string, std::shared_ptr<Primitive>>& prim_map, std::map<std::string, std::shared_ptr<Shape>>& shape_map) {
-    std::shared_ptr<Shape> shape = std::shared_ptr<Shape>(new Polygon(triangles));
+void loadPolygon(const std::vector<std::shared_ptr<Shape>>& faces, const std::shared_ptr<Material> _mat, bool mtl, const tinyobj::material_t material, std::vector<std::shared_ptr<Primitive>>& prims, std::vector<std::shared_ptr<Light>>& lights, bool map_insert, const std::string& name, std::map<std::string, std::shared_ptr<Primitive>>& prim_map, std::map<std::string, std::shared_ptr<Shape>>& shape_map) {
+    std::shared_ptr<Shape> shape = std::shared_ptr<Shape>(new Polygon(faces));
     std::shared_ptr<Material> mat;
     std::shared_ptr<Light> light;
     if(mtl) {
@@ -66,14 +66,15 @@ void loadPolygon(const std::vector<std::shared_ptr<Triangle>>& triangles, const
 }
 
 
-//objファイルを読み込み、std:shared_ptr<Triangle>の配列を返す
-void loadObj(std::vector<std::shared_ptr<Primitive>>& prims, std::vector<std::shared_ptr<Light>>& lights, const std::string& filename, const Vec3& center, const Vec3& scale, std::shared_ptr<Material> _mat, const std::string& name, std::map<std::string, std::shared_ptr<Primitive>>& prim_map, std::map<std::string, std::shared_ptr<Shape>>& shape_map) {
+//objファイルを読み込み、マテリアルごとにPolygonを生成してprimsに追加する
+//keepQuadsがtrueの場合は4頂点の面を三角形分割せずにQuadとして読み込む
+void loadObj(std::vector<std::shared_ptr<Primitive>>& prims, std::vector<std::shared_ptr<Light>>& lights, const std::string& filename, const Vec3& center, const Vec3& scale, std::shared_ptr<Material> _mat, const std::string& name, std::map<std::string, std::shared_ptr<Primitive>>& prim_map, std::map<std::string, std::shared_ptr<Shape>>& shape_map, bool keepQuads = true) {
     tinyobj::attrib_t attrib;
     std::vector<tinyobj::shape_t> shapes;
     std::vector<tinyobj::material_t> materials;
 
     std::string err;
-    bool ret = tinyobj::LoadObj(&attrib, &shapes, &materials, &err, filename.c_str());
+    bool ret = tinyobj::LoadObj(&attrib, &shapes, &materials, &err, filename.c_str(), nullptr, false);
     if(!err.empty())
         std::cerr << err << std::endl;
     if(!ret)
@@ -83,11 +84,13 @@ void loadObj(std::vector<std::shared_ptr<Primitive>>& prims, std::vector<std::sh
 
     int face_count = 0;
     int vertex_count = 0;
+    int triangle_count = 0;
+    int quad_count = 0;
     for(size_t s = 0; s < shapes.size(); s++) {
         std::cout << "Loading " << shapes[s].name << std::endl;
 
-        //三角形の配列
-        std::vector<std::shared_ptr<Triangle>> triangles;
+        //面の配列
+        std::vector<std::shared_ptr<Shape>> faces;
         size_t index_offset = 0;
         int prev_material_id = 0;
         for(size_t f = 0; f < shapes[s].mesh.num_face_vertices.size(); f++) {
@@ -95,7 +98,7 @@ void loadObj(std::vector<std::shared_ptr<Primitive>>& prims, std::vector<std::sh
             std::vector<Vec3> vertex;
             std::vector<Vec3> normal;
             std::vector<Vec2> uv;
-            for(size_t v = 0; v < fv; v++) {
+            for(int v = 0; v < fv; v++) {
                 tinyobj::index_t idx = shapes[s].mesh.indices[index_offset + v];
                 tinyobj::real_t vx = attrib.vertices[3*idx.vertex_index+0];
                 tinyobj::real_t vy = attrib.vertices[3*idx.vertex_index+1];
@@ -113,22 +116,35 @@ void loadObj(std::vector<std::shared_ptr<Primitive>>& prims, std::vector<std::sh
             }
             index_offset += fv;
 
-            std::shared_ptr<Triangle> triangle;
-            if(normal.size() > 0) {
-                triangle = std::shared_ptr<Triangle>(new Triangle(center + scale*vertex[0], center + scale*vertex[1], center + scale*vertex[2], normal[0], normal[1], normal[2]));
+            std::vector<Vec3> p(fv);
+            for(int v = 0; v < fv; v++)
+                p[v] = center + scale*vertex[v];
+            const bool has_normal = (int)normal.size() == fv;
+            //平面かつ凸な四角形はそのままQuadとして保持する
+            if(keepQuads && fv == 4 && Quad::isPlanarConvex(p[0], p[1], p[2], p[3])) {
+                if(has_normal)
+                    faces.push_back(std::shared_ptr<Shape>(new Quad(p[0], p[1], p[2], p[3], normal[0], normal[1], normal[2], normal[3])));
+                else
+                    faces.push_back(std::shared_ptr<Shape>(new Quad(p[0], p[1], p[2], p[3])));
+                quad_count++;
             }
+            //それ以外はtinyobjと同じく扇状に三角形分割する
             else {
-                triangle = std::shared_ptr<Triangle>(new Triangle(center + scale*vertex[0], center + scale*vertex[1], center + scale*vertex[2]));
+                for(int v = 1; v + 1 < fv; v++) {
+                    if(has_normal)
+                        faces.push_back(std::shared_ptr<Shape>(new Triangle(p[0], p[v], p[v+1], normal[0], normal[v], normal[v+1])));
+                    else
+                        faces.push_back(std::shared_ptr<Shape>(new Triangle(p[0], p[v], p[v+1])));
+                    triangle_count++;
+                }
             }
-
-            triangles.push_back(triangle);
             face_count++;
 
             //マテリアルの変更を検出
             if(f != 0 && shapes[s].mesh.material_ids[f] != prev_material_id) {
                 auto material = materials[shapes[s].mesh.material_ids[f]];
-                loadPolygon(triangles, _mat, mtl, material, prims, lights, false, name, prim_map, shape_map);
-                triangles = std::vector<std::shared_ptr<Triangle>>();
+                loadPolygon(faces, _mat, mtl, material, prims, lights, false, name, prim_map, shape_map);
+                faces = std::vector<std::shared_ptr<Shape>>();
             }
             prev_material_id = shapes[s].mesh.material_ids[f];
         }
@@ -136,14 +152,16 @@ void loadObj(std::vector<std::shared_ptr<Primitive>>& prims, std::vector<std::sh
         tinyobj::material_t material;
         if(mtl) {
             material = materials[shapes[s].mesh.material_ids[0]];
-            loadPolygon(triangles, _mat, mtl, material, prims, lights, shapes.size() == 1, name, prim_map, shape_map);
+            loadPolygon(faces, _mat, mtl, material, prims, lights, shapes.size() == 1, name, prim_map, shape_map);
         }
         else {
-            loadPolygon(triangles, _mat, false, material, prims, lights, shapes.size() == 1, name, prim_map, shape_map);
+            loadPolygon(faces, _mat, false, material, prims, lights, shapes.size() == 1, name, prim_map, shape_map);
         }
     }
     std::cout << "total vertex:" << vertex_count << std::endl;
     std::cout << "total face:" << face_count << std::endl;
+    std::cout << "triangles:" << triangle_count << " quads:" << quad_count << std::endl;
+    std::cout << "face memory:" << (triangle_count*sizeof(Triangle) + quad_count*sizeof(Quad))/1024 << "KB" << std::endl;
 }
 
 
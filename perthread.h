@@ -0,0 +1,47 @@
+#ifndef PERTHREAD_H
+#define PERTHREAD_H
+#include <omp.h>
+#include <cassert>
+#include <vector>
+
+
+//OpenMPのスレッドごとに1つずつ持つ値
+//作った時点のomp_get_max_threads()個の要素を確保するので スレッド数を変える場合はその前に設定しておく
+//要素は64バイトずつ離して置き 他のスレッドの要素とキャッシュラインを共有しないようにする
+//(C++14のnewはalignasを保証しないので詰め物にする)
+template <typename T>
+class PerThread {
+    public:
+        PerThread(const T& init = T()) : slots(omp_get_max_threads(), Slot{init}) {};
+
+        //呼び出したスレッドの値
+        T& get() {
+            const int t = omp_get_thread_num();
+            assert(t < size());
+            return slots[t].value;
+        };
+        const T& get() const {
+            const int t = omp_get_thread_num();
+            assert(t < size());
+            return slots[t].value;
+        };
+
+        int size() const {
+            return slots.size();
+        };
+        T& operator[](int t) {
+            return slots[t].value;
+        };
+        const T& operator[](int t) const {
+            return slots[t].value;
+        };
+
+
+    private:
+        struct Slot {
+            T value;
+            char padding[64];
+        };
+        std::vector<Slot> slots;
+};
+#endif
@@ -14,6 +14,8 @@ class Primitive {
     public:
         std::shared_ptr<Material> material;
         std::shared_ptr<Light> areaLight;
+        //Sceneが割り当てる通し番号
+        int id = -1;
 
         Primitive() {};
         Primitive(const std::shared_ptr<Material> _material, std::shared_ptr<Light> _areaLight) : material(_material), areaLight(_areaLight) {};
@@ -0,0 +1,396 @@
+#ifndef PSSMLT_H
+#define PSSMLT_H
+#include <omp.h>
+#include <cmath>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include "integrator.h"
+#include "distribution.h"
+#include "perthread.h"
+
+
+//誤差関数の逆関数(Giles 2010の単精度の近似)
+inline float erfInv(float x) {
+    x = clamp(x, -0.99999f, 0.99999f);
+    float w = -std::log((1.0f - x)*(1.0f + x));
+    float p;
+    if(w < 5.0f) {
+        w -= 2.5f;
+        p = 2.81022636e-08f;
+        p = 3.43273939e-07f + p*w;
+        p = -3.5233877e-06f + p*w;
+        p = -4.39150654e-06f + p*w;
+        p = 0.00021858087f + p*w;
+        p = -0.00125372503f + p*w;
+        p = -0.00417768164f + p*w;
+        p = 0.246640727f + p*w;
+        p = 1.50140941f + p*w;
+    }
+    else {
+        w = std::sqrt(w) - 3.0f;
+        p = -0.000200214257f;
+        p = 0.000100950558f + p*w;
+        p = 0.00134934322f + p*w;
+        p = -0.00367342844f + p*w;
+        p = 0.00573950773f + p*w;
+        p = -0.0076224613f + p*w;
+        p = 0.00943887047f + p*w;
+        p = 1.00167406f + p*w;
+        p = 2.83297682f + p*w;
+    }
+    return p*x;
+}
+
+
+//主標本空間(パスを作るのに使う乱数の列)の点を変異させていくSampler
+//スレッドごとに1本のマルコフ連鎖の状態を持ち 積分器はgetNextで現在の提案の成分を読む
+//成分は読まれたときに遅延して変異させるので パスが使わなかった次元には手間がかからない(Kelemen et al. 2002)
+class MLTSampler : public Sampler {
+    public:
+        //大きな変異(全成分を一様乱数に置き換える)の確率
+        float largeStepProbability;
+        //小さな変異の正規分布の標準偏差
+        float sigma;
+
+        MLTSampler(float _largeStepProbability, float _sigma) : largeStepProbability(_largeStepProbability), sigma(_sigma) {};
+
+
+        //このスレッドの連鎖をseedから始める
+        //最初の評価は全成分が一様乱数になるので 同じseedからは同じパスが得られる
+        void startChain(uint64_t seed) {
+            Chain& c = chain();
+            c.rng = mixBits(seed);
+            c.X.clear();
+            c.iteration = 0;
+            c.lastLargeStep = 0;
+            c.largeStep = true;
+            c.dimension = 0;
+        };
+        //連鎖の状態を保ったまま 以降の変異に使う乱数の列をstreamごとに変える
+        //同じ初期状態から始める連鎖を別々に進めるのに使う
+        void reseed(uint64_t stream) {
+            Chain& c = chain();
+            c.rng = mixBits(c.rng ^ mixBits(stream));
+        };
+        //次の提案を始める
+        void startIteration() {
+            Chain& c = chain();
+            c.iteration++;
+            c.largeStep = c.uniform() < largeStepProbability;
+            c.dimension = 0;
+        };
+        //提案を受理する
+        void accept() {
+            Chain& c = chain();
+            if(c.largeStep)
+                c.lastLargeStep = c.iteration;
+        };
+        //提案を棄却して 変異させた成分を元に戻す
+        void reject() {
+            Chain& c = chain();
+            for(PrimarySample& x : c.X) {
+                if(x.modified == c.iteration)
+                    x.restore();
+            }
+            c.iteration--;
+        };
+        //主標本空間とは別の一様乱数 受理判定などに使う
+        float uniform() {
+            return chain().uniform();
+        };
+
+
+        float getNext() {
+            Chain& c = chain();
+            const uint32_t i = c.dimension++;
+            ensureReady(c, i);
+            return c.X[i].value;
+        };
+        Vec2 getNext2D() {
+            const float x = getNext();
+            const float y = getNext();
+            return Vec2(x, y);
+        };
+        void startDimension(uint32_t dimension) {
+            Chain& c = chain();
+            c.dimension = std::max(c.dimension, dimension);
+        };
+
+
+    private:
+        struct PrimarySample {
+            float value = 0.0f;
+            //最後に変異させた反復
+            int64_t modified = 0;
+            //棄却されたときに戻す値
+            float valueBackup = 0.0f;
+            int64_t modifiedBackup = 0;
+
+            void backup() {
+                valueBackup = value;
+                modifiedBackup = modified;
+            };
+            void restore() {
+                value = valueBackup;
+                modified = modifiedBackup;
+            };
+        };
+
+        //1本のマルコフ連鎖の状態
+        struct Chain {
+            std::vector<PrimarySample> X;
+            uint64_t rng = 0;
+            int64_t iteration = 0;
+            int64_t lastLargeStep = 0;
+            bool largeStep = true;
+            uint32_t dimension = 0;
+
+            float uniform() {
+                rng += 0x9e3779b97f4a7c15ull;
+                return (mixBits(rng) >> 40)*(1.0f/16777216.0f);
+            };
+        };
+        PerThread<Chain> chains;
+
+        Chain& chain() {
+            return chains.get();
+        };
+
+
+        //i番目の成分を今の反復まで変異させる
+        void ensureReady(Chain& c, uint32_t i) {
+            if(i >= c.X.size())
+                c.X.resize(i + 1);
+            PrimarySample& x = c.X[i];
+            //最後の大きな変異より前の値は その大きな変異で一様乱数に置き換わっていたはず
+            if(x.modified < c.lastLargeStep) {
+                x.value = c.uniform();
+                x.modified = c.lastLargeStep;
+            }
+
+            x.backup();
+            if(c.largeStep) {
+                x.value = c.uniform();
+            }
+            else {
+                //読まれなかった反復の分の小さな変異をまとめて行う 正規分布の和は分散の和を持つ正規分布
+                const int64_t nSmall = c.iteration - x.modified;
+                const float normal = std::sqrt(2.0f)*erfInv(2.0f*c.uniform() - 1.0f);
+                x.value += normal*sigma*std::sqrt((float)nSmall);
+                x.value -= std::floor(x.value);
+                x.value = std::min(x.value, 0.99999994f);
+            }
+            x.modified = c.iteration;
+        };
+};
+
+
+//主標本空間メトロポリス光輸送(Primary Sample Space MLT, Kelemen et al. 2002)
+//パスを作る乱数の列を状態とするマルコフ連鎖で 輝度に比例してパスをサンプリングする
+//隙間から差し込む光や鏡とガラス越しのコースティクスのように 寄与のあるパスが少ない場面で
+//一度見つけたパスの近くを探索し続けるので 一方向のパストレーシングより速く収束する
+//  1. 独立なパスをbootstrapSamples本作り 平均輝度bを求める
+//  2. その輝度に比例して各連鎖の初期状態を選び 連鎖を並列に進めてフィルムに寄与を加える
+//  3. 各ピクセルを(寄与の和)*b/(1ピクセルあたりの変異の回数)とする
+//パスはスペキュラー経由で光源に当たるパスも扱うPathTraceMISで求める 最初の2次元がピクセル上の位置になる
+class PSSMLT : public Integrator {
+    public:
+        //1ピクセルあたりの変異の回数
+        int mutationsPerPixel;
+        int maxDepth;
+        //正規化定数を求めるパスの数
+        int bootstrapSamples = 100000;
+        //マルコフ連鎖の数 スレッド数より十分多くして負荷を分散させる
+        int chains = 1000;
+        float largeStepProbability = 0.3f;
+        float sigma = 0.01f;
+
+        PSSMLT(std::shared_ptr<Camera> _cam, std::shared_ptr<Sampler> _sampler, int _mutationsPerPixel, int _maxDepth) : Integrator(_cam, _sampler), mutationsPerPixel(_mutationsPerPixel), maxDepth(_maxDepth) {};
+
+
+        void render(const Scene& scene) const {
+            const int nEyes = cam->two_eyes ? 2 : 1;
+            for(int eye = 0; eye < nEyes; eye++) {
+                const bool isLeft = eye == 0;
+                cam->film->clear();
+                renderEye(scene, isLeft);
+                cam->film->gamma_correction();
+                if(!cam->two_eyes)
+                    cam->film->ppm_output("output.ppm");
+                else
+                    cam->film->ppm_output(isLeft ? "left.ppm" : "right.ppm");
+            }
+        };
+        //表示用に呼ばれるたびに1ピクセルあたり1回の変異を加える
+        //表示側は呼び出し回数で割るので color_sumには(寄与の和)*bを入れる
+        void compute(const Scene& scene) const {
+            Film& film = *cam->film;
+            if(!computeCore) {
+                film.clear();
+                computeSampler = std::make_shared<MLTSampler>(largeStepProbability, sigma);
+                computeCore = std::unique_ptr<PathTraceMIS>(new PathTraceMIS(cam, computeSampler, 1, maxDepth));
+                computeSeed = chainSeed(true);
+                std::vector<float> weights;
+                computeB = bootstrap(scene, *computeCore, *computeSampler, true, computeSeed, weights);
+                if(computeB <= 0.0f) {
+                    std::cerr << "PSSMLT: no path carries light" << std::endl;
+                    return;
+                }
+                computeDistribution = std::unique_ptr<Distribution1D>(new Distribution1D(weights));
+            }
+            if(computeB <= 0.0f) return;
+
+            computedPasses++;
+            runChains(scene, *computeCore, *computeSampler, true, computeSeed, *computeDistribution, (long long)film.width*film.height, computedPasses, false);
+            for(int j = 0; j < film.height; j++) {
+                for(int i = 0; i < film.width; i++)
+                    film.setPixel(i, j, computeB*film.pixels[i + film.width*j].splat_sum);
+            }
+        };
+
+
+    private:
+        //主標本空間の点から1本のパスの寄与を求め pRasterにピクセル上の位置を返す
+        RGB L(const Scene& scene, const PathTraceMIS& core, MLTSampler& mlt, bool isLeft, Vec2& pRaster) const {
+            const int width = cam->film->width;
+            const int height = cam->film->height;
+            pRaster.x = mlt.getNext()*width;
+            pRaster.y = mlt.getNext()*height;
+            const Vec2 uv = cam->rasterToUV(pRaster.x, pRaster.y);
+            float w;
+            const Ray ray = cam->getRay(uv.x, uv.y, w, mlt, isLeft);
+            const RGB c = w*core.Li(ray, scene);
+            return (isnan(c) || isinf(c)) ? RGB(0.0f) : c;
+        };
+
+
+        //連鎖ごとの乱数の種 Samplerから決めるので同じSamplerの設定なら同じ画像になる
+        uint64_t chainSeed(bool isLeft) const {
+            sampler->startPixelSample(0, isLeft ? 0 : 1);
+            const uint64_t hi = (uint64_t)(sampler->getNext()*16777216.0f);
+            const uint64_t lo = (uint64_t)(sampler->getNext()*16777216.0f);
+            return mixBits((hi << 24) | lo);
+        };
+
+
+        //独立なパスをbootstrapSamples本作り 輝度をweightsに入れて平均輝度bを返す
+        float bootstrap(const Scene& scene, const PathTraceMIS& core, MLTSampler& mlt, bool isLeft, uint64_t seed, std::vector<float>& weights) const {
+            weights.assign(bootstrapSamples, 0.0f);
+            #pragma omp parallel for schedule(dynamic, 256)
+            for(int k = 0; k < bootstrapSamples; k++) {
+                mlt.startChain(seed + k);
+                Vec2 pRaster;
+                weights[k] = std::max(0.0f, luminance(L(scene, core, mlt, isLeft, pRaster)));
+            }
+            double weightSum = 0.0;
+            for(float w : weights)
+                weightSum += w;
+            return weightSum/bootstrapSamples;
+        };
+
+
+        //chains本の連鎖で合計nMutations回変異させ 寄与をフィルムのsplat_sumに加える 受理された回数を返す
+        //stream > 0なら初期状態を選び直し 変異の乱数の列も変える
+        long long runChains(const Scene& scene, const PathTraceMIS& core, MLTSampler& mlt, bool isLeft, uint64_t seed, const Distribution1D& bootstrapDistribution, long long nMutations, uint64_t stream, bool progress) const {
+            Film& film = *cam->film;
+            std::atomic<long long> nAccepted(0);
+            std::atomic<int> finished(0);
+            #pragma omp parallel for schedule(dynamic, 1)
+            for(int c = 0; c < chains; c++) {
+                const long long chainMutations = (c + 1)*nMutations/chains - c*nMutations/chains;
+                //初期状態を輝度に比例して選ぶ 同じ種から作り直すのでbootstrapと同じパスになる
+                float pmf;
+                const int k = bootstrapDistribution.sampleDiscrete((mixBits(seed ^ mixBits(c + 1) ^ mixBits(stream)) >> 40)*(1.0f/16777216.0f), pmf);
+                mlt.startChain(seed + k);
+                Vec2 pCurrent;
+                RGB LCurrent = L(scene, core, mlt, isLeft, pCurrent);
+                float ICurrent = std::max(0.0f, luminance(LCurrent));
+                if(stream > 0)
+                    mlt.reseed(stream);
+
+                long long accepted = 0;
+                for(long long m = 0; m < chainMutations; m++) {
+                    mlt.startIteration();
+                    Vec2 pProposed;
+                    const RGB LProposed = L(scene, core, mlt, isLeft, pProposed);
+                    const float IProposed = std::max(0.0f, luminance(LProposed));
+                    const float a = ICurrent > 0.0f ? std::min(1.0f, IProposed/ICurrent) : 1.0f;
+
+                    //受理されるかによらず 両方の状態に受理確率で重みをつけて加える
+                    if(a > 0.0f)
+                        film.addSplat((int)pProposed.x, (int)pProposed.y, a/IProposed*LProposed);
+                    if(a < 1.0f)
+                        film.addSplat((int)pCurrent.x, (int)pCurrent.y, (1.0f - a)/ICurrent*LCurrent);
+
+                    if(mlt.uniform() < a) {
+                        pCurrent = pProposed;
+                        LCurrent = LProposed;
+                        ICurrent = IProposed;
+                        mlt.accept();
+                        accepted++;
+                    }
+                    else {
+                        mlt.reject();
+                    }
+                }
+                nAccepted += accepted;
+
+                const int done = ++finished;
+                if(progress && omp_get_thread_num() == 0)
+                    std::cout << progressbar(done, chains) << " " << percentage(done, chains) << '\r' << std::flush;
+            }
+            return nAccepted;
+        };
+
+
+        void renderEye(const Scene& scene, bool isLeft) const {
+            Timer timer;
+            timer.start();
+            Film& film = *cam->film;
+            const int width = film.width;
+            const int height = film.height;
+            const uint64_t seed = chainSeed(isLeft);
+
+            const std::shared_ptr<MLTSampler> mlt = std::make_shared<MLTSampler>(largeStepProbability, sigma);
+            const PathTraceMIS core(cam, mlt, 1, maxDepth);
+
+            //1. 正規化定数
+            std::vector<float> weights;
+            const float b = bootstrap(scene, core, *mlt, isLeft, seed, weights);
+            if(b <= 0.0f) {
+                std::cerr << "PSSMLT: no path carries light" << std::endl;
+                return;
+            }
+            const Distribution1D bootstrapDistribution(weights);
+            timer.stop("Bootstrap Finished");
+            std::cout << "PSSMLT: b = " << b << std::endl;
+
+            //2. マルコフ連鎖
+            timer.start();
+            const long long nMutations = (long long)mutationsPerPixel*width*height;
+            const long long nAccepted = runChains(scene, core, *mlt, isLeft, seed, bootstrapDistribution, nMutations, 0, true);
+            std::cout << std::endl;
+            timer.stop("Rendering Finished");
+            std::cout << "PSSMLT: acceptance rate " << (nMutations > 0 ? (float)nAccepted/nMutations : 0.0f) << std::endl;
+
+            //3. 正規化
+            const float scale = b/mutationsPerPixel;
+            for(int j = 0; j < height; j++) {
+                for(int i = 0; i < width; i++)
+                    film.setPixel(i, j, scale*film.pixels[i + width*j].splat_sum);
+            }
+        };
+
+
+        //computeで使う状態 最初の呼び出しでbootstrapを行い 以降は連鎖を1ピクセルあたり1回ずつ進める
+        mutable std::shared_ptr<MLTSampler> computeSampler;
+        mutable std::unique_ptr<PathTraceMIS> computeCore;
+        mutable std::unique_ptr<Distribution1D> computeDistribution;
+        mutable uint64_t computeSeed = 0;
+        mutable float computeB = 0.0f;
+        mutable int computedPasses = 0;
+};
+#endif
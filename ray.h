@@ -7,9 +7,11 @@ class Ray {
         Vec3 direction;
         mutable float tmax;
         constexpr static float tmin = 1e-5;
+        //tmaxの初期値 方向の逆数が発散しないように抑える値にも使う
+        constexpr static float tfar = 10000.0f;
 
         Ray() : origin(Vec3()), direction(Vec3()) {};
-        Ray(const Vec3& _origin, const Vec3& _direction) : origin(_origin), direction(_direction), tmax(10000.0f) {};
+        Ray(const Vec3& _origin, const Vec3& _direction) : origin(_origin), direction(_direction), tmax(tfar) {};
 
         Vec3 operator()(float t) const {
             return origin + t*direction;
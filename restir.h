@@ -0,0 +1,380 @@
+#ifndef RESTIR_H
+#define RESTIR_H
+#include <omp.h>
+#include <cmath>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include "integrator.h"
+
+
+//光源上の1点 面光源と点光源は位置 平行光源は光源への方向で表す
+//シェーディング点によらない表し方にして 他のピクセルでも使えるようにする
+struct LightPoint {
+    const Light* light = nullptr;
+    Vec3 p;
+    //面光源の法線
+    Vec3 n;
+    RGB Le;
+};
+
+
+//重み付きリザーバーサンプリングで候補から1つを選んで持つ
+struct Reservoir {
+    LightPoint y;
+    //候補の重みの和
+    float wSum = 0.0f;
+    //これまでに見た候補の数
+    float M = 0.0f;
+    //選んだ点の寄与にかける重み wSum/(M*p̂(y))
+    float W = 0.0f;
+
+    //重みwの候補xを確率w/wSumで選ぶ uは[0, 1)の一様乱数
+    void update(const LightPoint& x, float w, float u) {
+        wSum += w;
+        M += 1.0f;
+        if(u*wSum < w)
+            y = x;
+    };
+    //pHatは選んだ点でのターゲット関数の値
+    void finalize(float pHat) {
+        W = (pHat > 0.0f && M > 0.0f) ? wSum/(M*pHat) : 0.0f;
+    };
+};
+
+
+//ReSTIR(Bitterli et al. 2020)による最初の衝突点の直接光
+//1パスごとに画面全体について
+//  1. カメラレイの最初の衝突点を求める
+//  2. 各ピクセルで光源上の候補をcandidates個選び ターゲット関数(遮蔽を無視した寄与の輝度)でリザーバーに再サンプリングする
+//     temporalなら前のパスの同じピクセルのリザーバーも合わせる
+//  3. 近くのピクセルのリザーバーをspatialSamples個合わせる
+//  4. 選ばれた点にだけシャドウレイを飛ばして直接光を求め 間接光はBRDFサンプリングしてPathTraceExplicitと同じく追跡する
+//多数の面光源があるシーンでも 隣のピクセルが見つけた重要な光源を使えるので少ないsppで収束する
+//再利用では可視性を考えないので 影の境界付近はわずかに暗くなる(バイアスがある)
+//スペキュラーな面に当たったピクセルはPathTraceExplicitで計算する
+class ReSTIR : public PathTraceExplicit {
+    public:
+        //1ピクセルで最初に選ぶ候補の数
+        int candidates = 32;
+        //空間方向に再利用する近傍のピクセル数と探す半径[pixel] ピクセル数はmaxSpatialSamplesまで
+        int spatialSamples = 5;
+        float spatialRadius = 30.0f;
+        static constexpr int maxSpatialSamples = 32;
+        //前のパスのリザーバーを再利用するか カメラが動かないことを前提とする
+        bool temporal = true;
+
+        ReSTIR(std::shared_ptr<Camera> _cam, std::shared_ptr<Sampler> _sampler, int _pixelSamples, int _maxDepth) : PathTraceExplicit(_cam, _sampler, _pixelSamples, _maxDepth) {};
+
+
+        //[sampleStart, sampleEnd)番目のサンプルを1パスずつ全ビューについて計算する
+        void renderTiles(const Scene& scene, const std::vector<View>& views, const std::vector<Tile>& tiles, int sampleStart, int sampleEnd, const std::vector<uint8_t>* active = nullptr) const {
+            const int width = views[0].film->width;
+            const int height = views[0].film->height;
+            if(history.size() != views.size() || history[0].size() != (size_t)width*height) {
+                history.assign(views.size(), std::vector<Reservoir>(width*height));
+                historyPoints.assign(views.size(), std::vector<ShadingPoint>(width*height));
+            }
+            for(int k = sampleStart; k < sampleEnd; k++) {
+                if(k > 0 && timeUp()) break;
+                for(int v = 0; v < (int)views.size(); v++)
+                    renderPass(scene, views[v], v, k, active ? active->data() + v*width*height : nullptr);
+                std::cout << progressbar(k + 1, pixelSamples) << " " << percentage(k + 1, pixelSamples) << '\r' << std::flush;
+            }
+        };
+
+
+    private:
+        //カメラレイの最初の非スペキュラーな衝突点
+        struct ShadingPoint {
+            bool valid = false;
+            Hit res;
+            Vec3 n, s, t;
+            Vec3 wo_local;
+            const Material* material = nullptr;
+            //カメラの重み
+            float w = 0.0f;
+        };
+
+        //パスごとに作り直すバッファ
+        mutable std::vector<ShadingPoint> points;
+        mutable std::vector<Reservoir> initial;
+        mutable std::vector<Reservoir> reservoirs;
+        //前のパスの最終的なリザーバーと衝突点 ビューごと
+        mutable std::vector<std::vector<Reservoir>> history;
+        mutable std::vector<std::vector<ShadingPoint>> historyPoints;
+
+        //段階ごとに乱数の次元をずらして 同じピクセルの各段階が同じ乱数を使わないようにする
+        static constexpr uint32_t candidateDimension = 1 << 20;
+        static constexpr uint32_t spatialDimension = 2 << 20;
+        static constexpr uint32_t shadeDimension = 3 << 20;
+
+
+        void renderPass(const Scene& scene, const View& view, int v, int k, const uint8_t* flags) const {
+            Film& film = *view.film;
+            const int width = film.width;
+            const int height = film.height;
+            const int n = width*height;
+            points.assign(n, ShadingPoint());
+            initial.assign(n, Reservoir());
+            reservoirs.assign(n, Reservoir());
+            //直接光以外の寄与 光源やスペキュラーな面が見えたピクセルはここで全て求める
+            std::vector<RGB> Le(n);
+            const uint64_t pixelOffset = (uint64_t)v*n;
+
+            //1. 最初の衝突点
+            #pragma omp parallel for schedule(dynamic, 1)
+            for(int j = 0; j < height; j++) {
+                for(int i = 0; i < width; i++) {
+                    const int p = i + width*j;
+                    if(flags && !flags[p]) continue;
+                    sampler->startPixelSample(pixelOffset + p, k);
+                    const float rx = sampler->getNext();
+                    const float ry = sampler->getNext();
+                    const Vec2 uv = view.cam->rasterToUV(i + rx, j + ry);
+                    float w;
+                    const Ray ray = view.cam->getRay(uv.x, uv.y, w, *sampler, view.isLeft);
+
+                    Hit res;
+                    if(!scene.intersect(ray, res)) {
+                        Le[p] = w*scene.sky->getSky(ray);
+                        continue;
+                    }
+                    if(res.hitPrimitive->areaLight != nullptr) {
+                        Le[p] = w*res.hitPrimitive->areaLight->Le(res);
+                        continue;
+                    }
+                    const Material* material = res.hitPrimitive->material.get();
+                    if(material->type != MATERIAL_TYPE::DIFFUSE && material->type != MATERIAL_TYPE::GLOSSY) {
+                        Le[p] = w*radiance(ray, scene);
+                        continue;
+                    }
+                    ShadingPoint& sp = points[p];
+                    sp.valid = true;
+                    sp.res = res;
+                    sp.n = res.hitNormal;
+                    sp.s = res.dpdu;
+                    sp.t = normalize(cross(sp.s, sp.n));
+                    sp.wo_local = worldToLocal(-ray.direction, sp.n, sp.s, sp.t);
+                    sp.material = material;
+                    sp.w = w;
+                }
+            }
+
+            //2. 候補の再サンプリングと前のパスのリザーバーの再利用
+            std::vector<Reservoir>& prev = history[v];
+            std::vector<ShadingPoint>& prevPoints = historyPoints[v];
+            #pragma omp parallel for schedule(dynamic, 1)
+            for(int j = 0; j < height; j++) {
+                for(int i = 0; i < width; i++) {
+                    const int p = i + width*j;
+                    const ShadingPoint& sp = points[p];
+                    if(!sp.valid) continue;
+                    sampler->startPixelSample(pixelOffset + p, k, candidateDimension);
+                    Reservoir r;
+                    for(int c = 0; c < candidates; c++) {
+                        float pdf;
+                        const LightPoint y = sampleLightPoint(scene, sp.res, pdf);
+                        const float w = pdf > 0.0f ? targetFunction(sp, y)/pdf : 0.0f;
+                        r.update(y, w, sampler->getNext());
+                    }
+                    r.finalize(targetFunction(sp, r.y));
+
+                    if(temporal && similar(sp, prevPoints[p]) && prev[p].y.light != nullptr) {
+                        //古いサンプルが残り続けないように候補の数を制限する
+                        Reservoir old = prev[p];
+                        old.M = std::min(old.M, 20.0f*candidates);
+                        const Reservoir* rs[2] = {&r, &old};
+                        const ShadingPoint* sps[2] = {&sp, &prevPoints[p]};
+                        r = combine(sp, rs, sps, 2);
+                    }
+                    initial[p] = r;
+                }
+            }
+
+            //3. 近傍のピクセルのリザーバーの再利用
+            #pragma omp parallel for schedule(dynamic, 1)
+            for(int j = 0; j < height; j++) {
+                for(int i = 0; i < width; i++) {
+                    const int p = i + width*j;
+                    const ShadingPoint& sp = points[p];
+                    if(!sp.valid) continue;
+                    sampler->startPixelSample(pixelOffset + p, k, spatialDimension);
+                    //自分と近傍のリザーバー ピクセルごとに確保しないよう固定長の配列に入れる
+                    const Reservoir* rs[maxSpatialSamples + 1] = {&initial[p]};
+                    const ShadingPoint* sps[maxSpatialSamples + 1] = {&sp};
+                    int n = 1;
+                    const int nSpatial = std::min(spatialSamples, (int)maxSpatialSamples);
+                    for(int s = 0; s < nSpatial; s++) {
+                        const Vec2 d = spatialRadius*sampleDisk(sampler->getNext2D());
+                        const int qi = i + (int)std::round(d.x);
+                        const int qj = j + (int)std::round(d.y);
+                        if(qi < 0 || qi >= width || qj < 0 || qj >= height) continue;
+                        const int q = qi + width*qj;
+                        if(q == p || !similar(sp, points[q])) continue;
+                        rs[n] = &initial[q];
+                        sps[n] = &points[q];
+                        n++;
+                    }
+                    reservoirs[p] = combine(sp, rs, sps, n);
+                }
+            }
+
+            //4. 選ばれた点の直接光と間接光
+            #pragma omp parallel for schedule(dynamic, 1)
+            for(int j = 0; j < height; j++) {
+                for(int i = 0; i < width; i++) {
+                    const int p = i + width*j;
+                    if(flags && !flags[p]) continue;
+                    const ShadingPoint& sp = points[p];
+                    if(!sp.valid) {
+                        film.addSample(i, j, Le[p]);
+                        prevPoints[p].valid = false;
+                        continue;
+                    }
+                    sampler->startPixelSample(pixelOffset + p, k, shadeDimension);
+                    const Reservoir& r = reservoirs[p];
+                    RGB L;
+                    if(r.W > 0.0f && visible(scene, sp, r.y))
+                        L += contribution(sp, r.y)*r.W;
+
+                    if(maxDepth > 0) {
+                        Vec3 wi_local;
+                        float brdf_pdf = 1.0f;
+                        const RGB brdf_f = sp.material->sample(sp.wo_local, wi_local, *sampler, brdf_pdf);
+                        const RGB f = brdf_pdf > 0.0f ? std::abs(wi_local.y)/brdf_pdf*brdf_f : RGB(0.0f);
+                        if(!iszero(wi_local) && nonzero(f) && !isnan(f) && !isinf(f)) {
+                            //光源に当たった分は直接光で数えているので使わない
+                            Vec3 hit_le;
+                            L += f*Li(Ray(sp.res.hitPos, localToWorld(wi_local, sp.n, sp.s, sp.t)), scene, hit_le);
+                        }
+                    }
+                    film.addSample(i, j, sp.w*L);
+                    prev[p] = r;
+                    prevPoints[p] = sp;
+                }
+            }
+        };
+
+
+        //resから見て光源を選び その光源上の点を選ぶ
+        //pdfは光源の選択確率と点の確率密度(面光源は面積測度)の積
+        LightPoint sampleLightPoint(const Scene& scene, const Hit& res, float& pdf) const {
+            LightPoint y;
+            pdf = 0.0f;
+            const int nLights = scene.lights.size();
+            if(nLights == 0) return y;
+            float pmf;
+            if(scene.lightSampler) {
+                y.light = scene.lightSampler->sample(res, sampler->getNext(), pmf);
+                if(y.light == nullptr) return y;
+            }
+            else {
+                y.light = scene.lights[std::min((int)(sampler->getNext()*nLights), nLights - 1)].get();
+                pmf = 1.0f/nLights;
+            }
+
+            switch(y.light->type) {
+                case LIGHT_TYPE::AREA: {
+                    const AreaLight* area = static_cast<const AreaLight*>(y.light);
+                    float pointPdf;
+                    y.p = area->shape->sample(*sampler, y.n, pointPdf);
+                    y.Le = area->power;
+                    pdf = pmf*pointPdf;
+                    break;
+                }
+                case LIGHT_TYPE::POINT:
+                    y.p = static_cast<const PointLight*>(y.light)->lightPos;
+                    y.Le = y.light->power;
+                    pdf = pmf;
+                    break;
+                case LIGHT_TYPE::DIRECTIONAL:
+                    y.p = static_cast<const DirectionalLight*>(y.light)->direction;
+                    y.Le = y.light->power;
+                    pdf = pmf;
+                    break;
+                //環境光はBRDFサンプリングした間接光のレイが空に抜けた分で数える
+                case LIGHT_TYPE::ENVIRONMENT:
+                    pdf = pmf;
+                    break;
+            }
+            return y;
+        };
+
+
+        //spから光源上の点yに向かう方向と 遮蔽を考えない寄与
+        RGB contribution(const ShadingPoint& sp, const LightPoint& y, Vec3* wiOut = nullptr) const {
+            if(y.light == nullptr || iszero(y.Le)) return RGB(0.0f);
+            Vec3 wi;
+            float G = 1.0f;
+            if(y.light->type == LIGHT_TYPE::DIRECTIONAL) {
+                wi = y.p;
+            }
+            else {
+                const Vec3 d = y.p - sp.res.hitPos;
+                const float dist2 = d.length2();
+                if(dist2 == 0.0f) return RGB(0.0f);
+                wi = d/std::sqrt(dist2);
+                G = 1.0f/dist2;
+                if(y.light->type == LIGHT_TYPE::AREA)
+                    G *= std::max(dot(-wi, y.n), 0.0f);
+            }
+            if(wiOut) *wiOut = wi;
+            const Vec3 wi_local = worldToLocal(wi, sp.n, sp.s, sp.t);
+            if(wi_local.y <= 0.0f || G == 0.0f) return RGB(0.0f);
+            return sp.material->f(sp.wo_local, wi_local)*y.Le*(G*wi_local.y);
+        };
+        //リザーバーが比例してサンプリングしようとする関数
+        float targetFunction(const ShadingPoint& sp, const LightPoint& y) const {
+            return std::max(0.0f, luminance(contribution(sp, y)));
+        };
+
+
+        //spから光源上の点yが見えるか
+        bool visible(const Scene& scene, const ShadingPoint& sp, const LightPoint& y) const {
+            Vec3 wi;
+            contribution(sp, y, &wi);
+            Ray shadowRay(sp.res.hitPos, wi);
+            //点光源より向こうの物体には遮られない
+            if(y.light->type == LIGHT_TYPE::POINT)
+                shadowRay.tmax = (y.p - sp.res.hitPos).length();
+            Hit shadow_res;
+            const bool hit = scene.intersect(shadowRay, shadow_res);
+            if(y.light->type == LIGHT_TYPE::AREA)
+                return hit && shadow_res.hitPrimitive->areaLight.get() == y.light;
+            return !hit;
+        };
+
+
+        //衝突点sps[i]のリザーバーrs[i]をまとめてspのリザーバーにする
+        //各点はspでのターゲット関数で重みをつけ直す
+        //選んだ点のターゲット関数が0になる衝突点の候補数は数えない(そこからは選ばれ得ないので 数えると暗くなる)
+        Reservoir combine(const ShadingPoint& sp, const Reservoir* const* rs, const ShadingPoint* const* sps, int n) const {
+            Reservoir r;
+            float M = 0.0f;
+            for(int i = 0; i < n; i++) {
+                r.update(rs[i]->y, targetFunction(sp, rs[i]->y)*rs[i]->W*rs[i]->M, sampler->getNext());
+                M += rs[i]->M;
+            }
+            const float pHat = targetFunction(sp, r.y);
+            float Z = 0.0f;
+            for(int i = 0; i < n; i++) {
+                if(targetFunction(*sps[i], r.y) > 0.0f)
+                    Z += rs[i]->M;
+            }
+            r.M = Z;
+            r.finalize(pHat);
+            r.M = M;
+            return r;
+        };
+
+
+        //再利用してよいほど近い衝突点か 法線と距離が近いものに限る
+        static bool similar(const ShadingPoint& a, const ShadingPoint& b) {
+            if(!a.valid || !b.valid) return false;
+            if(dot(a.n, b.n) < 0.9f) return false;
+            return std::abs(a.res.t - b.res.t) <= 0.1f*a.res.t;
+        };
+};
+constexpr int ReSTIR::maxSpatialSamples;
+#endif
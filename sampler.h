@@ -1,8 +1,14 @@
 #ifndef SAMPLER_H
 #define SAMPLER_H
+#include <omp.h>
 #include <random>
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
 #include "vec2.h"
 #include "vec3.h"
+#include "util.h"
+#include "perthread.h"
 inline Vec2 sampleDisk(const Vec2& u) {
     const float r = std::sqrt(u.x);
     const float theta = 2 * M_PI * u.y;
@@ -33,6 +39,72 @@ inline Vec2 sampleTriangle(const Vec2& u) {
     float sqrt = std::sqrt(u.x);
     return Vec2(1 - sqrt, u.y*sqrt);
 }
+//2つの単位ベクトルのなす角 平行に近くてもacosより精度が落ちない
+inline float angleBetween(const Vec3& v1, const Vec3& v2) {
+    if(dot(v1, v2) < 0.0f) {
+        const Vec3 sum = v1 + v2;
+        return M_PI - 2.0f*std::asin(std::min(sum.length()/2.0f, 1.0f));
+    }
+    const Vec3 diff = v2 - v1;
+    return 2.0f*std::asin(std::min(diff.length()/2.0f, 1.0f));
+}
+//refから見た三角形p1p2p3の立体角(Van Oosterom and Strackee)
+inline float sphericalTriangleArea(const Vec3& ref, const Vec3& p1, const Vec3& p2, const Vec3& p3) {
+    const Vec3 a = normalize(p1 - ref);
+    const Vec3 b = normalize(p2 - ref);
+    const Vec3 c = normalize(p3 - ref);
+    return std::abs(2.0f*std::atan2(std::abs(dot(a, cross(b, c))), 1.0f + dot(a, b) + dot(b, c) + dot(c, a)));
+}
+//refから見た三角形p1p2p3の立体角の中で一様に方向を選ぶ(Arvo 1995)
+//pdfは立体角測度 失敗したらpdfを0にする
+inline Vec3 sampleSphericalTriangle(const Vec3& ref, const Vec3& p1, const Vec3& p2, const Vec3& p3, const Vec2& u, float& pdf) {
+    pdf = 0.0f;
+    const Vec3 a = normalize(p1 - ref);
+    const Vec3 b = normalize(p2 - ref);
+    const Vec3 c = normalize(p3 - ref);
+    Vec3 n_ab = cross(a, b);
+    Vec3 n_bc = cross(b, c);
+    Vec3 n_ca = cross(c, a);
+    if(n_ab.length2() == 0.0f || n_bc.length2() == 0.0f || n_ca.length2() == 0.0f) return Vec3(0.0f);
+    n_ab = normalize(n_ab);
+    n_bc = normalize(n_bc);
+    n_ca = normalize(n_ca);
+
+    //球面三角形の内角 面積は内角の和-π
+    const float alpha = angleBetween(n_ab, -n_ca);
+    const float beta = angleBetween(n_bc, -n_ab);
+    const float gamma = angleBetween(n_ca, -n_bc);
+    const float area = alpha + beta + gamma - M_PI;
+    if(area <= 0.0f) return Vec3(0.0f);
+
+    //面積がu.x倍になるようにa, bと弧ac上の点c'で部分三角形を作る
+    const float Ap_pi = M_PI + u.x*area;
+    const float cosAlpha = std::cos(alpha);
+    const float sinAlpha = std::sin(alpha);
+    const float sinPhi = std::sin(Ap_pi)*cosAlpha - std::cos(Ap_pi)*sinAlpha;
+    const float cosPhi = std::cos(Ap_pi)*cosAlpha + std::sin(Ap_pi)*sinAlpha;
+    const float k1 = cosPhi + cosAlpha;
+    const float k2 = sinPhi - sinAlpha*dot(a, b);
+    const float cosBp = clamp((k2 + (k2*cosPhi - k1*sinPhi)*cosAlpha)/((k2*sinPhi + k1*cosPhi)*sinAlpha), -1.0f, 1.0f);
+    const float sinBp = std::sqrt(std::max(0.0f, 1.0f - cosBp*cosBp));
+    const Vec3 cp = cosBp*a + sinBp*normalize(c - dot(c, a)*a);
+
+    //弧bc'上でu.yに応じて方向を選ぶ
+    const float cosTheta = 1.0f - u.y*(1.0f - dot(cp, b));
+    const float sinTheta = std::sqrt(std::max(0.0f, 1.0f - cosTheta*cosTheta));
+    const Vec3 w = normalize(cosTheta*b + sinTheta*normalize(cp - dot(cp, b)*b));
+    if(isnan(w)) return Vec3(0.0f);
+    pdf = 1.0f/area;
+    return w;
+}
+
+
+//SplitMix64の出力関数 64bitの値をよく混ぜる
+inline uint64_t mixBits(uint64_t x) {
+    x = (x ^ (x >> 30))*0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27))*0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
 
 
 class Sampler {
@@ -42,6 +114,21 @@ class Sampler {
 
         virtual float getNext() = 0;
         virtual Vec2 getNext2D() = 0;
+
+        //ピクセルpixelのsampleIndex番目のサンプルを始める dimension番目の乱数から使う
+        //乱数をこの組から決めるSamplerだけが使う
+        virtual void startPixelSample(uint64_t pixel, uint64_t sampleIndex, uint32_t dimension = 0) {};
+        //以降の乱数をdimension番目の次元から使う
+        //反射ごとに同じ次元を使うためのもので すでにdimensionを超えていれば同じ次元を使わないようにそのまま続ける
+        virtual void startDimension(uint32_t dimension) {};
+        //次に使う次元 startPixelSampleに渡せば同じサンプルの続きから使える
+        virtual uint32_t currentDimension() const {
+            return 0;
+        };
+
+        //チェックポイント用に内部状態を保存 復元する
+        virtual void saveState(std::ostream& os) const {};
+        virtual void loadState(std::istream& is) {};
 };
 
 
@@ -75,5 +162,175 @@ class UniformSampler : public Sampler {
         Vec2 getNext2D() {
             return Vec2(getNext(), getNext());
         };
+
+        void saveState(std::ostream& os) const {
+            os << mt << " " << minstd << " " << rnd;
+        };
+        void loadState(std::istream& is) {
+            is >> mt >> minstd >> rnd;
+        };
+};
+
+
+//カウンターベースの乱数
+//(シード, ピクセル, サンプル番号, 次元)をハッシュして乱数を作るので スレッドが持つ状態は現在のサンプルと次元だけ
+//どのスレッドがどのピクセルを計算しても同じ乱数になり スレッド数によらず同じ画像が得られる
+class CounterSampler : public Sampler {
+    public:
+        uint64_t seed;
+
+        CounterSampler(uint64_t _seed = 0) : seed(_seed) {
+            //startPixelSampleを呼ばずに使うスレッドのためにスレッドごとに異なる列にしておく
+            for(int t = 0; t < states.size(); t++) {
+                states[t].key = mixBits(seed + mixBits(t + 1));
+                states[t].dimension = 0;
+            }
+        };
+
+        void startPixelSample(uint64_t pixel, uint64_t sampleIndex, uint32_t dimension = 0) {
+            State& state = states.get();
+            state.key = mixBits(mixBits(seed ^ pixel*0x9e3779b97f4a7c15ull) + sampleIndex);
+            state.dimension = dimension;
+        };
+        void startDimension(uint32_t dimension) {
+            State& state = states.get();
+            state.dimension = std::max(state.dimension, dimension);
+        };
+        uint32_t currentDimension() const {
+            return states.get().dimension;
+        };
+
+        float getNext() {
+            State& state = states.get();
+            const uint64_t h = mixBits(state.key + (state.dimension++)*0x9e3779b97f4a7c15ull);
+            //上位24bitで[0, 1)の一様乱数にする
+            return (h >> 40)*(1.0f/16777216.0f);
+        };
+        Vec2 getNext2D() {
+            const float x = getNext();
+            const float y = getNext();
+            return Vec2(x, y);
+        };
+
+        //乱数はサンプル番号から決まるのでシードだけ保存すればよい
+        void saveState(std::ostream& os) const {
+            os << seed;
+        };
+        void loadState(std::istream& is) {
+            is >> seed;
+        };
+
+
+    private:
+        //スレッドごとの状態
+        struct State {
+            uint64_t key;
+            uint32_t dimension;
+        };
+        PerThread<State> states;
+};
+
+
+//Owen scramblingをかけたSobol列(Burley 2020, Practical Hash-based Owen Scrambling)
+//連続する2次元ずつを2次元のSobol列の点とし 次元の組ごとにサンプル番号の順序と値を別々にスクランブルする
+//どの2次元の射影もサンプル数が2の冪のときに層別されるので 一様乱数より少ないサンプル数で収束する
+//getNextを2回呼んだ場合も2次元の点になるように 2次元の組の前後の成分を順に返す
+class SobolSampler : public Sampler {
+    public:
+        uint64_t seed;
+
+        SobolSampler(uint64_t _seed = 0) : seed(_seed) {
+            for(int t = 0; t < states.size(); t++) {
+                states[t].key = mixBits(seed + mixBits(t + 1));
+                states[t].index = 0;
+                states[t].dimension = 0;
+            }
+        };
+
+        void startPixelSample(uint64_t pixel, uint64_t sampleIndex, uint32_t dimension = 0) {
+            State& state = states.get();
+            //ピクセルごとに異なるスクランブルにする
+            state.key = mixBits(seed ^ pixel*0x9e3779b97f4a7c15ull);
+            state.index = sampleIndex;
+            state.dimension = dimension;
+        };
+        void startDimension(uint32_t dimension) {
+            State& state = states.get();
+            state.dimension = std::max(state.dimension, dimension);
+        };
+        uint32_t currentDimension() const {
+            return states.get().dimension;
+        };
+
+        float getNext() {
+            State& state = states.get();
+            const float x = component(state, state.dimension >> 1, state.dimension & 1);
+            state.dimension++;
+            return x;
+        };
+        Vec2 getNext2D() {
+            State& state = states.get();
+            //組の途中からは始めない
+            state.dimension = (state.dimension + 1) & ~1u;
+            const uint32_t pair = state.dimension >> 1;
+            state.dimension += 2;
+            return Vec2(component(state, pair, 0), component(state, pair, 1));
+        };
+
+        //スクランブルはシードから決まるのでシードだけ保存すればよい
+        void saveState(std::ostream& os) const {
+            os << seed;
+        };
+        void loadState(std::istream& is) {
+            is >> seed;
+        };
+
+
+    private:
+        //スレッドごとの状態
+        struct State {
+            uint64_t key;
+            uint64_t index;
+            uint32_t dimension;
+        };
+        PerThread<State> states;
+
+
+        //次元の組pairのc番目の成分
+        static float component(const State& state, uint32_t pair, int c) {
+            const uint32_t pairSeed = mixBits(state.key + pair);
+            //サンプル番号を並べ替えて 組ごとの相関をなくす
+            const uint32_t i = nestedUniformScramble(state.index, pairSeed);
+            const uint32_t x = c == 0 ? reverseBits(i) : sobol1(i);
+            const uint32_t scrambled = nestedUniformScramble(x, mixBits(pairSeed + c + 1));
+            return (scrambled >> 8)*(1.0f/16777216.0f);
+        };
+
+        //Sobol列の2次元目 1次元目はビットを反転したもの(van der Corput列)
+        static uint32_t sobol1(uint32_t index) {
+            uint32_t result = 0;
+            for(uint32_t v = 1u << 31; index != 0; index >>= 1, v ^= v >> 1) {
+                if(index & 1) result ^= v;
+            }
+            return result;
+        };
+        static uint32_t reverseBits(uint32_t x) {
+            x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+            x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+            x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+            x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+            return (x >> 16) | (x << 16);
+        };
+        //上位ビットから順に 上位ビットの値ごとに独立に反転するかを決める(Owen scrambling)
+        //下位ビットが上位ビットに影響しないハッシュ(Laine-Karras)をビットを反転して使う
+        static uint32_t nestedUniformScramble(uint32_t x, uint32_t seed) {
+            x = reverseBits(x);
+            x ^= x*0x3d20adeau;
+            x += seed;
+            x *= (seed >> 16) | 1;
+            x ^= x*0x05526c56u;
+            x ^= x*0x53a22864u;
+            return reverseBits(x);
+        };
 };
 #endif
@@ -1,25 +1,72 @@
 #ifndef SCENE_H
-#define SCEME_H
+#define SCENE_H
+#include <omp.h>
 #include <vector>
 #include <memory>
+#include <cstdint>
+#include <algorithm>
 #include "primitive.h"
 #include "accel.h"
 #include "light.h"
 #include "sky.h"
+#include "lightsampler.h"
+#include "perthread.h"
 class Scene {
     public:
         std::vector<std::shared_ptr<Primitive>> prims;
         std::vector<std::shared_ptr<Light>> lights;
         std::shared_ptr<Sky> sky;
         std::shared_ptr<Accel<Primitive>> accel;
+        //シーン中のマテリアル Material::idはこの配列の添字
+        //同じMATERIAL_TYPEのマテリアルが連続するように並べる
+        std::vector<Material*> materials;
+        //光源サンプリングで光源を選ぶ方法 nullptrなら全光源をサンプリングする
+        std::shared_ptr<LightSampler> lightSampler;
+        //光源として扱われている環境光 なければnullptr
+        //ある場合は光源サンプリングした頂点から抜けたレイに空の寄与を加えない
+        const Light* envLight = nullptr;
 
         Scene() {};
         Scene(const std::vector<std::shared_ptr<Primitive>>& _prims, const std::vector<std::shared_ptr<Light>>& _lights, std::shared_ptr<Sky> _sky) : prims(_prims), lights(_lights), sky(_sky) {
             accel = std::shared_ptr<Accel<Primitive>>(new BVH<Primitive>(prims, 1, BVH_PARTITION_TYPE::SAH));
+            for(const auto& light : lights) {
+                if(light->type == LIGHT_TYPE::ENVIRONMENT)
+                    envLight = light.get();
+            }
+
+            for(size_t i = 0; i < prims.size(); i++)
+                prims[i]->id = i;
+            for(size_t i = 0; i < lights.size(); i++)
+                lights[i]->id = i;
+
+            for(const auto& prim : prims) {
+                if(prim->material && std::find(materials.begin(), materials.end(), prim->material.get()) == materials.end())
+                    materials.push_back(prim->material.get());
+            }
+            std::stable_sort(materials.begin(), materials.end(), [](const Material* a, const Material* b) {
+                    return a->type < b->type;
+                    });
+            for(size_t i = 0; i < materials.size(); i++)
+                materials[i]->id = i;
         };
 
         bool intersect(const Ray& ray, Hit& res) const {
+            rayCounters.get()++;
             return accel->intersect(ray, res);
         };
+
+
+        //これまでにintersectしたレイの数
+        uint64_t rayCount() const {
+            uint64_t total = 0;
+            for(int i = 0; i < rayCounters.size(); i++)
+                total += rayCounters[i];
+            return total;
+        };
+
+
+    private:
+        //レイの数はスレッドごとに別のキャッシュラインで数える
+        mutable PerThread<uint64_t> rayCounters;
 };
 #endif
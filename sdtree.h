@@ -0,0 +1,331 @@
+#ifndef SDTREE_H
+#define SDTREE_H
+#include <cmath>
+#include <atomic>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include "vec2.h"
+#include "vec3.h"
+#include "ray.h"
+#include "aabb.h"
+
+
+//複数のスレッドから加算されるfloat
+//コピーは学習の合間にしか行わないので値だけを写す
+struct AtomicFloat {
+    std::atomic<float> value;
+
+    AtomicFloat(float v = 0.0f) : value(v) {};
+    AtomicFloat(const AtomicFloat& a) : value(a.value.load(std::memory_order_relaxed)) {};
+    AtomicFloat& operator=(const AtomicFloat& a) {
+        value.store(a.value.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        return *this;
+    };
+    AtomicFloat& operator=(float v) {
+        value.store(v, std::memory_order_relaxed);
+        return *this;
+    };
+    operator float() const {
+        return value.load(std::memory_order_relaxed);
+    };
+
+    void add(float v) {
+        float current = value.load(std::memory_order_relaxed);
+        while(!value.compare_exchange_weak(current, current + v, std::memory_order_relaxed));
+    };
+};
+
+
+//方向と[0, 1)^2の対応 cos(theta)とphiについて一様なので面積比が立体角比に等しい
+inline Vec2 dirToCanonical(const Vec3& d) {
+    const float cosTheta = std::min(std::max(d.z, -1.0f), 1.0f);
+    float phi = std::atan2(d.y, d.x);
+    if(phi < 0.0f) phi += 2.0f*M_PI;
+    return Vec2((cosTheta + 1.0f)/2.0f, std::min(phi/(2.0f*(float)M_PI), 0.99999994f));
+}
+inline Vec3 canonicalToDir(const Vec2& p) {
+    const float cosTheta = 2.0f*p.x - 1.0f;
+    const float sinTheta = std::sqrt(std::max(0.0f, 1.0f - cosTheta*cosTheta));
+    const float phi = 2.0f*M_PI*p.y;
+    return Vec3(sinTheta*std::cos(phi), sinTheta*std::sin(phi), cosTheta);
+}
+
+
+//方向についての4分木
+//各ノードは4つの子の領域に届いた放射輝度の和を持ち 和に比例して方向をサンプリングする
+class DTree {
+    public:
+        struct Node {
+            AtomicFloat sum[4];
+            //子ノードの添字 0なら葉
+            int children[4] = {0, 0, 0, 0};
+
+            bool isLeaf(int c) const {
+                return children[c] == 0;
+            };
+            float total() const {
+                return sum[0] + sum[1] + sum[2] + sum[3];
+            };
+        };
+
+        std::vector<Node> nodes;
+        //記録されたサンプル数
+        AtomicFloat statisticalWeight;
+
+
+        DTree() : nodes(1) {};
+
+
+        float total() const {
+            return nodes[0].total();
+        };
+
+
+        //pの属する子の番号を返し pを子の領域での座標に変換する
+        static int childIndex(Vec2& p) {
+            int c = 0;
+            if(p.x < 0.5f) p.x *= 2.0f;
+            else { p.x = 2.0f*p.x - 1.0f; c |= 1; }
+            if(p.y < 0.5f) p.y *= 2.0f;
+            else { p.y = 2.0f*p.y - 1.0f; c |= 2; }
+            return c;
+        };
+
+
+        //方向dから届いた放射輝度をpdfで割ったものを記録する
+        void record(const Vec3& d, float irradiance) {
+            statisticalWeight.add(1.0f);
+            if(!std::isfinite(irradiance) || irradiance <= 0.0f) return;
+            Vec2 p = dirToCanonical(d);
+            int i = 0;
+            while(true) {
+                const int c = childIndex(p);
+                nodes[i].sum[c].add(irradiance);
+                if(nodes[i].isLeaf(c)) break;
+                i = nodes[i].children[c];
+            }
+        };
+
+
+        //方向dがサンプリングされる確率密度(立体角測度)
+        float pdf(const Vec3& d) const {
+            if(total() <= 0.0f) return 0.0f;
+            Vec2 p = dirToCanonical(d);
+            float result = 1.0f/(4.0f*M_PI);
+            int i = 0;
+            while(true) {
+                const int c = childIndex(p);
+                const float t = nodes[i].total();
+                if(nodes[i].sum[c] <= 0.0f || t <= 0.0f) return 0.0f;
+                result *= 4.0f*nodes[i].sum[c]/t;
+                if(nodes[i].isLeaf(c)) break;
+                i = nodes[i].children[c];
+            }
+            return result;
+        };
+
+
+        //和に比例して方向をサンプリングする
+        Vec3 sample(Vec2 u) const {
+            Vec2 origin(0.0f);
+            float size = 1.0f;
+            int i = 0;
+            while(true) {
+                const Node& node = nodes[i];
+                const float t = node.total();
+                //左右を選んでから上下を選ぶ
+                const float left = node.sum[0] + node.sum[2];
+                int c = 0;
+                float pLeft = left/t;
+                if(u.x < pLeft) u.x /= pLeft;
+                else { u.x = (u.x - pLeft)/(1.0f - pLeft); c |= 1; }
+                const float column = (c & 1) ? t - left : left;
+                const float pBottom = node.sum[c]/column;
+                if(u.y < pBottom) u.y /= pBottom;
+                else { u.y = (u.y - pBottom)/(1.0f - pBottom); c |= 2; }
+                u.x = std::min(u.x, 0.99999994f);
+                u.y = std::min(u.y, 0.99999994f);
+
+                size /= 2.0f;
+                origin = origin + Vec2((c & 1) ? size : 0.0f, (c & 2) ? size : 0.0f);
+                if(node.isLeaf(c)) break;
+                i = node.children[c];
+            }
+            return canonicalToDir(origin + u*size);
+        };
+
+
+        //prevの放射輝度の分布から新しい木の構造を作る 値は0にする
+        //全体に対する割合がthresholdを超える領域を分割し それ以外は統合する
+        //ノード数がmaxNodesに達したらそれ以上分割しない
+        void refine(const DTree& prev, int maxDepth, float threshold, int maxNodes) {
+            nodes.assign(1, Node());
+            statisticalWeight = 0.0f;
+            const float t = prev.total();
+            if(t <= 0.0f) return;
+
+            struct Entry {
+                int node;
+                //prevの対応するノード 葉の内側まで分割した場合は-1
+                int prevNode;
+                //prevNodeが-1のときの親の葉の値
+                float prevSum;
+                int depth;
+            };
+            std::vector<Entry> stack;
+            stack.push_back({0, 0, t, 1});
+            while(!stack.empty()) {
+                const Entry e = stack.back();
+                stack.pop_back();
+                for(int c = 0; c < 4; c++) {
+                    //prevの葉は内部で一様とみなして4等分する
+                    const float sum = e.prevNode >= 0 ? (float)prev.nodes[e.prevNode].sum[c] : e.prevSum/4.0f;
+                    if(sum/t <= threshold || e.depth >= maxDepth || (int)nodes.size() >= maxNodes) continue;
+                    const int child = nodes.size();
+                    nodes[e.node].children[c] = child;
+                    nodes.emplace_back();
+                    const int prevChild = (e.prevNode >= 0 && !prev.nodes[e.prevNode].isLeaf(c)) ? prev.nodes[e.prevNode].children[c] : -1;
+                    stack.push_back({child, prevChild, sum, e.depth + 1});
+                }
+            }
+        };
+};
+
+
+//空間の点ごとの方向分布
+//前の反復で学習したsamplingからサンプリングし 今の反復の結果をbuildingに記録する
+struct DTreeWrapper {
+    DTree building;
+    DTree sampling;
+
+    void record(const Vec3& d, float irradiance) {
+        building.record(d, irradiance);
+    };
+    bool valid() const {
+        return sampling.total() > 0.0f;
+    };
+    float pdf(const Vec3& d) const {
+        return sampling.pdf(d);
+    };
+    Vec3 sample(const Vec2& u) const {
+        return sampling.sample(u);
+    };
+};
+
+
+//空間を2分割していく木(SD-tree)
+//葉ごとに方向の4分木を持ち サンプルの多い葉を分割していく
+class SDTree {
+    public:
+        struct Node {
+            //分割する軸
+            int axis = 0;
+            //子ノードの添字 葉なら0
+            int children[2] = {0, 0};
+            //葉の方向分布の添字
+            int dtree = -1;
+
+            bool isLeaf() const {
+                return children[0] == 0;
+            };
+        };
+
+        std::vector<Node> nodes;
+        //アドレスが変わらないように1つずつ確保する
+        std::vector<std::unique_ptr<DTreeWrapper>> dtrees;
+        AABB bounds;
+
+        //空間方向の葉の数の上限 メモリは最大で葉の数*4分木のノード数*64バイト程度になる
+        int maxLeaves = 1 << 12;
+        //方向の4分木の深さとノード数の上限
+        int maxDTreeDepth = 20;
+        int maxDTreeNodes = 1 << 10;
+        //方向の4分木を分割する放射輝度の割合
+        float dtreeThreshold = 0.01f;
+        //空間の葉を分割するサンプル数の係数
+        float streeThreshold = 12000.0f;
+
+
+        SDTree() {
+            clear(AABB(Vec3(0.0f), Vec3(1.0f)));
+        };
+
+
+        //シーン全体を覆う立方体を根とする
+        void clear(const AABB& sceneBound) {
+            const Vec3 size = sceneBound.pMax - sceneBound.pMin;
+            const float maxSize = std::max(size.x, std::max(size.y, size.z));
+            bounds = AABB(sceneBound.pMin, sceneBound.pMin + Vec3(maxSize*1.001f + 1e-3f));
+            nodes.assign(1, Node());
+            dtrees.clear();
+            dtrees.emplace_back(new DTreeWrapper());
+            nodes[0].dtree = 0;
+        };
+
+
+        //点pを含む葉の方向分布
+        DTreeWrapper* lookup(const Vec3& p) const {
+            const Vec3 size = bounds.pMax - bounds.pMin;
+            float q[3] = {(p.x - bounds.pMin.x)/size.x, (p.y - bounds.pMin.y)/size.y, (p.z - bounds.pMin.z)/size.z};
+            int i = 0;
+            while(!nodes[i].isLeaf()) {
+                const int a = nodes[i].axis;
+                if(q[a] < 0.5f) {
+                    q[a] *= 2.0f;
+                    i = nodes[i].children[0];
+                }
+                else {
+                    q[a] = 2.0f*q[a] - 1.0f;
+                    i = nodes[i].children[1];
+                }
+            }
+            return dtrees[nodes[i].dtree].get();
+        };
+
+
+        //1反復の学習が終わるたびに呼ぶ iterationは終えた反復の番号
+        //記録した分布をサンプリングに使い 空間と方向の木を次の反復に向けて分割し直す
+        void update(int iteration) {
+            for(auto& d : dtrees)
+                d->sampling = d->building;
+
+            //空間の分割 反復ごとにサンプル数が倍になるのでしきい値をsqrt(2)倍していく
+            const float threshold = streeThreshold*std::sqrt(std::pow(2.0f, iteration));
+            std::vector<int> stack(1, 0);
+            while(!stack.empty()) {
+                const int i = stack.back();
+                stack.pop_back();
+                if(!nodes[i].isLeaf()) {
+                    stack.push_back(nodes[i].children[0]);
+                    stack.push_back(nodes[i].children[1]);
+                    continue;
+                }
+                if((int)dtrees.size() >= maxLeaves) continue;
+                DTreeWrapper& parent = *dtrees[nodes[i].dtree];
+                if(parent.building.statisticalWeight <= threshold) continue;
+
+                //子は親の分布を引き継ぎ サンプル数を半分ずつ持つ
+                const int axis = nodes[i].axis;
+                parent.building.statisticalWeight = parent.building.statisticalWeight/2.0f;
+                dtrees.emplace_back(new DTreeWrapper(parent));
+                for(int c = 0; c < 2; c++) {
+                    Node child;
+                    child.axis = (axis + 1)%3;
+                    child.dtree = c == 0 ? nodes[i].dtree : (int)dtrees.size() - 1;
+                    nodes[i].children[c] = nodes.size();
+                    nodes.push_back(child);
+                }
+                nodes[i].dtree = -1;
+                //子もまだサンプル数が多ければさらに分割する
+                stack.push_back(nodes[i].children[0]);
+                stack.push_back(nodes[i].children[1]);
+            }
+
+            //方向の分割
+            #pragma omp parallel for schedule(dynamic, 16)
+            for(int d = 0; d < (int)dtrees.size(); d++)
+                dtrees[d]->building.refine(dtrees[d]->sampling, maxDTreeDepth, dtreeThreshold, maxDTreeNodes);
+        };
+};
+#endif
@@ -1,6 +1,10 @@
 #ifndef SHAPE_H
 #define SHAPE_H
 #include <cmath>
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <immintrin.h>
 #include "vec3.h"
 #include "ray.h"
 #include "hit.h"
@@ -8,6 +12,8 @@
 #include "util.h"
 #include "accel.h"
 #include "sampler.h"
+#include "cone.h"
+#include "distribution.h"
 
 
 class Shape {
@@ -16,9 +22,67 @@ class Shape {
         virtual AABB worldBound() const = 0;
         virtual float surfaceArea() const = 0;
         virtual Vec3 sample(Sampler& sampler, Vec3& normal, float &pdf) const = 0;
+        //表面の法線の向きを囲むコーン 光源のBVHで使う
+        virtual DirectionCone normalBounds() const {
+            return DirectionCone::entireSphere();
+        };
+        //光源として点のサンプリングに使われる前に呼ばれる 必要な前計算を行う
+        virtual void initSampling() {};
+
+        //refから見た立体角測度で点をサンプリングする 光源の直接光に使う
+        //既定では面積に対してサンプリングして変換する 裏側を向いた点はpdfを0にする
+        virtual Vec3 sampleSolidAngle(const Vec3& ref, Sampler& sampler, Vec3& normal, float& pdf) const {
+            const Vec3 p = sample(sampler, normal, pdf);
+            pdf = areaToSolidAngle(pdf, ref, p, normal);
+            return p;
+        };
+        //refから方向wiに進んで表面上の点p(法線n)に当たったとき その方向がsampleSolidAngleで選ばれる確率密度
+        virtual float pdfSolidAngle(const Vec3& ref, const Vec3& wi, const Vec3& p, const Vec3& n) const {
+            return areaToSolidAngle(1.0f/surfaceArea(), ref, p, n);
+        };
+
+
+    protected:
+        //面積測度のpdfをrefから見た立体角測度に変換する
+        static float areaToSolidAngle(float pdf, const Vec3& ref, const Vec3& p, const Vec3& n) {
+            const Vec3 d = p - ref;
+            const float dist2 = d.length2();
+            if(dist2 == 0.0f) return 0.0f;
+            const float cos_term = -dot(d, n)/std::sqrt(dist2);
+            if(cos_term <= 0.0f) return 0.0f;
+            return pdf*dist2/cos_term;
+        };
 };
 
 
+//立体角でサンプリングする三角形の立体角の範囲
+//小さすぎると球面三角形の計算の精度が落ち 大きすぎると不安定になるので面積でサンプリングする
+constexpr float minSphericalSampleArea = 3e-4f;
+constexpr float maxSphericalSampleArea = 6.22f;
+
+
+//球の衝突点からUV座標と接ベクトルを計算する
+//SphereSetからも最終的な衝突点についてのみ呼ばれる
+inline void sphereHitInfo(const Vec3& center, float radius, const Ray& ray, float tHit, Hit& res) {
+    Vec3 hitPos = ray(tHit);
+    Vec3 localHitPos = hitPos - center;
+    if(localHitPos.x == 0 && localHitPos.z == 0) localHitPos.x -= 1e-5*radius;
+
+    float phi = std::atan2(localHitPos.z, localHitPos.x);
+    if(phi < 0) phi += 2*M_PI;
+    float theta = std::acos(clamp(localHitPos.y/radius, -1.0f, 1.0f));
+
+    res.t = tHit;
+    res.uv = Vec2(phi/(2*M_PI), 1.0f - theta/M_PI);
+    Vec3 dpdu = Vec3(-2*M_PI*localHitPos.z, 0, 2*M_PI*localHitPos.x);
+    Vec3 dpdv = M_PI * Vec3(localHitPos.y*std::cos(phi), -radius*std::sin(theta), localHitPos.y*std::sin(phi));
+    res.dpdu = normalize(dpdu);
+    res.dpdv = normalize(dpdv);
+    res.hitNormal = normalize(cross(dpdu, dpdv));
+    res.hitPos = hitPos;
+}
+
+
 class Sphere : public Shape {
     public:
         Vec3 center;
@@ -39,22 +103,7 @@ class Sphere : public Shape {
                 tHit = t1;
                 if(tHit > ray.tmax) return false;
             }
-            Vec3 hitPos = ray(tHit);
-            Vec3 localHitPos = hitPos - center;
-            if(localHitPos.x == 0 && localHitPos.z == 0) localHitPos.x -= 1e-5*radius;
-
-            float phi = std::atan2(localHitPos.z, localHitPos.x);
-            if(phi < 0) phi += 2*M_PI;
-            float theta = std::acos(clamp(localHitPos.y/radius, -1.0f, 1.0f));
-
-            res.t = tHit;
-            res.uv = Vec2(phi/(2*M_PI), 1.0f - theta/M_PI);
-            Vec3 dpdu = Vec3(-2*M_PI*localHitPos.z, 0, 2*M_PI*localHitPos.x);
-            Vec3 dpdv = M_PI * Vec3(localHitPos.y*std::cos(phi), -radius*std::sin(theta), localHitPos.y*std::sin(phi));
-            res.dpdu = normalize(dpdu);
-            res.dpdv = normalize(dpdv);
-            res.hitNormal = normalize(cross(dpdu, dpdv));
-            res.hitPos = hitPos;
+            sphereHitInfo(center, radius, ray, tHit, res);
             return true;
         };
         AABB worldBound() const {
@@ -66,14 +115,299 @@ class Sphere : public Shape {
         };
 
         Vec3 sample(Sampler& sampler, Vec3& normal, float &pdf) const {
+            //球面上で面積に対して一様にサンプリングする
             Vec2 u = sampler.getNext2D();
-            float theta = M_PI*u.x;
+            float cos_theta = 1.0f - 2.0f*u.x;
+            float sin_theta = std::sqrt(std::max(0.0f, 1.0f - cos_theta*cos_theta));
             float phi = 2*M_PI*u.y;
-            Vec3 samplingPos = center + radius*Vec3(std::cos(phi)*std::sin(theta), std::cos(theta), std::sin(phi)*std::sin(theta));
+            Vec3 samplingPos = center + radius*Vec3(std::cos(phi)*sin_theta, cos_theta, std::sin(phi)*sin_theta);
             normal = normalize(samplingPos - center);
             pdf = 1.0f/(surfaceArea());
             return samplingPos;
         };
+
+        //refから見える球冠だけを 球を囲むコーンの中で方向を一様に選んでサンプリングする
+        Vec3 sampleSolidAngle(const Vec3& ref, Sampler& sampler, Vec3& normal, float& pdf) const {
+            const Vec3 d = ref - center;
+            const float dist2 = d.length2();
+            //内側からは全体が見えるので面積でサンプリングする
+            if(dist2 <= radius*radius) return Shape::sampleSolidAngle(ref, sampler, normal, pdf);
+
+            const float sin2ThetaMax = radius*radius/dist2;
+            const float sinThetaMax = std::sqrt(sin2ThetaMax);
+            const float cosThetaMax = std::sqrt(std::max(0.0f, 1.0f - sin2ThetaMax));
+            const Vec2 u = sampler.getNext2D();
+            float cosTheta = (cosThetaMax - 1.0f)*u.x + 1.0f;
+            float sin2Theta = 1.0f - cosTheta*cosTheta;
+            //遠くの小さな球ではcosが1に近く桁落ちするのでsinで求める
+            if(sin2ThetaMax < smallSin2ThetaMax) {
+                sin2Theta = sin2ThetaMax*u.x;
+                cosTheta = std::sqrt(1.0f - sin2Theta);
+            }
+
+            //選んだ方向が球面と交わる点を 中心から見た角度alphaで求める
+            const float cosAlpha = sin2Theta/sinThetaMax + cosTheta*std::sqrt(std::max(0.0f, 1.0f - sin2Theta/sin2ThetaMax));
+            const float sinAlpha = std::sqrt(std::max(0.0f, 1.0f - cosAlpha*cosAlpha));
+            const float phi = 2*M_PI*u.y;
+            const Vec3 w = d/std::sqrt(dist2);
+            Vec3 s, t;
+            orthonormalBasis(w, s, t);
+            normal = localToWorld(Vec3(sinAlpha*std::cos(phi), cosAlpha, sinAlpha*std::sin(phi)), w, s, t);
+            pdf = 1.0f/(2*M_PI*oneMinusCosThetaMax(sin2ThetaMax, cosThetaMax));
+            return center + radius*normal;
+        };
+        float pdfSolidAngle(const Vec3& ref, const Vec3& wi, const Vec3& p, const Vec3& n) const {
+            const float dist2 = (ref - center).length2();
+            if(dist2 <= radius*radius) return Shape::pdfSolidAngle(ref, wi, p, n);
+            const float sin2ThetaMax = radius*radius/dist2;
+            const float cosThetaMax = std::sqrt(std::max(0.0f, 1.0f - sin2ThetaMax));
+            return 1.0f/(2*M_PI*oneMinusCosThetaMax(sin2ThetaMax, cosThetaMax));
+        };
+
+
+    private:
+        //これより小さいsin^2(thetaMax)では1-cos(thetaMax)をsin^2(thetaMax)/2で近似する
+        static constexpr float smallSin2ThetaMax = 0.00068523f;
+
+        static float oneMinusCosThetaMax(float sin2ThetaMax, float cosThetaMax) {
+            return sin2ThetaMax < smallSin2ThetaMax ? sin2ThetaMax/2.0f : 1.0f - cosThetaMax;
+        };
+};
+
+
+//大量の球をまとめて一つのShapeとして扱う
+//球の中心と半径は8個ずつのブロックにSoAで格納し、専用のBVHの葉を1ブロックとする
+//葉ではAVXで8個の球と同時に交差判定を行い、UVと接ベクトルは最も近い衝突点についてのみ計算する
+class SphereSet : public Shape {
+    public:
+        struct SphereBlock {
+            float cx[8];
+            float cy[8];
+            float cz[8];
+            float r[8];
+        };
+
+        struct SphereSetNode {
+            AABB bbox;
+            union {
+                int blockIndex;
+                int rightChildOffset;
+            };
+            uint8_t nSpheres;
+            uint8_t splitAxis;
+        };
+
+        std::vector<SphereBlock> blocks;
+        std::vector<SphereSetNode> nodes;
+        //球を面積に比例して選ぶための累積分布
+        std::vector<float> areaCDF;
+        float totalArea;
+        int nSpheres;
+
+
+        SphereSet(const std::vector<Vec3>& centers, const std::vector<float>& radii) : nSpheres(centers.size()) {
+            if(centers.size() == 0) {
+                std::cerr << "spheres is empty!" << std::endl;
+                std::exit(1);
+            }
+            std::vector<int> indices(centers.size());
+            for(size_t i = 0; i < indices.size(); i++)
+                indices[i] = i;
+            nodes.reserve(2*(centers.size()/8 + 1));
+            blocks.reserve(centers.size()/4 + 1);
+            build(0, indices.size(), indices, centers, radii);
+
+            totalArea = 0.0f;
+            areaCDF.reserve(8*blocks.size());
+            for(const auto& block : blocks) {
+                for(int k = 0; k < 8; k++) {
+                    if(!std::isnan(block.cx[k]))
+                        totalArea += 4*M_PI*block.r[k]*block.r[k];
+                    areaCDF.push_back(totalArea);
+                }
+            }
+            std::cout << "SphereSet Construction Finished!" << std::endl;
+            std::cout << "Spheres:" << nSpheres << " Blocks:" << blocks.size() << " Nodes:" << nodes.size() << std::endl;
+        };
+
+
+        bool intersect(const Ray& ray, Hit& res) const {
+            Vec3 invDir = 1.0f/(ray.direction);
+            if(std::abs(invDir.x) > Ray::tfar) invDir.x += sign(invDir.x)*Ray::tfar;
+            if(std::abs(invDir.y) > Ray::tfar) invDir.y += sign(invDir.y)*Ray::tfar;
+            if(std::abs(invDir.z) > Ray::tfar) invDir.z += sign(invDir.z)*Ray::tfar;
+            const int dirIsNeg[3] = {ray.direction.x < 0, ray.direction.y < 0, ray.direction.z < 0};
+
+            int hitBlock = -1;
+            int hitLane = -1;
+            float tHit = ray.tmax;
+            int toVisitOffset = 0, currentNodeIndex = 0;
+            int nodesToVisit[64];
+            while(true) {
+                const SphereSetNode& node = nodes[currentNodeIndex];
+                if(node.bbox.intersect(ray, invDir, dirIsNeg)) {
+                    if(node.nSpheres > 0) {
+                        int lane;
+                        float t;
+                        if(intersectBlock(blocks[node.blockIndex], ray, t, lane)) {
+                            //rayの衝突距離を更新する
+                            ray.tmax = tHit = t;
+                            hitBlock = node.blockIndex;
+                            hitLane = lane;
+                        }
+                        if(toVisitOffset == 0) break;
+                        currentNodeIndex = nodesToVisit[--toVisitOffset];
+                    }
+                    else {
+                        if(dirIsNeg[node.splitAxis]) {
+                            nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
+                            currentNodeIndex = node.rightChildOffset;
+                        }
+                        else {
+                            nodesToVisit[toVisitOffset++] = node.rightChildOffset;
+                            currentNodeIndex++;
+                        }
+                    }
+                }
+                else {
+                    if(toVisitOffset == 0) break;
+                    currentNodeIndex = nodesToVisit[--toVisitOffset];
+                }
+            }
+            if(hitBlock < 0) return false;
+
+            const SphereBlock& block = blocks[hitBlock];
+            sphereHitInfo(Vec3(block.cx[hitLane], block.cy[hitLane], block.cz[hitLane]), block.r[hitLane], ray, tHit, res);
+            return true;
+        };
+
+        AABB worldBound() const {
+            return nodes[0].bbox;
+        };
+
+        float surfaceArea() const {
+            return totalArea;
+        };
+
+        Vec3 sample(Sampler& sampler, Vec3& normal, float &pdf) const {
+            //面積に比例して球を選ぶ
+            int index = std::upper_bound(areaCDF.begin(), areaCDF.end(), sampler.getNext()*totalArea) - areaCDF.begin();
+            if(index >= (int)areaCDF.size()) index = areaCDF.size() - 1;
+            const SphereBlock& block = blocks[index/8];
+            Sphere sphere(Vec3(block.cx[index%8], block.cy[index%8], block.cz[index%8]), block.r[index%8]);
+            Vec3 samplePos = sphere.sample(sampler, normal, pdf);
+            pdf = 1.0f/totalArea;
+            return samplePos;
+        };
+
+
+    private:
+        //8個の球との交差判定 最も近い衝突距離とそのレーンを返す
+        //パディングのレーンは中心がNaNなので比較が全て偽になる
+        static bool intersectBlock(const SphereBlock& block, const Ray& ray, float& tHit, int& hitLane) {
+#ifdef __AVX__
+            const __m256 ocx = _mm256_sub_ps(_mm256_set1_ps(ray.origin.x), _mm256_loadu_ps(block.cx));
+            const __m256 ocy = _mm256_sub_ps(_mm256_set1_ps(ray.origin.y), _mm256_loadu_ps(block.cy));
+            const __m256 ocz = _mm256_sub_ps(_mm256_set1_ps(ray.origin.z), _mm256_loadu_ps(block.cz));
+            const __m256 r = _mm256_loadu_ps(block.r);
+
+            const __m256 b = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(ray.direction.x), ocx), _mm256_mul_ps(_mm256_set1_ps(ray.direction.y), ocy)), _mm256_mul_ps(_mm256_set1_ps(ray.direction.z), ocz));
+            const __m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ocx), _mm256_mul_ps(ocy, ocy)), _mm256_mul_ps(ocz, ocz)), _mm256_mul_ps(r, r));
+            const __m256 D = _mm256_sub_ps(_mm256_mul_ps(b, b), c);
+            const __m256 hitSphere = _mm256_cmp_ps(D, _mm256_setzero_ps(), _CMP_GE_OQ);
+            if(_mm256_movemask_ps(hitSphere) == 0) return false;
+            const __m256 sqrtD = _mm256_sqrt_ps(_mm256_max_ps(D, _mm256_setzero_ps()));
+            const __m256 t0 = _mm256_sub_ps(_mm256_sub_ps(_mm256_setzero_ps(), b), sqrtD);
+            const __m256 t1 = _mm256_add_ps(_mm256_sub_ps(_mm256_setzero_ps(), b), sqrtD);
+
+            //手前の交点がtminより手前なら奥の交点を使う
+            const __m256 tmin = _mm256_set1_ps(ray.tmin);
+            const __m256 t = _mm256_blendv_ps(t1, t0, _mm256_cmp_ps(t0, tmin, _CMP_GT_OQ));
+            const __m256 valid = _mm256_and_ps(hitSphere, _mm256_and_ps(_mm256_cmp_ps(t, tmin, _CMP_GT_OQ), _mm256_cmp_ps(t, _mm256_set1_ps(ray.tmax), _CMP_LE_OQ)));
+            if(_mm256_movemask_ps(valid) == 0) return false;
+
+            //水平方向の最小値を求め、それに一致するレーンを取り出す
+            const __m256 tv = _mm256_blendv_ps(_mm256_set1_ps(std::numeric_limits<float>::max()), t, valid);
+            __m256 tm = _mm256_min_ps(tv, _mm256_permute2f128_ps(tv, tv, 1));
+            tm = _mm256_min_ps(tm, _mm256_permute_ps(tm, _MM_SHUFFLE(1, 0, 3, 2)));
+            tm = _mm256_min_ps(tm, _mm256_permute_ps(tm, _MM_SHUFFLE(2, 3, 0, 1)));
+            hitLane = __builtin_ctz(_mm256_movemask_ps(_mm256_and_ps(_mm256_cmp_ps(tv, tm, _CMP_EQ_OQ), valid)));
+            tHit = _mm256_cvtss_f32(tm);
+            return true;
+#else
+            bool hit = false;
+            tHit = ray.tmax;
+            for(int k = 0; k < 8; k++) {
+                const Vec3 oc = ray.origin - Vec3(block.cx[k], block.cy[k], block.cz[k]);
+                const float b = dot(ray.direction, oc);
+                const float c = oc.length2() - block.r[k]*block.r[k];
+                const float D = b*b - c;
+                if(!(D >= 0)) continue;
+                const float t0 = -b - std::sqrt(D);
+                const float t1 = -b + std::sqrt(D);
+                const float t = t0 > ray.tmin ? t0 : t1;
+                if(t > ray.tmin && t <= tHit) {
+                    tHit = t;
+                    hitLane = k;
+                    hit = true;
+                }
+            }
+            return hit;
+#endif
+        };
+
+
+        //中心座標の最大の広がりを持つ軸の中央値で分割する
+        //葉は8個以下の球を持ち、1つのブロックに対応する
+        int build(int start, int end, std::vector<int>& indices, const std::vector<Vec3>& centers, const std::vector<float>& radii) {
+            const int nodeIndex = nodes.size();
+            nodes.push_back(SphereSetNode());
+
+            AABB bounds;
+            AABB centroidBounds;
+            for(int i = start; i < end; i++) {
+                const Vec3& c = centers[indices[i]];
+                const float r = radii[indices[i]];
+                bounds = mergeAABB(bounds, AABB(c - r, c + r));
+                centroidBounds = mergeAABB(centroidBounds, c);
+            }
+
+            if(end - start <= 8) {
+                SphereBlock block;
+                for(int k = 0; k < 8; k++) {
+                    if(start + k < end) {
+                        const Vec3& c = centers[indices[start + k]];
+                        block.cx[k] = c.x;
+                        block.cy[k] = c.y;
+                        block.cz[k] = c.z;
+                        block.r[k] = radii[indices[start + k]];
+                    }
+                    else {
+                        block.cx[k] = block.cy[k] = block.cz[k] = std::numeric_limits<float>::quiet_NaN();
+                        block.r[k] = 0.0f;
+                    }
+                }
+                nodes[nodeIndex].bbox = bounds;
+                nodes[nodeIndex].blockIndex = blocks.size();
+                nodes[nodeIndex].nSpheres = end - start;
+                blocks.push_back(block);
+                return nodeIndex;
+            }
+
+            const int axis = maximumExtent(centroidBounds);
+            const int mid = (start + end)/2;
+            std::nth_element(indices.begin() + start, indices.begin() + mid, indices.begin() + end, [&](int a, int b) {
+                    return centers[a][axis] < centers[b][axis];
+                    });
+
+            build(start, mid, indices, centers, radii);
+            const int right = build(mid, end, indices, centers, radii);
+            nodes[nodeIndex].bbox = bounds;
+            nodes[nodeIndex].rightChildOffset = right;
+            nodes[nodeIndex].nSpheres = 0;
+            nodes[nodeIndex].splitAxis = axis;
+            return nodeIndex;
+        };
 };
 
 
@@ -139,6 +473,11 @@ class Triangle : public Shape {
             return AABB(min(p1, min(p2, p3)) - 1e-3 , max(p1, max(p2, p3)) + 1e-3);
         };
 
+        DirectionCone normalBounds() const {
+            if(!vertex_normal) return DirectionCone(face_normal, 1.0f);
+            return unionCone(unionCone(DirectionCone(n1, 1.0f), DirectionCone(n2, 1.0f)), DirectionCone(n3, 1.0f));
+        };
+
         float surfaceArea() const {
             return 0.5f * std::abs(cross(p2 - p1, p3 - p1).length());
         };
@@ -150,19 +489,225 @@ class Triangle : public Shape {
                 normal = normalize((1.0f - u.x - u.y)*n1 + u.x*n2 + u.y*n3);
             else
                 normal = face_normal;
-            pdf = 1.0f;
+            pdf = 1.0f/surfaceArea();
             return samplePos;
         };
+
+        //refに表側を向けていれば 球面三角形の上で方向を一様に選んでサンプリングする
+        Vec3 sampleSolidAngle(const Vec3& ref, Sampler& sampler, Vec3& normal, float& pdf) const {
+            const float area = solidAngle(ref);
+            if(area < minSphericalSampleArea || area > maxSphericalSampleArea)
+                return Shape::sampleSolidAngle(ref, sampler, normal, pdf);
+            const Vec3 wi = sampleSphericalTriangle(ref, p1, p2, p3, sampler.getNext2D(), pdf);
+            Hit res;
+            //辺の上の方向では交差判定が外れることがあるので その場合は失敗とする
+            if(pdf == 0.0f || !intersect(Ray(ref, wi), res)) {
+                pdf = 0.0f;
+                return ref;
+            }
+            normal = res.hitNormal;
+            return res.hitPos;
+        };
+        float pdfSolidAngle(const Vec3& ref, const Vec3& wi, const Vec3& p, const Vec3& n) const {
+            const float area = solidAngle(ref);
+            if(area < minSphericalSampleArea || area > maxSphericalSampleArea)
+                return Shape::pdfSolidAngle(ref, wi, p, n);
+            return 1.0f/area;
+        };
+
+
+    private:
+        //refから見た立体角 裏側を向けている場合は0
+        float solidAngle(const Vec3& ref) const {
+            if(dot(cross(p2 - p1, p3 - p1), ref - p1) <= 0.0f) return 0.0f;
+            return sphericalTriangleArea(ref, p1, p2, p3);
+        };
+};
+
+
+//平面四角形
+//objの4頂点の面を三角形分割せずに保持し、BVHの葉と交差判定の数を減らす
+//シェーディングは対角線p1-p3で分割した2つの三角形と同じ値を返す
+class Quad : public Shape {
+    public:
+        Vec3 p1, p2, p3, p4; //頂点座標
+        Vec3 n1, n2, n3, n4; //頂点法線
+        Vec3 face_normal; //面法線
+        Vec3 plane_normal; //対角線の外積(正規化しない)
+        bool vertex_normal;
+
+        Quad(const Vec3& _p1, const Vec3& _p2, const Vec3& _p3, const Vec3& _p4) : p1(_p1), p2(_p2), p3(_p3), p4(_p4) {
+            plane_normal = cross(p3 - p1, p4 - p2);
+            face_normal = normalize(cross(p2 - p1, p3 - p1));
+            vertex_normal = false;
+        };
+        Quad(const Vec3& _p1, const Vec3& _p2, const Vec3& _p3, const Vec3& _p4, const Vec3& _n1, const Vec3& _n2, const Vec3& _n3, const Vec3& _n4) : p1(_p1), p2(_p2), p3(_p3), p4(_p4), n1(_n1), n2(_n2), n3(_n3), n4(_n4) {
+            plane_normal = cross(p3 - p1, p4 - p2);
+            face_normal = normalize(cross(p2 - p1, p3 - p1));
+            vertex_normal = true;
+        };
+
+
+        //4頂点が同一平面上にあり凸であるか
+        //そうでない面は2つの三角形として読み込む
+        static bool isPlanarConvex(const Vec3& p1, const Vec3& p2, const Vec3& p3, const Vec3& p4) {
+            const Vec3 n = cross(p3 - p1, p4 - p2);
+            const float nlen = n.length();
+            if(nlen < 1e-12) return false;
+            const Vec3 nn = n/nlen;
+            const float size = std::max((p3 - p1).length(), (p4 - p2).length());
+            if(std::abs(dot(p4 - p1, nn)) > 1e-4f*size || std::abs(dot(p2 - p1, nn)) > 1e-4f*size) return false;
+            const Vec3 p[4] = {p1, p2, p3, p4};
+            for(int i = 0; i < 4; i++) {
+                if(dot(cross(p[(i + 1)%4] - p[i], p[(i + 2)%4] - p[(i + 1)%4]), n) <= 0.0f)
+                    return false;
+            }
+            return true;
+        };
+
+
+        bool intersect(const Ray& ray, Hit& res) const {
+            const float eps = 1e-6;
+            const float a = dot(plane_normal, ray.direction);
+            if(a >= -eps*plane_normal.length() && a <= eps*plane_normal.length())
+                return false;
+
+            //4辺に対するレイの向きが全て同じ符号なら内側
+            const float e1 = edgeFunction(p1, p2, ray);
+            const float e2 = edgeFunction(p2, p3, ray);
+            const float e3 = edgeFunction(p3, p4, ray);
+            const float e4 = edgeFunction(p4, p1, ray);
+            if((e1 < 0.0f || e2 < 0.0f || e3 < 0.0f || e4 < 0.0f) && (e1 > 0.0f || e2 > 0.0f || e3 > 0.0f || e4 > 0.0f))
+                return false;
+
+            const float t = dot(plane_normal, p1 - ray.origin)/a;
+            if(t <= ray.tmin || t > ray.tmax)
+                return false;
+            const Vec3 p = ray(t);
+
+            //対角線p1-p3のどちら側かで三角形(p1, p2, p3)か(p1, p3, p4)を選び重心座標を求める
+            const bool first = dot(cross(p3 - p1, p - p1), plane_normal) <= 0.0f;
+            const Vec3& a1 = p1;
+            const Vec3& a2 = first ? p2 : p3;
+            const Vec3& a3 = first ? p3 : p4;
+            const Vec3 na = cross(a2 - a1, a3 - a1);
+            const float inv = 1.0f/na.length2();
+            const float u = dot(cross(p - a1, a3 - a1), na)*inv;
+            const float v = dot(cross(a2 - a1, p - a1), na)*inv;
+
+            res.t = t;
+            res.hitPos = p;
+            if(vertex_normal) {
+                if(first)
+                    res.hitNormal = normalize((1.0f - u - v)*n1 + u*n2 + v*n3);
+                else
+                    res.hitNormal = normalize((1.0f - u - v)*n1 + u*n3 + v*n4);
+            }
+            else {
+                res.hitNormal = face_normal;
+            }
+            res.uv = Vec2(u, v);
+            res.dpdu = normalize(a2 - a1);
+            res.dpdv = normalize(a3 - a1);
+
+            return true;
+        };
+
+        //辺abとレイの相対的な向き(Plücker座標の内積)
+        //隣接する面が同じ辺で同じ値を得るように頂点の順序を正規化することで、辺上の隙間をなくす
+        static float edgeFunction(const Vec3& a, const Vec3& b, const Ray& ray) {
+            if(a.x < b.x || (a.x == b.x && (a.y < b.y || (a.y == b.y && a.z < b.z))))
+                return dot(ray.direction, cross(a - ray.origin, b - ray.origin));
+            else
+                return -dot(ray.direction, cross(b - ray.origin, a - ray.origin));
+        };
+
+        AABB worldBound() const {
+            return AABB(min(min(p1, p2), min(p3, p4)) - 1e-3, max(max(p1, p2), max(p3, p4)) + 1e-3);
+        };
+
+        DirectionCone normalBounds() const {
+            if(!vertex_normal) return DirectionCone(face_normal, 1.0f);
+            return unionCone(unionCone(DirectionCone(n1, 1.0f), DirectionCone(n2, 1.0f)), unionCone(DirectionCone(n3, 1.0f), DirectionCone(n4, 1.0f)));
+        };
+
+        float surfaceArea() const {
+            return 0.5f * plane_normal.length();
+        };
+
+        Vec3 sample(Sampler& sampler, Vec3& normal, float &pdf) const {
+            //面積に比例して2つの三角形のどちらかを選ぶ
+            const float area1 = 0.5f * cross(p2 - p1, p3 - p1).length();
+            const bool first = sampler.getNext()*surfaceArea() < area1;
+            Vec2 u = sampleTriangle(sampler.getNext2D());
+            Vec3 samplePos;
+            if(first) {
+                samplePos = (1.0f - u.x - u.y)*p1 + u.x*p2 + u.y*p3;
+                if(vertex_normal)
+                    normal = normalize((1.0f - u.x - u.y)*n1 + u.x*n2 + u.y*n3);
+            }
+            else {
+                samplePos = (1.0f - u.x - u.y)*p1 + u.x*p3 + u.y*p4;
+                if(vertex_normal)
+                    normal = normalize((1.0f - u.x - u.y)*n1 + u.x*n3 + u.y*n4);
+            }
+            if(!vertex_normal)
+                normal = face_normal;
+            pdf = 1.0f/surfaceArea();
+            return samplePos;
+        };
+
+        //2つの三角形を立体角に比例して選び 球面三角形の上で方向を一様に選ぶ
+        //凸な平面四角形なので2つの球面三角形は重ならず 四角形全体の立体角で一様になる
+        Vec3 sampleSolidAngle(const Vec3& ref, Sampler& sampler, Vec3& normal, float& pdf) const {
+            float area1, area2;
+            if(!solidAngles(ref, area1, area2))
+                return Shape::sampleSolidAngle(ref, sampler, normal, pdf);
+            const bool first = sampler.getNext()*(area1 + area2) < area1;
+            const Vec3 wi = first ? sampleSphericalTriangle(ref, p1, p2, p3, sampler.getNext2D(), pdf) : sampleSphericalTriangle(ref, p1, p3, p4, sampler.getNext2D(), pdf);
+            Hit res;
+            if(pdf == 0.0f || !intersect(Ray(ref, wi), res)) {
+                pdf = 0.0f;
+                return ref;
+            }
+            normal = res.hitNormal;
+            pdf = 1.0f/(area1 + area2);
+            return res.hitPos;
+        };
+        float pdfSolidAngle(const Vec3& ref, const Vec3& wi, const Vec3& p, const Vec3& n) const {
+            float area1, area2;
+            if(!solidAngles(ref, area1, area2))
+                return Shape::pdfSolidAngle(ref, wi, p, n);
+            return 1.0f/(area1 + area2);
+        };
+
+
+    private:
+        //refから見た2つの三角形の立体角 表側を向けていて両方が立体角でサンプリングできる範囲ならtrue
+        bool solidAngles(const Vec3& ref, float& area1, float& area2) const {
+            if(dot(plane_normal, ref - p1) <= 0.0f) return false;
+            area1 = sphericalTriangleArea(ref, p1, p2, p3);
+            area2 = sphericalTriangleArea(ref, p1, p3, p4);
+            return area1 >= minSphericalSampleArea && area2 >= minSphericalSampleArea && area1 + area2 <= maxSphericalSampleArea;
+        };
 };
 
 
 class Polygon : public Shape {
     public:
-        std::vector<std::shared_ptr<Triangle>> triangles;
-        std::shared_ptr<Accel<Triangle>> accel;
+        //TriangleあるいはQuad
+        std::vector<std::shared_ptr<Shape>> faces;
+        std::shared_ptr<Accel<Shape>> accel;
+        float totalArea;
+        //面積に比例して面を選ぶためのテーブル 光源になったときに作る
+        std::unique_ptr<AliasTable> faceTable;
 
-        Polygon(const std::vector<std::shared_ptr<Triangle>>& _triangles) : triangles(_triangles) {
-            accel = std::shared_ptr<Accel<Triangle>>(new BVH<Triangle>(triangles, 4, BVH_PARTITION_TYPE::SAH));
+        Polygon(const std::vector<std::shared_ptr<Shape>>& _faces) : faces(_faces) {
+            accel = std::shared_ptr<Accel<Shape>>(new BVH<Shape>(faces, 4, BVH_PARTITION_TYPE::SAH));
+            totalArea = 0.0f;
+            for(const auto& face : faces) {
+                totalArea += face->surfaceArea();
+            }
         };
 
         bool intersect(const Ray& ray, Hit& res) const {
@@ -173,20 +718,71 @@ class Polygon : public Shape {
             return accel->worldBound();
         };
 
+        DirectionCone normalBounds() const {
+            DirectionCone cone;
+            for(const auto& face : faces) {
+                cone = unionCone(cone, face->normalBounds());
+            }
+            return cone;
+        };
+
         float surfaceArea() const {
-            float area = 0.0f;
-            for(const auto& triangle : triangles) {
-                area += triangle->surfaceArea();
+            return totalArea;
+        };
+
+        void initSampling() {
+            std::vector<float> areas(faces.size());
+            for(size_t i = 0; i < faces.size(); i++) {
+                areas[i] = faces[i]->surfaceArea();
             }
-            return area;
+            faceTable = std::unique_ptr<AliasTable>(new AliasTable(areas));
         };
 
         Vec3 sample(Sampler& sampler, Vec3& normal, float &pdf) const {
-            int tri_num = std::floor(triangles.size()*sampler.getNext());
-            if(tri_num == triangles.size()) tri_num--;
-            Vec3 samplePos = triangles[tri_num]->sample(sampler, normal, pdf);
-            pdf = 1.0f/this->surfaceArea();
+            //面積に比例して面を選び 面上で一様に点を選ぶので 全体で面積に対して一様になる
+            if(faceTable) {
+                float face_pmf;
+                const int face_num = faceTable->sample(sampler.getNext(), face_pmf);
+                Vec3 samplePos = faces[face_num]->sample(sampler, normal, pdf);
+                pdf = 1.0f/totalArea;
+                return samplePos;
+            }
+            //テーブルがなければ一様に面を選ぶ
+            int face_num = std::floor(faces.size()*sampler.getNext());
+            if(face_num == (int)faces.size()) face_num--;
+            Vec3 samplePos = faces[face_num]->sample(sampler, normal, pdf);
+            pdf /= faces.size();
+            return samplePos;
+        };
+
+        //面が少なければ 面積に比例して面を選び その面を立体角でサンプリングする
+        //同じ方向に複数の面が重なり得るので pdfはその方向が通る全ての面での確率密度の和とする
+        Vec3 sampleSolidAngle(const Vec3& ref, Sampler& sampler, Vec3& normal, float& pdf) const {
+            if(!faceTable || faces.size() > maxSolidAngleFaces)
+                return Shape::sampleSolidAngle(ref, sampler, normal, pdf);
+            float face_pmf;
+            const int face_num = faceTable->sample(sampler.getNext(), face_pmf);
+            const Vec3 samplePos = faces[face_num]->sampleSolidAngle(ref, sampler, normal, pdf);
+            if(pdf == 0.0f) return samplePos;
+            pdf = pdfSolidAngle(ref, normalize(samplePos - ref), samplePos, normal);
             return samplePos;
         };
+        float pdfSolidAngle(const Vec3& ref, const Vec3& wi, const Vec3& p, const Vec3& n) const {
+            if(!faceTable || faces.size() > maxSolidAngleFaces)
+                return Shape::pdfSolidAngle(ref, wi, p, n);
+            float pdf = 0.0f;
+            const Ray ray(ref, wi);
+            for(const auto& face : faces) {
+                Hit res;
+                if(face->intersect(ray, res))
+                    pdf += face->surfaceArea()/totalArea*face->pdfSolidAngle(ref, wi, res.hitPos, res.hitNormal);
+            }
+            return pdf;
+        };
+
+
+    private:
+        //立体角でサンプリングする面の数の上限 pdfの計算で全ての面と交差判定をするので面の多い光源では使わない
+        static constexpr size_t maxSolidAngleFaces = 16;
 };
 #endif
@@ -1,14 +1,18 @@
 #ifndef SKY_H
 #define SKY_H
 #include <string>
+#include <cmath>
+#include <algorithm>
 
 #ifndef STB_IMAGE_IMPLEMENTATION
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 #endif
 
+#include "vec2.h"
 #include "vec3.h"
 #include "ray.h"
+#include "util.h"
 class Sky {
     public:
         Sky() {};
@@ -65,22 +69,35 @@ class IBL : public Sky {
             stbi_image_free(HDRI);
         };
 
-        RGB getSky(const Ray& ray) const {
-            float phi = std::atan2(ray.direction.z, ray.direction.x);
+        //方向を画像上のUV座標に変換する
+        Vec2 directionToUV(const Vec3& dir) const {
+            float phi = std::atan2(dir.z, dir.x);
             if(phi < 0) phi += 2*M_PI;
-            phi += offsetX;
-            if(phi > 2*M_PI) phi -= 2*M_PI;
-            float theta = std::acos(clamp(ray.direction.y, -1.0f, 1.0f));
-            theta += offsetY;
-            if(theta > M_PI) theta -= M_PI;
-
-            float u = phi/(2.0*M_PI);
-            float v = theta/M_PI;
-
-            int w = (int)(u * width);
-            int h = (int)(v * height);
+            phi = std::fmod(phi + offsetX, 2*M_PI);
+            if(phi < 0) phi += 2*M_PI;
+            float theta = std::acos(clamp(dir.y, -1.0f, 1.0f));
+            theta = std::fmod(theta + offsetY, M_PI);
+            if(theta < 0) theta += M_PI;
+            return Vec2(phi/(2.0*M_PI), theta/M_PI);
+        };
+        //UV座標を方向に変換する directionToUVの逆
+        Vec3 uvToDirection(const Vec2& uv) const {
+            float phi = std::fmod(2*M_PI*uv.x - offsetX, 2*M_PI);
+            if(phi < 0) phi += 2*M_PI;
+            float theta = std::fmod(M_PI*uv.y - offsetY, M_PI);
+            if(theta < 0) theta += M_PI;
+            return Vec3(std::cos(phi)*std::sin(theta), std::cos(theta), std::sin(phi)*std::sin(theta));
+        };
+        RGB texel(int w, int h) const {
             int adr = 3*w + 3*width*h;
             return RGB(HDRI[adr], HDRI[adr+1], HDRI[adr+2]);
         };
+
+        RGB getSky(const Ray& ray) const {
+            const Vec2 uv = directionToUV(ray.direction);
+            int w = std::min((int)(uv.x * width), width - 1);
+            int h = std::min((int)(uv.y * height), height - 1);
+            return texel(w, h);
+        };
 };
 #endif
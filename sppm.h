@@ -0,0 +1,422 @@
+#ifndef SPPM_H
+#define SPPM_H
+#include <omp.h>
+#include <cmath>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include "integrator.h"
+
+
+//確率的プログレッシブフォトンマッピング(SPPM)
+//反復ごとに
+//  1. カメラからスペキュラーな反射を辿って最初の非スペキュラーな点(可視点)を求め 直接光を光源サンプリングで計算する
+//  2. 可視点をハッシュグリッドに登録する
+//  3. 光源からフォトンを追跡し 2回目以降の衝突点で半径内の可視点にフォトンの寄与を加える
+//  4. ピクセルごとに集めたフォトンの数に応じて半径を縮める
+//フォトン自体は保存しないので 1反復のメモリはピクセル数に比例する量で抑えられる
+//光源から光を放てない空と平行光源は 直接光とカメラから直接見えた分だけを扱う
+class SPPM : public Integrator {
+    public:
+        //反復回数
+        int iterations;
+        int maxDepth;
+        //1反復あたりのフォトン数
+        int photonsPerIteration;
+        //初期の収集半径 0以下ならシーンの大きさから決める
+        float initialRadius;
+        //半径の縮小率 大きいほど半径がゆっくり縮む
+        float alpha = 2.0f/3.0f;
+
+        SPPM(std::shared_ptr<Camera> _cam, std::shared_ptr<Sampler> _sampler, int _iterations, int _maxDepth, int _photonsPerIteration, float _initialRadius) : Integrator(_cam, _sampler), iterations(_iterations), maxDepth(_maxDepth), photonsPerIteration(_photonsPerIteration), initialRadius(_initialRadius) {};
+
+
+        void render(const Scene& scene) const {
+            Timer timer;
+            const int nEyes = cam->two_eyes ? 2 : 1;
+            for(int eye = 0; eye < nEyes; eye++) {
+                const bool isLeft = eye == 0;
+                init(scene);
+
+                timer.start();
+                for(int k = 0; k < iterations; k++) {
+                    iterate(scene, isLeft);
+                    std::cout << progressbar(k + 1, iterations) << " " << percentage(k + 1, iterations) << '\r' << std::flush;
+                }
+                std::cout << std::endl;
+                timer.stop("Rendering Finished");
+
+                resolve(1);
+                cam->film->gamma_correction();
+                if(!cam->two_eyes)
+                    cam->film->ppm_output("output.ppm");
+                else
+                    cam->film->ppm_output(isLeft ? "left.ppm" : "right.ppm");
+            }
+        };
+        //1反復ごとに呼ばれる 表示側が呼ばれた回数で割るのでその分を掛けておく
+        void compute(const Scene& scene) const {
+            if(pixels.empty()) init(scene);
+            iterate(scene, true);
+            resolve(iteration);
+        };
+
+
+    private:
+        //可視点
+        struct VisiblePoint {
+            Vec3 p;
+            //法線は可視点に到達した側に向ける
+            Vec3 n, s, t;
+            Vec3 wo;
+            const Material* material = nullptr;
+            //カメラからこの点までの寄与
+            RGB beta;
+        };
+
+        struct SPPMPixel {
+            float radius = 0.0f;
+            //直接光の和
+            RGB Ld;
+            VisiblePoint vp;
+            //この反復で集めたフォトンの寄与と数 フォトンの追跡中に複数のスレッドから加算される
+            RGB phi;
+            int M = 0;
+            //これまでに集めたフォトンの数(縮小率をかけたもの)と寄与
+            float N = 0.0f;
+            RGB tau;
+        };
+
+        //ハッシュグリッドのセルに登録された可視点の連結リスト
+        struct GridNode {
+            int pixel;
+            int next;
+        };
+
+        mutable std::vector<SPPMPixel> pixels;
+        mutable int iteration = 0;
+        //フォトンを放つ光源を放射束に比例して選ぶ
+        mutable std::unique_ptr<Distribution1D> lightDistribution;
+        mutable float radius0 = 0.0f;
+
+        //反復ごとに作り直すハッシュグリッド
+        mutable std::vector<GridNode> gridNodes;
+        mutable std::unique_ptr<std::atomic<int>[]> gridHeads;
+        mutable AABB gridBounds;
+        mutable int gridRes[3];
+
+
+        void init(const Scene& scene) const {
+            const AABB bounds = scene.accel->worldBound();
+            const float sceneRadius = 0.5f*(bounds.pMax - bounds.pMin).length();
+            radius0 = initialRadius > 0.0f ? initialRadius : 0.01f*sceneRadius;
+
+            pixels.assign(cam->film->width*cam->film->height, SPPMPixel());
+            for(auto& pixel : pixels)
+                pixel.radius = radius0;
+            iteration = 0;
+
+            std::vector<float> power(scene.lights.size());
+            for(size_t l = 0; l < scene.lights.size(); l++)
+                power[l] = lightPower(*scene.lights[l], sceneRadius);
+            if(!power.empty())
+                lightDistribution = std::unique_ptr<Distribution1D>(new Distribution1D(power));
+
+            gridHeads = std::unique_ptr<std::atomic<int>[]>(new std::atomic<int>[pixels.size()]);
+        };
+
+
+        void iterate(const Scene& scene, bool isLeft) const {
+            traceCameraPaths(scene, isLeft);
+            buildGrid();
+            tracePhotons(scene);
+            updatePixels();
+            iteration++;
+        };
+
+
+        //フィルムに現在の推定値のscale倍を書き込む
+        void resolve(int scale) const {
+            const long long nPhotons = (long long)iteration*photonsPerIteration;
+            for(int j = 0; j < cam->film->height; j++) {
+                for(int i = 0; i < cam->film->width; i++) {
+                    const SPPMPixel& pixel = pixels[i + cam->film->width*j];
+                    RGB L = pixel.Ld/iteration;
+                    if(nPhotons > 0)
+                        L += pixel.tau/(nPhotons*M_PI*pixel.radius*pixel.radius);
+                    cam->film->setPixel(i, j, scale*L);
+                }
+            }
+        };
+
+
+        //カメラからスペキュラーな反射を辿って可視点を求める
+        void traceCameraPaths(const Scene& scene, bool isLeft) const {
+            const int width = cam->film->width;
+            const int height = cam->film->height;
+            #pragma omp parallel for schedule(dynamic, 1)
+            for(int j = 0; j < height; j++) {
+                for(int i = 0; i < width; i++) {
+                    SPPMPixel& pixel = pixels[i + width*j];
+                    pixel.vp.material = nullptr;
+                    sampler->startPixelSample(i + width*j, iteration);
+
+                    const float rx = sampler->getNext();
+                    const float ry = sampler->getNext();
+                    const Vec2 uv = cam->rasterToUV(i + rx, j + ry);
+                    float w;
+                    Ray ray = cam->getRay(uv.x, uv.y, w, *sampler, isLeft);
+                    RGB beta(w);
+
+                    for(int depth = 0; depth <= maxDepth; depth++) {
+                        Hit res;
+                        if(!scene.intersect(ray, res)) {
+                            pixel.Ld += beta * scene.sky->getSky(ray);
+                            break;
+                        }
+                        //光源が見えるのはカメラから直接かスペキュラーな反射の後だけなので 光源サンプリングと重複しない
+                        if(res.hitPrimitive->areaLight != nullptr) {
+                            pixel.Ld += beta * res.hitPrimitive->areaLight->Le(res);
+                            break;
+                        }
+
+                        const Material* material = res.hitPrimitive->material.get();
+                        const Vec3 wo = -ray.direction;
+                        if(material->type != MATERIAL_TYPE::SPECULAR) {
+                            VisiblePoint& vp = pixel.vp;
+                            vp.p = res.hitPos;
+                            vp.n = dot(res.hitNormal, wo) < 0.0f ? -res.hitNormal : res.hitNormal;
+                            vp.s = res.dpdu;
+                            vp.t = normalize(cross(vp.s, vp.n));
+                            vp.wo = wo;
+                            vp.material = material;
+                            vp.beta = beta;
+                            pixel.Ld += beta * directLight(scene, res, vp);
+                            break;
+                        }
+
+                        //スペキュラーな反射を辿る
+                        const Vec3 n = res.hitNormal;
+                        const Vec3 s = res.dpdu;
+                        const Vec3 t = normalize(cross(s, n));
+                        Vec3 wi_local;
+                        float pdf = 1.0f;
+                        const RGB f = material->sample(worldToLocal(wo, n, s, t), wi_local, *sampler, pdf);
+                        if(iszero(wi_local) || pdf == 0.0f) break;
+                        beta *= f * std::abs(wi_local.y)/pdf;
+                        if(iszero(beta) || isnan(beta) || isinf(beta)) break;
+                        ray = Ray(res.hitPos, localToWorld(wi_local, n, s, t));
+                    }
+                }
+            }
+        };
+
+
+        //可視点での直接光 全光源を1回ずつサンプリングする
+        RGB directLight(const Scene& scene, const Hit& res, const VisiblePoint& vp) const {
+            RGB Ld;
+            const Vec3 wo_local = worldToLocal(vp.wo, vp.n, vp.s, vp.t);
+            for(const auto& light : scene.lights) {
+                float light_pdf = 1.0f;
+                Vec3 wi_light;
+                const RGB le = light->sample(res, *sampler, wi_light, light_pdf);
+                if(light_pdf == 0.0f || iszero(le)) continue;
+                const Vec3 wi_light_local = worldToLocal(wi_light, vp.n, vp.s, vp.t);
+                if(wi_light_local.y <= 0.0f) continue;
+
+                Ray shadowRay(res.hitPos, wi_light);
+                Hit shadow_res;
+                bool visible;
+                if(light->type == LIGHT_TYPE::AREA) {
+                    visible = scene.intersect(shadowRay, shadow_res) && shadow_res.hitPrimitive->areaLight.get() == light.get();
+                }
+                else {
+                    if(light->type == LIGHT_TYPE::POINT)
+                        shadowRay.tmax = (static_cast<const PointLight*>(light.get())->lightPos - res.hitPos).length();
+                    visible = !scene.intersect(shadowRay, shadow_res);
+                }
+                if(!visible) continue;
+                Ld += vp.material->f(wo_local, wi_light_local) * le/light_pdf * wi_light_local.y;
+            }
+            return Ld;
+        };
+
+
+        //可視点をその半径が重なるセル全てに登録する
+        void buildGrid() const {
+            const int nPixels = pixels.size();
+            gridBounds = AABB();
+            float maxRadius = 0.0f;
+            for(const auto& pixel : pixels) {
+                if(!pixel.vp.material) continue;
+                gridBounds = mergeAABB(gridBounds, AABB(pixel.vp.p - pixel.radius, pixel.vp.p + pixel.radius));
+                maxRadius = std::max(maxRadius, pixel.radius);
+            }
+            gridNodes.clear();
+            for(int k = 0; k < nPixels; k++)
+                gridHeads[k] = -1;
+            if(maxRadius == 0.0f) return;
+
+            //セルの一辺がおおよそ最大の半径になるようにする
+            const Vec3 diag = gridBounds.pMax - gridBounds.pMin;
+            const float maxDiag = std::max(diag.x, std::max(diag.y, diag.z));
+            const float baseRes = maxDiag/maxRadius;
+            for(int a = 0; a < 3; a++)
+                gridRes[a] = std::max(1, std::min((int)(baseRes*diag[a]/maxDiag), 1 << 20));
+
+            //各可視点が重なるセルの数を数えてから 連結リストのノードを確保する
+            std::vector<int> offsets(nPixels + 1, 0);
+            #pragma omp parallel for schedule(static)
+            for(int k = 0; k < nPixels; k++) {
+                const SPPMPixel& pixel = pixels[k];
+                if(!pixel.vp.material) continue;
+                int pMin[3], pMax[3];
+                toGrid(pixel.vp.p - pixel.radius, pMin);
+                toGrid(pixel.vp.p + pixel.radius, pMax);
+                offsets[k + 1] = (pMax[0] - pMin[0] + 1)*(pMax[1] - pMin[1] + 1)*(pMax[2] - pMin[2] + 1);
+            }
+            for(int k = 0; k < nPixels; k++)
+                offsets[k + 1] += offsets[k];
+            gridNodes.resize(offsets[nPixels]);
+
+            #pragma omp parallel for schedule(static)
+            for(int k = 0; k < nPixels; k++) {
+                const SPPMPixel& pixel = pixels[k];
+                if(!pixel.vp.material) continue;
+                int pMin[3], pMax[3];
+                toGrid(pixel.vp.p - pixel.radius, pMin);
+                toGrid(pixel.vp.p + pixel.radius, pMax);
+                int node = offsets[k];
+                for(int z = pMin[2]; z <= pMax[2]; z++) {
+                    for(int y = pMin[1]; y <= pMax[1]; y++) {
+                        for(int x = pMin[0]; x <= pMax[0]; x++) {
+                            std::atomic<int>& head = gridHeads[hashCell(x, y, z)];
+                            gridNodes[node].pixel = k;
+                            gridNodes[node].next = head.load(std::memory_order_relaxed);
+                            while(!head.compare_exchange_weak(gridNodes[node].next, node));
+                            node++;
+                        }
+                    }
+                }
+            }
+        };
+
+
+        //位置pを含むセルの添字 グリッドの外ならfalseを返す
+        bool toGrid(const Vec3& p, int c[3]) const {
+            bool inBounds = true;
+            for(int a = 0; a < 3; a++) {
+                const float extent = gridBounds.pMax[a] - gridBounds.pMin[a];
+                c[a] = extent > 0.0f ? (int)(gridRes[a]*(p[a] - gridBounds.pMin[a])/extent) : 0;
+                inBounds &= c[a] >= 0 && c[a] < gridRes[a];
+                c[a] = clamp(c[a], 0, gridRes[a] - 1);
+            }
+            return inBounds;
+        };
+        int hashCell(int x, int y, int z) const {
+            return (((uint32_t)x*73856093u) ^ ((uint32_t)y*19349663u) ^ ((uint32_t)z*83492791u)) % pixels.size();
+        };
+
+
+        //光源からフォトンを追跡し 2回目以降の衝突点で可視点に寄与を加える
+        //1回目の衝突は直接光として光源サンプリングで計算済み
+        void tracePhotons(const Scene& scene) const {
+            if(!lightDistribution || gridNodes.empty()) return;
+            #pragma omp parallel for schedule(dynamic, 1024)
+            for(int k = 0; k < photonsPerIteration; k++) {
+                //フォトンには画像のピクセルに続く番号を使う
+                sampler->startPixelSample((uint64_t)cam->film->width*cam->film->height + k, iteration);
+                float pmf;
+                const Light* light = scene.lights[lightDistribution->sampleDiscrete(sampler->getNext(), pmf)].get();
+                if(pmf == 0.0f) continue;
+                Ray ray;
+                Vec3 normal;
+                float pdfPos, pdfDir;
+                const RGB le = light->sampleLe(*sampler, ray, normal, pdfPos, pdfDir);
+                if(pdfPos == 0.0f || pdfDir == 0.0f || iszero(le)) continue;
+                const float cos_term = light->type == LIGHT_TYPE::AREA ? std::abs(dot(normal, ray.direction)) : 1.0f;
+                RGB beta = le*cos_term/(pmf*pdfPos*pdfDir);
+
+                for(int depth = 0; depth < maxDepth; depth++) {
+                    Hit res;
+                    if(!scene.intersect(ray, res)) break;
+                    //光源は光を反射しない
+                    if(res.hitPrimitive->areaLight != nullptr) break;
+                    const Material* material = res.hitPrimitive->material.get();
+                    const bool specular = material->type == MATERIAL_TYPE::SPECULAR;
+
+                    if(depth > 0 && !specular)
+                        addPhoton(res.hitPos, -ray.direction, beta);
+
+                    //次の方向をサンプリング
+                    const Vec3 wo = -ray.direction;
+                    const Vec3 n = (!specular && dot(res.hitNormal, wo) < 0.0f) ? -res.hitNormal : res.hitNormal;
+                    const Vec3 s = res.dpdu;
+                    const Vec3 t = normalize(cross(s, n));
+                    const Vec3 wo_local = worldToLocal(wo, n, s, t);
+                    Vec3 wi_local;
+                    float pdf = 1.0f;
+                    RGB f = material->sample(wo_local, wi_local, *sampler, pdf, TRANSPORT_MODE::IMPORTANCE);
+                    if(iszero(wi_local)) break;
+                    if(!specular) {
+                        f = material->f(wo_local, wi_local);
+                        pdf = material->pdf(wo_local, wi_local);
+                    }
+                    if(pdf == 0.0f) break;
+                    const RGB betaNew = beta * f * std::abs(wi_local.y)/pdf;
+
+                    //寄与の減り具合に応じたロシアンルーレット
+                    const float q = std::max(0.0f, 1.0f - luminance(betaNew)/luminance(beta));
+                    if(sampler->getNext() < q) break;
+                    beta = betaNew/(1.0f - q);
+                    if(iszero(beta) || isnan(beta) || isinf(beta)) break;
+                    ray = Ray(res.hitPos, localToWorld(wi_local, n, s, t));
+                }
+            }
+        };
+
+
+        //位置pに方向wiから届いたフォトンを半径内の可視点に加える
+        void addPhoton(const Vec3& p, const Vec3& wi, const RGB& beta) const {
+            int c[3];
+            if(!toGrid(p, c)) return;
+            for(int node = gridHeads[hashCell(c[0], c[1], c[2])]; node >= 0; node = gridNodes[node].next) {
+                SPPMPixel& pixel = pixels[gridNodes[node].pixel];
+                const VisiblePoint& vp = pixel.vp;
+                if((vp.p - p).length2() > pixel.radius*pixel.radius) continue;
+                const Vec3 wi_local = worldToLocal(wi, vp.n, vp.s, vp.t);
+                if(wi_local.y <= 0.0f) continue;
+                const RGB phi = beta * vp.material->f(worldToLocal(vp.wo, vp.n, vp.s, vp.t), wi_local);
+                #pragma omp atomic
+                pixel.phi.x += phi.x;
+                #pragma omp atomic
+                pixel.phi.y += phi.y;
+                #pragma omp atomic
+                pixel.phi.z += phi.z;
+                #pragma omp atomic
+                pixel.M++;
+            }
+        };
+
+
+        //集めたフォトンの数に応じて半径を縮め 寄与を新しい半径に合わせる
+        void updatePixels() const {
+            #pragma omp parallel for schedule(static)
+            for(size_t k = 0; k < pixels.size(); k++) {
+                SPPMPixel& pixel = pixels[k];
+                if(pixel.M > 0) {
+                    const float N = pixel.N + alpha*pixel.M;
+                    const float radius = pixel.radius*std::sqrt(N/(pixel.N + pixel.M));
+                    pixel.tau = (pixel.tau + pixel.vp.beta*pixel.phi)*(radius*radius)/(pixel.radius*pixel.radius);
+                    pixel.N = N;
+                    pixel.radius = radius;
+                    pixel.M = 0;
+                    pixel.phi = RGB(0.0f);
+                }
+                pixel.vp.material = nullptr;
+            }
+        };
+};
+#endif
@@ -0,0 +1,55 @@
+#ifndef TILE_H
+#define TILE_H
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+
+
+//画面を分割したタイル
+//[x0, x1) x [y0, y1) の範囲のピクセルを表す
+struct Tile {
+    int x0, y0;
+    int x1, y1;
+
+    Tile() {};
+    Tile(int _x0, int _y0, int _x1, int _y1) : x0(_x0), y0(_y0), x1(_x1), y1(_y1) {};
+};
+
+
+//2次元のタイル番号をビットインターリーブしたMortonコード
+inline uint32_t mortonCode(uint32_t x, uint32_t y) {
+    auto spread = [](uint32_t v) {
+        v &= 0x0000ffff;
+        v = (v | (v << 8)) & 0x00ff00ff;
+        v = (v | (v << 4)) & 0x0f0f0f0f;
+        v = (v | (v << 2)) & 0x33333333;
+        v = (v | (v << 1)) & 0x55555555;
+        return v;
+    };
+    return spread(x) | (spread(y) << 1);
+}
+
+
+//画面をtileSize四方のタイルに分割し、Morton順に並べて返す
+//隣り合うタイルが近い順に処理されるので、BVHやFilmのキャッシュが効きやすい
+inline std::vector<Tile> makeTiles(int width, int height, int tileSize) {
+    const int nx = (width + tileSize - 1)/tileSize;
+    const int ny = (height + tileSize - 1)/tileSize;
+    std::vector<std::pair<uint32_t, Tile>> keyed;
+    keyed.reserve(nx*ny);
+    for(int ty = 0; ty < ny; ty++) {
+        for(int tx = 0; tx < nx; tx++) {
+            Tile tile(tx*tileSize, ty*tileSize, std::min((tx + 1)*tileSize, width), std::min((ty + 1)*tileSize, height));
+            keyed.push_back(std::make_pair(mortonCode(tx, ty), tile));
+        }
+    }
+    std::sort(keyed.begin(), keyed.end(), [](const std::pair<uint32_t, Tile>& a, const std::pair<uint32_t, Tile>& b) {
+            return a.first < b.first;
+            });
+    std::vector<Tile> tiles;
+    tiles.reserve(keyed.size());
+    for(const auto& k : keyed)
+        tiles.push_back(k.second);
+    return tiles;
+}
+#endif
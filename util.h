@@ -49,4 +49,12 @@ inline Vec3 worldToLocal(const Vec3& w, const Vec3& n, const Vec3& s, const Vec3
 inline Vec3 localToWorld(const Vec3& w, const Vec3& n, const Vec3& s, const Vec3& t) {
     return Vec3(s.x*w.x + n.x*w.y + t.x*w.z, s.y*w.x + n.y*w.y + t.y*w.z, s.z*w.x + n.z*w.y + t.z*w.z);
 }
+//法線nから正規直交基底s, tを作る dpdu(接ベクトル)を持たない点で使う
+inline void orthonormalBasis(const Vec3& n, Vec3& s, Vec3& t) {
+    if(std::abs(n.x) > 0.9f)
+        s = normalize(cross(Vec3(0, 1, 0), n));
+    else
+        s = normalize(cross(Vec3(1, 0, 0), n));
+    t = cross(n, s);
+}
 #endif
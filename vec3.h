@@ -187,6 +187,12 @@ class Vec3 {
 using RGB = Vec3;
 
 
+//輝度(Rec.709)
+inline float luminance(const RGB& c) {
+    return 0.2126f*c.x + 0.7152f*c.y + 0.0722f*c.z;
+}
+
+
 inline Vec3 operator+(float k, const Vec3& v) {
     return v + k;
 }
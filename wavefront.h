@@ -0,0 +1,377 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+#include <omp.h>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include "integrator.h"
+
+
+//ウェーブフロント方式のパストレーシング
+//多数のパスを同時に保持し、1回の反射を以下のステージに分けてキュー全体に対して並列に処理する
+//  1. カメラレイの生成
+//  2. 全パスの交差判定
+//  3. 背景・光源に当たったパスの処理と、それ以外のパスのマテリアルごとの並べ替え
+//  4. マテリアルごとにまとめて光源サンプリングとBRDFサンプリング
+//  5. シャドウレイの一括交差判定
+//  6. 直接光の蓄積と次のレイへの更新
+//同じマテリアルの処理が連続し、各ステージのループが単純になるのでキャッシュとSIMDが効きやすい
+//結果はPathTraceExplicitと同じになる
+class WavefrontPathTrace : public Integrator {
+    public:
+        int pixelSamples;
+        int maxDepth;
+        //同時に保持するパスの数
+        //大きすぎるとパスの状態がキャッシュに乗らなくなる
+        int poolSize;
+        //Scene::lightSamplerがある場合に1頂点あたりに選ぶ光源の数
+        int lightSamples = 1;
+
+        //パスの状態 SoAで保持する
+        struct PathPool {
+            std::vector<float> ox, oy, oz;
+            std::vector<float> dx, dy, dz;
+            std::vector<float> tr, tg, tb; //throughput
+            std::vector<float> lr, lg, lb; //放射輝度
+            std::vector<float> roulette;
+            std::vector<int> depth;
+            //直前の頂点で光源サンプリングをしなかったか
+            std::vector<uint8_t> specular;
+            std::vector<Hit> hit;
+            //Samplerに渡すピクセル サンプル番号 次に使う次元
+            //ステージごとに別のスレッドが処理するので パスごとに覚えておいて続きから使う
+            std::vector<uint64_t> pixel;
+            std::vector<int> sampleIndex;
+            std::vector<uint32_t> dim;
+
+            void resize(int n) {
+                for(auto v : {&ox, &oy, &oz, &dx, &dy, &dz, &tr, &tg, &tb, &lr, &lg, &lb, &roulette})
+                    v->resize(n);
+                depth.resize(n);
+                pixel.resize(n);
+                sampleIndex.resize(n);
+                dim.resize(n);
+                specular.resize(n);
+                hit.resize(n);
+            };
+
+            Ray ray(int p) const {
+                return Ray(Vec3(ox[p], oy[p], oz[p]), Vec3(dx[p], dy[p], dz[p]));
+            };
+            void setRay(int p, const Ray& r) {
+                ox[p] = r.origin.x; oy[p] = r.origin.y; oz[p] = r.origin.z;
+                dx[p] = r.direction.x; dy[p] = r.direction.y; dz[p] = r.direction.z;
+            };
+            RGB throughput(int p) const {
+                return RGB(tr[p], tg[p], tb[p]);
+            };
+            void setThroughput(int p, const RGB& t) {
+                tr[p] = t.x; tg[p] = t.y; tb[p] = t.z;
+            };
+            void addL(int p, const RGB& c) {
+                lr[p] += c.x; lg[p] += c.y; lb[p] += c.z;
+            };
+        };
+
+        //シェーディングステージの結果 シェーディングキューと同じ並び
+        struct ShadeQueue {
+            std::vector<int> path;
+            std::vector<float> nx, ny, nz; //次のレイの方向
+            std::vector<float> kr, kg, kb; //BRDFの係数
+            std::vector<uint8_t> valid;
+
+            void resize(int n) {
+                path.resize(n);
+                for(auto v : {&nx, &ny, &nz, &kr, &kg, &kb})
+                    v->resize(n);
+                valid.resize(n);
+            };
+        };
+
+        //シャドウレイのキュー シェーディングキューの要素ごとに1頂点の光源サンプリングの回数だけ並ぶ
+        struct ShadowQueue {
+            std::vector<float> ox, oy, oz;
+            std::vector<float> dx, dy, dz;
+            std::vector<float> cr, cg, cb; //可視なら加える寄与
+            std::vector<const Light*> light;
+            std::vector<uint8_t> visible;
+
+            void resize(int n) {
+                for(auto v : {&ox, &oy, &oz, &dx, &dy, &dz, &cr, &cg, &cb})
+                    v->resize(n);
+                light.resize(n);
+                visible.resize(n);
+            };
+        };
+
+
+        WavefrontPathTrace(std::shared_ptr<Camera> _cam, std::shared_ptr<Sampler> _sampler, int _pixelSamples, int _maxDepth, int _poolSize = 1 << 16) : Integrator(_cam, _sampler), pixelSamples(_pixelSamples), maxDepth(_maxDepth), poolSize(_poolSize) {};
+
+
+        void render(const Scene& scene) const {
+            Timer timer;
+            const int nEyes = cam->two_eyes ? 2 : 1;
+            for(int eye = 0; eye < nEyes; eye++) {
+                const bool isLeft = eye == 0;
+                if(!isLeft)
+                    cam->film->clear();
+
+                timer.start();
+                renderSamples(scene, 0, pixelSamples, isLeft);
+                std::cout << std::endl;
+                timer.stop("Rendering Finished");
+
+                cam->film->divide(pixelSamples);
+                cam->film->gamma_correction();
+                if(!cam->two_eyes)
+                    cam->film->ppm_output("output.ppm");
+                else
+                    cam->film->ppm_output(isLeft ? "left.ppm" : "right.ppm");
+            }
+        };
+        void compute(const Scene& scene) const {
+            //呼ばれるたびに次のサンプル番号を使う
+            renderSamples(scene, computedSamples, computedSamples + 1, true);
+            computedSamples++;
+        };
+
+
+        //[sampleStart, sampleEnd)番目のサンプルを全ピクセルについて計算する
+        //パスはpoolSize個ずつのウェーブに分けて処理する
+        void renderSamples(const Scene& scene, int sampleStart, int sampleEnd, bool isLeft) const {
+            const int width = cam->film->width;
+            const int height = cam->film->height;
+            const long long nPixels = (long long)width*height;
+            const long long total = nPixels*(sampleEnd - sampleStart);
+            //1頂点での光源サンプリングの回数 lightSamplerがなければ全光源を1回ずつサンプリングする
+            const int nLights = scene.lightSampler ? lightSamples : scene.lights.size();
+            //シャドウレイのキューが大きくなりすぎないようにパスの数を制限する
+            const long long maxShadowRays = 1 << 24;
+            const int pool = std::max(1LL, std::min(std::min<long long>(poolSize, total), maxShadowRays/std::max(1, nLights)));
+
+            PathPool paths;
+            paths.resize(pool);
+            ShadeQueue shade;
+            shade.resize(pool);
+            ShadowQueue shadow;
+            shadow.resize((long long)pool*nLights);
+            std::vector<int> active, next;
+            active.reserve(pool);
+            next.reserve(pool);
+            std::vector<int> materialCount(scene.materials.size() + 1);
+            //パスごとの並べ替えのキー
+            std::vector<int> key(pool);
+
+            for(long long base = 0; base < total; base += pool) {
+                const int n = std::min<long long>(pool, total - base);
+
+                //1. カメラレイの生成
+                #pragma omp parallel for schedule(static)
+                for(int p = 0; p < n; p++) {
+                    const long long id = base + p;
+                    const int pix = id%nPixels;
+                    const int i = pix%width;
+                    const int j = pix/width;
+                    //右目は左目の後ろのピクセルとして扱う(TiledIntegratorのビューと同じ)
+                    paths.pixel[p] = (isLeft ? 0 : nPixels) + pix;
+                    paths.sampleIndex[p] = sampleStart + id/nPixels;
+                    sampler->startPixelSample(paths.pixel[p], paths.sampleIndex[p]);
+                    const float rx = sampler->getNext();
+                    const float ry = sampler->getNext();
+                    const Vec2 uv = cam->rasterToUV(i + rx, j + ry);
+                    float w;
+                    paths.setRay(p, cam->getRay(uv.x, uv.y, w, *sampler, isLeft));
+                    paths.setThroughput(p, RGB(w));
+                    paths.lr[p] = paths.lg[p] = paths.lb[p] = 0.0f;
+                    paths.roulette[p] = 1.0f;
+                    paths.depth[p] = 0;
+                    paths.specular[p] = 1;
+                    paths.dim[p] = sampler->currentDimension();
+                }
+                active.resize(n);
+                for(int p = 0; p < n; p++)
+                    active[p] = p;
+
+                while(!active.empty()) {
+                    extend(scene, paths, active, next, key, materialCount, shade, shadow, nLights);
+                    active.swap(next);
+                }
+
+                //ピクセルごとに蓄積する 同じピクセルのパスはnPixels間隔で並んでいる
+                #pragma omp parallel for schedule(static)
+                for(long long pix = 0; pix < std::min<long long>(nPixels, n); pix++) {
+                    const int q = (base + pix)%nPixels;
+                    RGB col;
+                    for(long long p = pix; p < n; p += nPixels)
+                        col += RGB(paths.lr[p], paths.lg[p], paths.lb[p]);
+                    cam->film->addSample(q%width, q/width, col);
+                }
+
+                const float progress = std::min<long long>(base + pool, total);
+                std::cout << progressbar(progress, total) << " " << percentage(progress, total) << '\r' << std::flush;
+            }
+        };
+
+
+        //activeのパスを1回反射させ、続くパスをnextに格納する
+        //keyはactiveの要素ごとの並べ替えのキー -1: 終了 0..nMaterials-1: シェーディングするマテリアル
+        void extend(const Scene& scene, PathPool& paths, const std::vector<int>& active, std::vector<int>& next, std::vector<int>& key, std::vector<int>& materialCount, ShadeQueue& shade, ShadowQueue& shadow, int nLights) const {
+            const int n = active.size();
+            const int nMaterials = scene.materials.size();
+
+            //2. ロシアンルーレットと交差判定
+            #pragma omp parallel for schedule(dynamic, 256)
+            for(int q = 0; q < n; q++) {
+                const int p = active[q];
+                key[q] = -1;
+                //PathTraceExplicitと同じく反射ごとに決まった次元の乱数を使う
+                sampler->startPixelSample(paths.pixel[p], paths.sampleIndex[p], paths.dim[p]);
+                sampler->startDimension(TiledIntegrator::bounceDimension(paths.depth[p]));
+                if(paths.depth[p] > 10) {
+                    const float u = sampler->getNext();
+                    paths.dim[p] = sampler->currentDimension();
+                    if(u < 1.0f - paths.roulette[p])
+                        continue;
+                    paths.roulette[p] *= 0.9f;
+                }
+                paths.dim[p] = sampler->currentDimension();
+                if(paths.depth[p] > maxDepth)
+                    continue;
+
+                const Ray ray = paths.ray(p);
+                Hit& res = paths.hit[p];
+                //3. 背景と光源の処理
+                if(!scene.intersect(ray, res)) {
+                    //環境光を光源サンプリングしている場合は二重に数えないようにする
+                    if(!scene.envLight || paths.specular[p])
+                        paths.addL(p, paths.throughput(p) * scene.sky->getSky(ray));
+                    continue;
+                }
+                if(res.hitPrimitive->areaLight != nullptr) {
+                    //直接光源に当たった場合
+                    if(paths.depth[p] == 0)
+                        paths.addL(p, paths.throughput(p) * res.hitPrimitive->areaLight->Le(res));
+                    continue;
+                }
+                key[q] = res.hitPrimitive->material->id;
+            }
+
+            //3. マテリアルごとに並べ替える(計数ソート)
+            std::fill(materialCount.begin(), materialCount.end(), 0);
+            for(int q = 0; q < n; q++) {
+                if(key[q] >= 0) materialCount[key[q] + 1]++;
+            }
+            for(int m = 0; m < nMaterials; m++)
+                materialCount[m + 1] += materialCount[m];
+            const int nShade = materialCount[nMaterials];
+            for(int q = 0; q < n; q++) {
+                if(key[q] >= 0) shade.path[materialCount[key[q]]++] = active[q];
+            }
+
+            //4. マテリアルごとにまとめてシェーディングする
+            #pragma omp parallel for schedule(static)
+            for(int q = 0; q < nShade; q++) {
+                const int p = shade.path[q];
+                const Hit& res = paths.hit[p];
+                const Material* hitMaterial = res.hitPrimitive->material.get();
+                const Vec3 wo = -Vec3(paths.dx[p], paths.dy[p], paths.dz[p]);
+                const Vec3 n = res.hitNormal;
+                const Vec3 s = res.dpdu;
+                const Vec3 t = normalize(cross(s, n));
+                const Vec3 wo_local = worldToLocal(wo, n, s, t);
+                sampler->startPixelSample(paths.pixel[p], paths.sampleIndex[p], paths.dim[p]);
+
+                //光源サンプリング シャドウレイをキューに積む
+                const bool nee = hitMaterial->type == MATERIAL_TYPE::DIFFUSE || hitMaterial->type == MATERIAL_TYPE::GLOSSY;
+                for(int l = 0; l < nLights; l++) {
+                    const long long e = (long long)q*nLights + l;
+                    shadow.cr[e] = shadow.cg[e] = shadow.cb[e] = 0.0f;
+                    if(!nee) continue;
+                    //光源を選ぶ TiledIntegrator::pickLightと同じ
+                    float light_pmf = 1.0f;
+                    const Light* light;
+                    if(scene.lightSampler) {
+                        light = scene.lightSampler->sample(res, sampler->getNext(), light_pmf);
+                        light_pmf *= lightSamples;
+                    }
+                    else {
+                        light = scene.lights[l].get();
+                    }
+                    if(light == nullptr) continue;
+                    shadow.light[e] = light;
+                    float light_pdf = 1.0f;
+                    Vec3 wi_light;
+                    const RGB le = light->sample(res, *sampler, wi_light, light_pdf);
+                    light_pdf *= light_pmf;
+                    const Vec3 wi_light_local = worldToLocal(wi_light, n, s, t);
+                    const RGB c = hitMaterial->f(wo_local, wi_light_local) * le/light_pdf * std::max(wi_light_local.y, 0.0f);
+                    shadow.ox[e] = res.hitPos.x; shadow.oy[e] = res.hitPos.y; shadow.oz[e] = res.hitPos.z;
+                    shadow.dx[e] = wi_light.x; shadow.dy[e] = wi_light.y; shadow.dz[e] = wi_light.z;
+                    shadow.cr[e] = c.x; shadow.cg[e] = c.y; shadow.cb[e] = c.z;
+                }
+
+                //BRDFサンプリング
+                Vec3 wi_local;
+                float brdf_pdf = 1.0f;
+                const RGB brdf_f = hitMaterial->sample(wo_local, wi_local, *sampler, brdf_pdf);
+                paths.dim[p] = sampler->currentDimension();
+                shade.valid[q] = 0;
+                if(iszero(wi_local)) continue;
+                const Vec3 wi = localToWorld(wi_local, n, s, t);
+                const RGB k = abs(1.0f/(paths.roulette[p]*brdf_pdf) * std::abs(wi_local.y) * brdf_f);
+                if(isnan(k) || isinf(k)) continue;
+                shade.nx[q] = wi.x; shade.ny[q] = wi.y; shade.nz[q] = wi.z;
+                shade.kr[q] = k.x; shade.kg[q] = k.y; shade.kb[q] = k.z;
+                shade.valid[q] = 1;
+            }
+
+            //5. シャドウレイの一括交差判定
+            const long long nShadow = (long long)nShade*nLights;
+            #pragma omp parallel for schedule(dynamic, 256)
+            for(long long e = 0; e < nShadow; e++) {
+                shadow.visible[e] = 0;
+                if(shadow.cr[e] == 0.0f && shadow.cg[e] == 0.0f && shadow.cb[e] == 0.0f) continue;
+                const Light* light = shadow.light[e];
+                Ray shadowRay(Vec3(shadow.ox[e], shadow.oy[e], shadow.oz[e]), Vec3(shadow.dx[e], shadow.dy[e], shadow.dz[e]));
+                //点光源より向こうの物体には遮られない
+                if(light->type == LIGHT_TYPE::POINT)
+                    shadowRay.tmax = (static_cast<const PointLight*>(light)->lightPos - shadowRay.origin).length();
+                Hit shadow_res;
+                const bool hit = scene.intersect(shadowRay, shadow_res);
+                if(light->type == LIGHT_TYPE::AREA)
+                    shadow.visible[e] = hit && shadow_res.hitPrimitive->areaLight.get() == light;
+                else
+                    shadow.visible[e] = !hit;
+            }
+
+            //6. 直接光の蓄積と次のレイへの更新
+            #pragma omp parallel for schedule(static)
+            for(int q = 0; q < nShade; q++) {
+                const int p = shade.path[q];
+                //PathTraceExplicitと同じく、BRDFサンプリングに失敗した頂点の直接光は捨てる
+                if(!shade.valid[q]) continue;
+                RGB Ld;
+                for(int l = 0; l < nLights; l++) {
+                    const long long e = (long long)q*nLights + l;
+                    if(shadow.visible[e])
+                        Ld += RGB(shadow.cr[e], shadow.cg[e], shadow.cb[e]);
+                }
+                const RGB throughput = paths.throughput(p);
+                paths.addL(p, throughput * Ld);
+                paths.setThroughput(p, throughput * RGB(shade.kr[q], shade.kg[q], shade.kb[q]));
+                paths.setRay(p, Ray(paths.hit[p].hitPos, Vec3(shade.nx[q], shade.ny[q], shade.nz[q])));
+                paths.depth[p]++;
+                paths.specular[p] = paths.hit[p].hitPrimitive->material->type == MATERIAL_TYPE::SPECULAR;
+            }
+
+            next.clear();
+            for(int q = 0; q < nShade; q++) {
+                if(shade.valid[q]) next.push_back(shade.path[q]);
+            }
+        };
+
+
+    private:
+        mutable int computedSamples = 0;
+};
+#endif